@@ -20,6 +20,9 @@ static int throtl_quantum = 32;
 /* Throttling is performed over 100ms slice and after that slice is renewed */
 static unsigned long throtl_slice = HZ/10;	/* 100 ms */
 
+/* A cpu is handed 1/8th of a slice's budget of a group at a time */
+static int throtl_token_shift = 3;
+
 /* A workqueue to queue throttle related work */
 static struct workqueue_struct *kthrotld_workqueue;
 static void throtl_schedule_delayed_work(struct throtl_data *td,
@@ -37,6 +40,21 @@ struct throtl_rb_root {
 
 #define rb_entry_tg(node)	rb_entry((node), struct throtl_grp, rb_node)
 
+/*
+ * Budget handed to one cpu by the slow path.  It has already been charged
+ * to the group and its ancestors, so while there are tokens left bios can
+ * be let through without taking the queue lock.  Tokens are only good
+ * for the slice they were charged to.  The lock is only ever contended
+ * when the slow path takes back the tokens of an idle cpu.
+ */
+struct throtl_bucket {
+	spinlock_t lock;
+	uint64_t bytes[2];		/* -1 if bps are unlimited */
+	unsigned int ios[2];		/* -1 if iops are unlimited */
+	unsigned int gen[2];		/* tg->token_gen when handed out */
+	unsigned long expires[2];
+};
+
 struct throtl_grp {
 	/* List of throtl groups on the request queue*/
 	struct hlist_node tg_node;
@@ -78,6 +96,24 @@ struct throtl_grp {
 
 	/* Some throttle limits got updated for the group */
 	bool limits_changed;
+
+	/*
+	 * Group of the parent cgroup.  A bio has to be within the limits of
+	 * its group and all of its ancestors.  NULL for the root group.
+	 */
+	struct throtl_grp *parent;
+
+	/* Per cpu tokens, NULL until kthrotld gets round to allocating them */
+	struct throtl_bucket __percpu *buckets;
+	struct list_head bucket_alloc_node;
+
+	/* Bumped to invalidate handed out tokens */
+	unsigned int token_gen[2];
+	/* Tokens of the current generation may be sitting in buckets */
+	bool tokens_out[2];
+
+	/* The fast path looks groups up under rcu, so free them after it */
+	struct rcu_head rcu_head;
 };
 
 struct throtl_data
@@ -103,6 +139,13 @@ struct throtl_data
 	struct delayed_work throtl_work;
 
 	atomic_t limits_changed;
+
+	/*
+	 * Groups are created under the queue lock, so their per cpu
+	 * buckets are allocated later from this work.
+	 */
+	struct list_head bucket_alloc_list;
+	struct work_struct bucket_alloc_work;
 };
 
 enum tg_state_flags {
@@ -151,19 +194,65 @@ static inline struct throtl_grp *throtl_ref_get_tg(struct throtl_grp *tg)
 	return tg;
 }
 
+static void throtl_free_tg(struct rcu_head *head)
+{
+	struct throtl_grp *tg = container_of(head, struct throtl_grp, rcu_head);
+
+	free_percpu(tg->buckets);
+	kfree(tg);
+}
+
 static void throtl_put_tg(struct throtl_grp *tg)
 {
+	struct throtl_grp *parent;
+
 	BUG_ON(atomic_read(&tg->ref) <= 0);
 	if (!atomic_dec_and_test(&tg->ref))
 		return;
-	kfree(tg);
+
+	/*
+	 * blk_throtl_bio() may still be looking at the group, or walking
+	 * up from a child to it, under rcu_read_lock().
+	 */
+	parent = tg->parent;
+	call_rcu(&tg->rcu_head, throtl_free_tg);
+
+	/* Drop the reference the group had on its parent */
+	if (parent)
+		throtl_put_tg(parent);
+}
+
+/* Does neither the group nor any ancestor limit @rw? */
+static bool tg_no_rule_group(struct throtl_grp *tg, bool rw)
+{
+	for (; tg; tg = tg->parent)
+		if (tg->bps[rw] != -1 || tg->iops[rw] != -1)
+			return false;
+
+	return true;
+}
+
+/*
+ * Find the group of the current task without allocating it, so it can be
+ * done under rcu_read_lock() alone.  The group may be unlinked at any
+ * time, but it is only freed after a grace period.
+ */
+static struct throtl_grp *throtl_find_tg(struct throtl_data *td)
+{
+	struct cgroup *cgroup = task_cgroup(current, blkio_subsys_id);
+	struct blkio_cgroup *blkcg = cgroup_to_blkio_cgroup(cgroup);
+
+	if (blkcg == &blkio_root_cgroup)
+		return &td->root_tg;
+
+	return tg_of_blkg(blkiocg_lookup_group(blkcg, td));
 }
 
 static struct throtl_grp * throtl_find_alloc_tg(struct throtl_data *td,
 			struct cgroup *cgroup)
 {
 	struct blkio_cgroup *blkcg = cgroup_to_blkio_cgroup(cgroup);
-	struct throtl_grp *tg = NULL;
+	struct throtl_grp *tg = NULL, *parent;
 	void *key = td;
 	struct backing_dev_info *bdi = &td->queue->backing_dev_info;
 	unsigned int major, minor;
@@ -193,6 +282,15 @@ static struct throtl_grp * throtl_find_alloc_tg(struct throtl_data *td,
 	if (tg)
 		goto done;
 
+	/*
+	 * A group can't be created without its parent: limits set higher
+	 * up the hierarchy would not apply to it.  The root cgroup always
+	 * maps to root_tg, so this terminates.
+	 */
+	parent = throtl_find_alloc_tg(td, cgroup->parent);
+	if (!parent)
+		goto done;
+
 	tg = kzalloc_node(sizeof(*tg), GFP_ATOMIC, td->queue->node);
 	if (!tg)
 		goto done;
@@ -201,6 +299,7 @@ static struct throtl_grp * throtl_find_alloc_tg(struct throtl_data *td,
 	RB_CLEAR_NODE(&tg->rb_node);
 	bio_list_init(&tg->bio_lists[0]);
 	bio_list_init(&tg->bio_lists[1]);
+	INIT_LIST_HEAD(&tg->bucket_alloc_node);
 
 	/*
 	 * Take the initial reference that will be released on destroy
@@ -220,8 +319,13 @@ static struct throtl_grp * throtl_find_alloc_tg(struct throtl_data *td,
 	tg->iops[READ] = blkcg_get_read_iops(blkcg, tg->blkg.dev);
 	tg->iops[WRITE] = blkcg_get_write_iops(blkcg, tg->blkg.dev);
 
+	tg->parent = throtl_ref_get_tg(parent);
+
 	hlist_add_head(&tg->tg_node, &td->tg_list);
 	td->nr_undestroyed_grps++;
+
+	list_add_tail(&tg->bucket_alloc_node, &td->bucket_alloc_list);
+	queue_work(kthrotld_workqueue, &td->bucket_alloc_work);
 done:
 	return tg;
 }
@@ -362,6 +466,9 @@ throtl_start_new_slice(struct throtl_data *td, struct throtl_grp *tg, bool rw)
 	tg->io_disp[rw] = 0;
 	tg->slice_start[rw] = jiffies;
 	tg->slice_end[rw] = jiffies + throtl_slice;
+	/* Tokens charged to the old slice are no good any more */
+	tg->token_gen[rw]++;
+	tg->tokens_out[rw] = false;
 	throtl_log_tg(td, tg, "[%c] new slice start=%lu end=%lu jiffies=%lu",
 			rw == READ ? 'R' : 'W', tg->slice_start[rw],
 			tg->slice_end[rw], jiffies);
@@ -544,24 +651,13 @@ static bool tg_with_in_bps_limit(struct throtl_data *td, struct throtl_grp *tg,
 	return 0;
 }
 
-/*
- * Returns whether one can dispatch a bio or not. Also returns approx number
- * of jiffies to wait before this bio is with-in IO rate and can be dispatched
- */
-static bool tg_may_dispatch(struct throtl_data *td, struct throtl_grp *tg,
+/* Like tg_may_dispatch(), but only considering the limits of @tg itself */
+static bool tg_may_dispatch_one(struct throtl_data *td, struct throtl_grp *tg,
 				struct bio *bio, unsigned long *wait)
 {
 	bool rw = bio_data_dir(bio);
 	unsigned long bps_wait = 0, iops_wait = 0, max_wait = 0;
 
-	/*
- 	 * Currently whole state machine of group depends on first bio
-	 * queued in the group bio list. So one should not be calling
-	 * this function with a different bio if there are other bios
-	 * queued.
-	 */
-	BUG_ON(tg->nr_queued[rw] && bio != bio_list_peek(&tg->bio_lists[rw]));
-
 	/* If tg->bps = -1, then BW is unlimited */
 	if (tg->bps[rw] == -1 && tg->iops[rw] == -1) {
 		if (wait)
@@ -599,14 +695,49 @@ static bool tg_may_dispatch(struct throtl_data *td, struct throtl_grp *tg,
 	return 0;
 }
 
+/*
+ * Returns whether one can dispatch a bio or not. Also returns approx number
+ * of jiffies to wait before this bio is with-in IO rate and can be dispatched
+ */
+static bool tg_may_dispatch(struct throtl_data *td, struct throtl_grp *tg,
+				struct bio *bio, unsigned long *wait)
+{
+	bool rw = bio_data_dir(bio);
+	unsigned long level_wait, max_wait = 0;
+	bool ret = 1;
+
+	/*
+ 	 * Currently whole state machine of group depends on first bio
+	 * queued in the group bio list. So one should not be calling
+	 * this function with a different bio if there are other bios
+	 * queued.
+	 */
+	BUG_ON(tg->nr_queued[rw] && bio != bio_list_peek(&tg->bio_lists[rw]));
+
+	/* Every ancestor has to allow the bio too, wait for the slowest */
+	for (; tg; tg = tg->parent) {
+		if (!tg_may_dispatch_one(td, tg, bio, &level_wait)) {
+			ret = 0;
+			max_wait = max(max_wait, level_wait);
+		}
+	}
+
+	if (wait)
+		*wait = max_wait;
+	return ret;
+}
+
 static void throtl_charge_bio(struct throtl_grp *tg, struct bio *bio)
 {
 	bool rw = bio_data_dir(bio);
 	bool sync = bio->bi_rw & REQ_SYNC;
+	struct throtl_grp *t;
 
-	/* Charge the bio to the group */
-	tg->bytes_disp[rw] += bio->bi_size;
-	tg->io_disp[rw]++;
+	/* Charge the bio to the group and its ancestors */
+	for (t = tg; t; t = t->parent) {
+		t->bytes_disp[rw] += bio->bi_size;
+		t->io_disp[rw]++;
+	}
 
 	/*
 	 * TODO: This will take blkg->stats_lock. Figure out a way
@@ -615,6 +746,240 @@ static void throtl_charge_bio(struct throtl_grp *tg, struct bio *bio)
 	blkiocg_update_dispatch_stats(&tg->blkg, bio->bi_size, rw, sync);
 }
 
+/*
+ * Per cpu tokens.  Called with irqs disabled, either under the queue lock
+ * or from the lockless fast path; both only touch this cpu's bucket.
+ */
+static bool throtl_bucket_valid(struct throtl_grp *tg,
+				struct throtl_bucket *b, bool rw)
+{
+	return b->gen[rw] == tg->token_gen[rw] &&
+	       time_before(jiffies, b->expires[rw]);
+}
+
+static bool throtl_consume_tokens(struct throtl_grp *tg, struct bio *bio)
+{
+	struct throtl_bucket __percpu *buckets = ACCESS_ONCE(tg->buckets);
+	bool rw = bio_data_dir(bio);
+	struct throtl_bucket *b;
+	unsigned long flags;
+	bool ret = false;
+
+	/* Don't overtake bios that are already queued */
+	if (!buckets || tg->nr_queued[rw])
+		return false;
+
+	local_irq_save(flags);
+	b = this_cpu_ptr(buckets);
+	spin_lock(&b->lock);
+	if (throtl_bucket_valid(tg, b, rw) &&
+	    b->bytes[rw] >= bio->bi_size && b->ios[rw]) {
+		if (b->bytes[rw] != -1)
+			b->bytes[rw] -= bio->bi_size;
+		if (b->ios[rw] != -1)
+			b->ios[rw]--;
+		ret = true;
+	}
+	spin_unlock(&b->lock);
+	local_irq_restore(flags);
+
+	return ret;
+}
+
+/* Can @bytes and @ios more be dispatched in the current slice of @tg? */
+static bool tg_may_charge(struct throtl_grp *tg, bool rw, uint64_t bytes,
+			  unsigned int ios)
+{
+	unsigned long jiffy_elapsed_rnd = jiffies - tg->slice_start[rw];
+	u64 tmp;
+
+	if (!jiffy_elapsed_rnd)
+		jiffy_elapsed_rnd = throtl_slice;
+	jiffy_elapsed_rnd = roundup(jiffy_elapsed_rnd, throtl_slice);
+
+	if (tg->bps[rw] != -1 && bytes != -1) {
+		tmp = tg->bps[rw] * jiffy_elapsed_rnd;
+		do_div(tmp, HZ);
+		if (tg->bytes_disp[rw] + bytes > tmp)
+			return false;
+	}
+
+	if (tg->iops[rw] != -1 && ios != -1) {
+		tmp = (u64)tg->iops[rw] * jiffy_elapsed_rnd;
+		do_div(tmp, HZ);
+		if (tg->io_disp[rw] + ios > tmp)
+			return false;
+	}
+
+	return true;
+}
+
+/* Charge (or with @sign < 0, refund) tokens to @tg and its ancestors */
+static void throtl_charge_tokens(struct throtl_grp *tg, bool rw,
+				 uint64_t bytes, unsigned int ios, int sign)
+{
+	for (; tg; tg = tg->parent) {
+		if (bytes != -1) {
+			if (sign > 0)
+				tg->bytes_disp[rw] += bytes;
+			else
+				tg->bytes_disp[rw] -= min(bytes, tg->bytes_disp[rw]);
+		}
+		if (ios != -1) {
+			if (sign > 0)
+				tg->io_disp[rw] += ios;
+			else
+				tg->io_disp[rw] -= min(ios, tg->io_disp[rw]);
+		}
+	}
+}
+
+/*
+ * Called under the queue lock after a bio of @tg was let through: hand
+ * this cpu a share of the smallest budget along the hierarchy so that
+ * the next bios can skip the queue lock.
+ */
+static void throtl_refill_tokens(struct throtl_grp *tg, bool rw)
+{
+	struct throtl_bucket *b;
+	struct throtl_grp *t;
+	uint64_t bytes = -1, tmp;
+	unsigned int ios = -1;
+	unsigned long expires = jiffies + throtl_slice;
+
+	if (!tg->buckets)
+		return;
+
+	for (t = tg; t; t = t->parent) {
+		if (t->bps[rw] == -1 && t->iops[rw] == -1)
+			continue;
+
+		if (t->bps[rw] != -1) {
+			tmp = t->bps[rw] * throtl_slice;
+			do_div(tmp, HZ);
+			bytes = min(bytes, tmp >> throtl_token_shift);
+		}
+
+		if (t->iops[rw] != -1) {
+			tmp = (u64)t->iops[rw] * throtl_slice;
+			do_div(tmp, HZ);
+			ios = min_t(u64, ios, tmp >> throtl_token_shift);
+		}
+
+		if (time_before(t->slice_end[rw], expires))
+			expires = t->slice_end[rw];
+	}
+
+	/* Limits too low to hand out in batches */
+	if (!bytes || !ios)
+		return;
+
+	/*
+	 * Give back what is left of the last batch.  Expired tokens of
+	 * this generation were charged to the current slice as well.
+	 */
+	b = this_cpu_ptr(tg->buckets);
+	spin_lock(&b->lock);
+	if (b->gen[rw] == tg->token_gen[rw])
+		throtl_charge_tokens(tg, rw, b->bytes[rw], b->ios[rw], -1);
+	b->bytes[rw] = 0;
+	b->ios[rw] = 0;
+
+	for (t = tg; t; t = t->parent)
+		if (!tg_may_charge(t, rw, bytes, ios))
+			goto out;
+
+	throtl_charge_tokens(tg, rw, bytes, ios, 1);
+	b->bytes[rw] = bytes;
+	b->ios[rw] = ios;
+	b->gen[rw] = tg->token_gen[rw];
+	b->expires[rw] = expires;
+	tg->tokens_out[rw] = true;
+out:
+	spin_unlock(&b->lock);
+}
+
+/*
+ * Called under the queue lock when a bio of @tg doesn't fit: take back
+ * the tokens other cpus hold for @tg, so that budget handed to cpus that
+ * went idle isn't lost to the group until the slice ends.  Returns true
+ * if there were any.
+ */
+static bool throtl_reclaim_tokens(struct throtl_grp *tg, bool rw)
+{
+	struct throtl_bucket *b;
+	bool reclaimed = false;
+	int cpu;
+
+	if (!tg->buckets || !tg->tokens_out[rw])
+		return false;
+
+	for_each_possible_cpu(cpu) {
+		b = per_cpu_ptr(tg->buckets, cpu);
+		spin_lock(&b->lock);
+		if (b->gen[rw] == tg->token_gen[rw] &&
+		    (b->bytes[rw] || b->ios[rw])) {
+			throtl_charge_tokens(tg, rw, b->bytes[rw],
+					     b->ios[rw], -1);
+			reclaimed = true;
+		}
+		b->bytes[rw] = 0;
+		b->ios[rw] = 0;
+		spin_unlock(&b->lock);
+	}
+	tg->tokens_out[rw] = false;
+
+	return reclaimed;
+}
+
+static struct throtl_bucket __percpu *throtl_alloc_buckets(void)
+{
+	struct throtl_bucket __percpu *buckets;
+	int cpu;
+
+	buckets = alloc_percpu(struct throtl_bucket);
+	if (buckets)
+		for_each_possible_cpu(cpu)
+			spin_lock_init(&per_cpu_ptr(buckets, cpu)->lock);
+
+	return buckets;
+}
+
+static void throtl_bucket_alloc_fn(struct work_struct *work)
+{
+	struct throtl_data *td = container_of(work, struct throtl_data,
+					      bucket_alloc_work);
+	struct request_queue *q = td->queue;
+	struct throtl_bucket __percpu *buckets;
+	struct throtl_grp *tg;
+
+	while (1) {
+		/*
+		 * On failure the remaining groups just go without tokens
+		 * until the next group gets created.
+		 */
+		buckets = throtl_alloc_buckets();
+		if (!buckets)
+			return;
+
+		spin_lock_irq(q->queue_lock);
+		if (list_empty(&td->bucket_alloc_list)) {
+			spin_unlock_irq(q->queue_lock);
+			free_percpu(buckets);
+			return;
+		}
+
+		tg = list_first_entry(&td->bucket_alloc_list,
+				      struct throtl_grp, bucket_alloc_node);
+		list_del_init(&tg->bucket_alloc_node);
+
+		/* The fast path reads tg->buckets without the queue lock */
+		smp_wmb();
+		tg->buckets = buckets;
+		spin_unlock_irq(q->queue_lock);
+	}
+}
+
 static void throtl_add_bio_tg(struct throtl_data *td, struct throtl_grp *tg,
 			struct bio *bio)
 {
@@ -665,7 +1030,8 @@ static void tg_dispatch_one_bio(struct throtl_data *td, struct throtl_grp *tg,
 	bio_list_add(bl, bio);
 	bio->bi_rw |= REQ_THROTTLED;
 
-	throtl_trim_slice(td, tg, rw);
+	for (; tg; tg = tg->parent)
+		throtl_trim_slice(td, tg, rw);
 }
 
 static int throtl_dispatch_tg(struct throtl_data *td, struct throtl_grp *tg,
@@ -844,6 +1210,7 @@ throtl_destroy_tg(struct throtl_data *td, struct throtl_grp *tg)
 	BUG_ON(hlist_unhashed(&tg->tg_node));
 
 	hlist_del_init(&tg->tg_node);
+	list_del_init(&tg->bucket_alloc_node);
 
 	/*
 	 * Put the reference taken at the time of creation so that when all
@@ -871,6 +1238,7 @@ static void throtl_release_tgs(struct throtl_data *td)
 
 static void throtl_td_free(struct throtl_data *td)
 {
+	free_percpu(td->root_tg.buckets);
 	kfree(td);
 }
 
@@ -913,6 +1281,7 @@ static void throtl_update_blkio_group_read_bps(void *key,
 	struct throtl_data *td = key;
 
 	tg_of_blkg(blkg)->bps[READ] = read_bps;
+	tg_of_blkg(blkg)->token_gen[READ]++;
 	/* Make sure read_bps is updated before setting limits_changed */
 	smp_wmb();
 	tg_of_blkg(blkg)->limits_changed = true;
@@ -932,6 +1301,7 @@ static void throtl_update_blkio_group_write_bps(void *key,
 	struct throtl_data *td = key;
 
 	tg_of_blkg(blkg)->bps[WRITE] = write_bps;
+	tg_of_blkg(blkg)->token_gen[WRITE]++;
 	smp_wmb();
 	tg_of_blkg(blkg)->limits_changed = true;
 	smp_mb__before_atomic_inc();
@@ -946,6 +1316,7 @@ static void throtl_update_blkio_group_read_iops(void *key,
 	struct throtl_data *td = key;
 
 	tg_of_blkg(blkg)->iops[READ] = read_iops;
+	tg_of_blkg(blkg)->token_gen[READ]++;
 	smp_wmb();
 	tg_of_blkg(blkg)->limits_changed = true;
 	smp_mb__before_atomic_inc();
@@ -960,6 +1331,7 @@ static void throtl_update_blkio_group_write_iops(void *key,
 	struct throtl_data *td = key;
 
 	tg_of_blkg(blkg)->iops[WRITE] = write_iops;
+	tg_of_blkg(blkg)->token_gen[WRITE]++;
 	smp_wmb();
 	tg_of_blkg(blkg)->limits_changed = true;
 	smp_mb__before_atomic_inc();
@@ -973,6 +1345,7 @@ void throtl_shutdown_timer_wq(struct request_queue *q)
 	struct throtl_data *td = q->td;
 
 	cancel_delayed_work_sync(&td->throtl_work);
+	cancel_work_sync(&td->bucket_alloc_work);
 }
 
 static struct blkio_policy_type blkio_policy_throtl = {
@@ -1002,6 +1375,23 @@ int blk_throtl_bio(struct request_queue *q, struct bio **biop)
 		return 0;
 	}
 
+	/*
+	 * Fast path: if neither the group nor its ancestors limit this
+	 * direction, or this cpu still has tokens for the group, there is
+	 * no need for the queue lock.  Groups and their buckets are freed
+	 * through rcu, so they stay valid until rcu_read_unlock() even if
+	 * the task moves and the cgroup is removed meanwhile.
+	 */
+	rcu_read_lock();
+	tg = throtl_find_tg(td);
+	if (tg && (tg_no_rule_group(tg, rw) || throtl_consume_tokens(tg, bio))) {
+		blkiocg_update_dispatch_stats(&tg->blkg, bio->bi_size, rw,
+					      bio->bi_rw & REQ_SYNC);
+		rcu_read_unlock();
+		return 0;
+	}
+	rcu_read_unlock();
+
 	spin_lock_irq(q->queue_lock);
 	tg = throtl_get_tg(td);
 
@@ -1020,9 +1410,15 @@ int blk_throtl_bio(struct request_queue *q, struct bio **biop)
 		goto queue_bio;
 	}
 
-	/* Bio is with-in rate limit of group */
-	if (tg_may_dispatch(td, tg, bio, NULL)) {
+	/*
+	 * Bio is with-in rate limit of group, possibly once the tokens
+	 * idle cpus hold for the group are taken back.
+	 */
+	if (tg_may_dispatch(td, tg, bio, NULL) ||
+	    (throtl_reclaim_tokens(tg, rw) &&
+	     tg_may_dispatch(td, tg, bio, NULL))) {
 		throtl_charge_bio(tg, bio);
+		throtl_refill_tokens(tg, rw);
 		goto out;
 	}
 
@@ -1059,6 +1455,8 @@ int blk_throtl_init(struct request_queue *q)
 	INIT_HLIST_HEAD(&td->tg_list);
 	td->tg_service_tree = THROTL_RB_ROOT;
 	atomic_set(&td->limits_changed, 0);
+	INIT_LIST_HEAD(&td->bucket_alloc_list);
+	INIT_WORK(&td->bucket_alloc_work, throtl_bucket_alloc_fn);
 
 	/* Init root group */
 	tg = &td->root_tg;
@@ -1066,6 +1464,10 @@ int blk_throtl_init(struct request_queue *q)
 	RB_CLEAR_NODE(&tg->rb_node);
 	bio_list_init(&tg->bio_lists[0]);
 	bio_list_init(&tg->bio_lists[1]);
+	INIT_LIST_HEAD(&tg->bucket_alloc_node);
+
+	/* Tokens are an optimisation, carry on without them */
+	tg->buckets = throtl_alloc_buckets();
 
 	/* Practically unlimited BW */
 	tg->bps[0] = tg->bps[1] = -1;
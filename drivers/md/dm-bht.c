@@ -9,6 +9,7 @@
 
 #include <asm/atomic.h>
 #include <asm/page.h>
+#include <linux/bitmap.h>
 #include <linux/bitops.h>  /* for fls() */
 #include <linux/bug.h>
 #include <linux/cpumask.h>  /* nr_cpu_ids */
@@ -213,6 +214,10 @@ int dm_bht_create(struct dm_bht *bht, unsigned int block_count,
 	int cpu = 0;
 
 	bht->have_salt = false;
+	bht->verified_map = NULL;
+	bht->verified_map_blocks = 0;
+	atomic_long_set(&bht->verified_hits, 0);
+	atomic_long_set(&bht->verified_misses, 0);
 
 	/* Setup the hash first. Its length determines much of the bht layout */
 	for (cpu = 0; cpu < nr_cpu_ids; ++cpu) {
@@ -424,6 +429,26 @@ void dm_bht_read_completed(struct dm_bht_entry *entry, int status)
 }
 EXPORT_SYMBOL(dm_bht_read_completed);
 
+/**
+ * dm_bht_read_cancelled
+ * @entry:	pointer to the entry whose read was never started
+ * For optional reads, like prefetches, that a read_cb chose to skip.
+ * The entry becomes unallocated again, so the next dm_bht_populate()
+ * covering it retries the read.
+ */
+void dm_bht_read_cancelled(struct dm_bht_entry *entry)
+{
+	u8 *nodes = entry->nodes;
+
+	BUG_ON(atomic_read(&entry->state) != DM_BHT_ENTRY_PENDING);
+	entry->nodes = NULL;
+	/* The next populate may claim the entry as soon as it is set */
+	smp_wmb();
+	atomic_set(&entry->state, DM_BHT_ENTRY_UNALLOCATED);
+	free_page((unsigned long)nodes);
+}
+EXPORT_SYMBOL(dm_bht_read_cancelled);
+
 /**
  * dm_bht_write_completed
  * @entry:	pointer to the entry that's been loaded
@@ -825,9 +850,26 @@ EXPORT_SYMBOL(dm_bht_populate);
 int dm_bht_verify_block(struct dm_bht *bht, unsigned int block,
 			struct page *pg, unsigned int offset)
 {
+	bool cached = bht->verified_map && block < bht->verified_map_blocks;
+	int r;
+
 	BUG_ON(offset != 0);
 
-	return  dm_bht_verify_path(bht, block, pg, offset);
+	if (cached && test_bit(block, bht->verified_map)) {
+		atomic_long_inc(&bht->verified_hits);
+		return 0;
+	}
+
+	r = dm_bht_verify_path(bht, block, pg, offset);
+	if (!cached)
+		return r;
+
+	atomic_long_inc(&bht->verified_misses);
+	if (r == 0)
+		set_bit(block, bht->verified_map);
+	else
+		dm_bht_invalidate_verified_map(bht);
+	return r;
 }
 EXPORT_SYMBOL(dm_bht_verify_block);
 
@@ -868,6 +910,8 @@ int dm_bht_destroy(struct dm_bht *bht)
 		bht->levels[depth].entries = NULL;
 	}
 	kfree(bht->levels);
+	kfree(bht->verified_map);
+	bht->verified_map = NULL;
 	for (cpu = 0; cpu < nr_cpu_ids; ++cpu)
 		if (bht->hash_desc[cpu].tfm)
 			crypto_free_hash(bht->hash_desc[cpu].tfm);
@@ -978,3 +1022,48 @@ int dm_bht_salt(struct dm_bht *bht, char *hexsalt)
 	dm_bht_bin_to_hex(bht->salt, (u8 *)hexsalt, sizeof(bht->salt));
 	return 0;
 }
+
+/**
+ * dm_bht_enable_verified_map - remember blocks which passed verification
+ * @bht:	pointer to a dm_bht_create()d bht
+ * @max_bytes:	upper bound on the memory used by the map
+ *
+ * Once a block has been verified, dm_bht_verify_block() returns success
+ * for it without hashing the data again.  This trusts that the data device
+ * does not change after a block is first read; any verification failure
+ * clears the whole map.  Blocks beyond what fits in @max_bytes are always
+ * hashed.
+ *
+ * Must be called before @bht is used for verification.  Returns 0 on
+ * success.
+ */
+int dm_bht_enable_verified_map(struct dm_bht *bht, size_t max_bytes)
+{
+	size_t blocks = min_t(size_t, bht->block_count,
+			      (max_bytes / sizeof(long)) * BITS_PER_LONG);
+
+	if (!blocks)
+		return -EINVAL;
+
+	bht->verified_map = kcalloc(BITS_TO_LONGS(blocks), sizeof(long),
+				    GFP_KERNEL);
+	if (!bht->verified_map)
+		return -ENOMEM;
+	bht->verified_map_blocks = blocks;
+	return 0;
+}
+EXPORT_SYMBOL(dm_bht_enable_verified_map);
+
+/**
+ * dm_bht_invalidate_verified_map - forget all previously verified blocks
+ * @bht:	pointer to a dm_bht_create()d bht
+ *
+ * Blocks verified concurrently may still be marked afterwards; they did
+ * pass verification.
+ */
+void dm_bht_invalidate_verified_map(struct dm_bht *bht)
+{
+	if (bht->verified_map)
+		bitmap_zero(bht->verified_map, bht->verified_map_blocks);
+}
+EXPORT_SYMBOL(dm_bht_invalidate_verified_map);
@@ -19,6 +19,8 @@
 #include <linux/workqueue.h>
 #include <linux/backing-dev.h>
 #include <linux/percpu.h>
+#include <linux/kthread.h>
+#include <linux/rbtree.h>
 #include <asm/atomic.h>
 #include <linux/scatterlist.h>
 #include <asm/page.h>
@@ -61,6 +63,12 @@ struct dm_crypt_io {
 	int error;
 	sector_t sector;
 	struct dm_crypt_io *base_io;
+
+	/* CPU the bio was submitted on, the crypto is done there too */
+	int cpu;
+
+	/* In crypt_config.write_tree while waiting to be submitted */
+	struct rb_node rb_node;
 };
 
 struct dm_crypt_request {
@@ -103,7 +111,7 @@ struct iv_lmk_private {
  * Crypt: maps a linear range of a block device
  * and encrypts / decrypts at the same time.
  */
-enum flags { DM_CRYPT_SUSPENDED, DM_CRYPT_KEY_VALID };
+enum flags { DM_CRYPT_SUSPENDED, DM_CRYPT_KEY_VALID, DM_CRYPT_SORT_WRITES };
 
 /*
  * Duplicated per-CPU state for cipher.
@@ -135,6 +143,15 @@ struct crypt_config {
 	struct workqueue_struct *io_queue;
 	struct workqueue_struct *crypt_queue;
 
+	/*
+	 * With the "sort_writes" option encrypted writes are queued here,
+	 * ordered by sector, and submitted by write_thread.  The tree is
+	 * protected by write_thread_wait.lock.
+	 */
+	struct task_struct *write_thread;
+	wait_queue_head_t write_thread_wait;
+	struct rb_root write_tree;
+
 	char *cipher;
 	char *cipher_string;
 
@@ -689,15 +706,42 @@ static u8 *iv_of_dmreq(struct crypt_config *cc,
 		crypto_ablkcipher_alignmask(any_tfm(cc)) + 1);
 }
 
-static int crypt_convert_block(struct crypt_config *cc,
+/*
+ * Number of bytes the next cipher request can cover.  Every sector gets
+ * its own IV (and key, with multiple keys), so normally that's a single
+ * sector.  Without IVs and with one key, sectors are independent and a
+ * request can span the rest of the current input and output bio_vecs.
+ */
+static unsigned crypt_request_len(struct crypt_config *cc,
+				  struct convert_context *ctx,
+				  struct bio_vec *bv_in,
+				  struct bio_vec *bv_out)
+{
+	if (cc->iv_size || cc->tfms_count > 1)
+		return 1 << SECTOR_SHIFT;
+
+	return min(bv_in->bv_len - ctx->offset_in,
+		   bv_out->bv_len - ctx->offset_out);
+}
+
+/*
+ * Sectors with their own IV still need one cipher request each, but they
+ * need not be set up and handed to the cipher one at a time.  Up to
+ * eight requests (a 4k page of sectors) are prepared first, IVs included,
+ * and then submitted back to back, so that an asynchronous cipher gets
+ * the whole batch queued before we wait on any of it.
+ */
+#define CRYPT_BATCH_MAX	8
+
+static int crypt_prepare_block(struct crypt_config *cc,
 			       struct convert_context *ctx,
 			       struct ablkcipher_request *req)
 {
 	struct bio_vec *bv_in = bio_iovec_idx(ctx->bio_in, ctx->idx_in);
 	struct bio_vec *bv_out = bio_iovec_idx(ctx->bio_out, ctx->idx_out);
 	struct dm_crypt_request *dmreq;
+	unsigned len = crypt_request_len(cc, ctx, bv_in, bv_out);
 	u8 *iv;
-	int r = 0;
 
 	dmreq = dmreq_of_req(cc, req);
 	iv = iv_of_dmreq(cc, dmreq);
@@ -705,33 +749,42 @@ static int crypt_convert_block(struct crypt_config *cc,
 	dmreq->iv_sector = ctx->sector;
 	dmreq->ctx = ctx;
 	sg_init_table(&dmreq->sg_in, 1);
-	sg_set_page(&dmreq->sg_in, bv_in->bv_page, 1 << SECTOR_SHIFT,
+	sg_set_page(&dmreq->sg_in, bv_in->bv_page, len,
 		    bv_in->bv_offset + ctx->offset_in);
 
 	sg_init_table(&dmreq->sg_out, 1);
-	sg_set_page(&dmreq->sg_out, bv_out->bv_page, 1 << SECTOR_SHIFT,
+	sg_set_page(&dmreq->sg_out, bv_out->bv_page, len,
 		    bv_out->bv_offset + ctx->offset_out);
 
-	ctx->offset_in += 1 << SECTOR_SHIFT;
+	ctx->sector += len >> SECTOR_SHIFT;
+
+	ctx->offset_in += len;
 	if (ctx->offset_in >= bv_in->bv_len) {
 		ctx->offset_in = 0;
 		ctx->idx_in++;
 	}
 
-	ctx->offset_out += 1 << SECTOR_SHIFT;
+	ctx->offset_out += len;
 	if (ctx->offset_out >= bv_out->bv_len) {
 		ctx->offset_out = 0;
 		ctx->idx_out++;
 	}
 
-	if (cc->iv_gen_ops) {
-		r = cc->iv_gen_ops->generator(cc, iv, dmreq);
-		if (r < 0)
-			return r;
-	}
-
 	ablkcipher_request_set_crypt(req, &dmreq->sg_in, &dmreq->sg_out,
-				     1 << SECTOR_SHIFT, iv);
+				     len, iv);
+
+	if (cc->iv_gen_ops)
+		return cc->iv_gen_ops->generator(cc, iv, dmreq);
+
+	return 0;
+}
+
+static int crypt_submit_block(struct crypt_config *cc,
+			      struct convert_context *ctx,
+			      struct ablkcipher_request *req)
+{
+	struct dm_crypt_request *dmreq = dmreq_of_req(cc, req);
+	int r;
 
 	if (bio_data_dir(ctx->bio_in) == WRITE)
 		r = crypto_ablkcipher_encrypt(req);
@@ -739,7 +792,7 @@ static int crypt_convert_block(struct crypt_config *cc,
 		r = crypto_ablkcipher_decrypt(req);
 
 	if (!r && cc->iv_gen_ops && cc->iv_gen_ops->post)
-		r = cc->iv_gen_ops->post(cc, iv, dmreq);
+		r = cc->iv_gen_ops->post(cc, iv_of_dmreq(cc, dmreq), dmreq);
 
 	return r;
 }
@@ -747,19 +800,75 @@ static int crypt_convert_block(struct crypt_config *cc,
 static void kcryptd_async_done(struct crypto_async_request *async_req,
 			       int error);
 
-static void crypt_alloc_req(struct crypt_config *cc,
-			    struct convert_context *ctx)
+/*
+ * Only the first request of a batch may wait for the mempool: waiting
+ * for a second one while holding the first could deadlock once every
+ * reserved request is held by a partly built batch.
+ */
+static struct ablkcipher_request *crypt_alloc_req(struct crypt_config *cc,
+						  struct convert_context *ctx,
+						  gfp_t gfp_mask)
 {
 	struct crypt_cpu *this_cc = this_crypt_config(cc);
 	unsigned key_index = ctx->sector & (cc->tfms_count - 1);
+	struct ablkcipher_request *req = this_cc->req;
 
-	if (!this_cc->req)
-		this_cc->req = mempool_alloc(cc->req_pool, GFP_NOIO);
+	if (req)
+		this_cc->req = NULL;
+	else {
+		req = mempool_alloc(cc->req_pool, gfp_mask);
+		if (!req)
+			return NULL;
+	}
 
-	ablkcipher_request_set_tfm(this_cc->req, this_cc->tfms[key_index]);
-	ablkcipher_request_set_callback(this_cc->req,
+	ablkcipher_request_set_tfm(req, this_cc->tfms[key_index]);
+	ablkcipher_request_set_callback(req,
 	    CRYPTO_TFM_REQ_MAY_BACKLOG | CRYPTO_TFM_REQ_MAY_SLEEP,
-	    kcryptd_async_done, dmreq_of_req(cc, this_cc->req));
+	    kcryptd_async_done, dmreq_of_req(cc, req));
+
+	return req;
+}
+
+/* Keep one finished request per cpu for the next conversion */
+static void crypt_free_req(struct crypt_config *cc,
+			   struct ablkcipher_request *req)
+{
+	struct crypt_cpu *this_cc = this_crypt_config(cc);
+
+	if (!this_cc->req)
+		this_cc->req = req;
+	else
+		mempool_free(req, cc->req_pool);
+}
+
+/*
+ * Set up the next batch of requests.  Returns the number of requests
+ * in batch[], or a negative error with nothing left allocated.
+ */
+static int crypt_prepare_batch(struct crypt_config *cc,
+			       struct convert_context *ctx,
+			       struct ablkcipher_request **batch)
+{
+	struct ablkcipher_request *req;
+	int nr = 0, r;
+
+	while (nr < CRYPT_BATCH_MAX &&
+	       ctx->idx_in < ctx->bio_in->bi_vcnt &&
+	       ctx->idx_out < ctx->bio_out->bi_vcnt) {
+		req = crypt_alloc_req(cc, ctx, nr ? GFP_NOWAIT : GFP_NOIO);
+		if (!req)
+			break;
+
+		r = crypt_prepare_block(cc, ctx, req);
+		batch[nr++] = req;
+		if (r < 0) {
+			while (nr)
+				crypt_free_req(cc, batch[--nr]);
+			return r;
+		}
+	}
+
+	return nr;
 }
 
 /*
@@ -768,43 +877,48 @@ static void crypt_alloc_req(struct crypt_config *cc,
 static int crypt_convert(struct crypt_config *cc,
 			 struct convert_context *ctx)
 {
-	struct crypt_cpu *this_cc = this_crypt_config(cc);
-	int r;
+	struct ablkcipher_request *batch[CRYPT_BATCH_MAX];
+	int i, nr, r;
 
 	atomic_set(&ctx->pending, 1);
 
 	while(ctx->idx_in < ctx->bio_in->bi_vcnt &&
 	      ctx->idx_out < ctx->bio_out->bi_vcnt) {
 
-		crypt_alloc_req(cc, ctx);
-
-		atomic_inc(&ctx->pending);
-
-		r = crypt_convert_block(cc, ctx, this_cc->req);
-
-		switch (r) {
-		/* async */
-		case -EBUSY:
-			wait_for_completion(&ctx->restart);
-			INIT_COMPLETION(ctx->restart);
-			/* fall through*/
-		case -EINPROGRESS:
-			this_cc->req = NULL;
-			ctx->sector++;
-			continue;
-
-		/* sync */
-		case 0:
-			atomic_dec(&ctx->pending);
-			ctx->sector++;
-			cond_resched();
-			continue;
-
-		/* error */
-		default:
-			atomic_dec(&ctx->pending);
-			return r;
+		nr = crypt_prepare_batch(cc, ctx, batch);
+		if (nr < 0)
+			return nr;
+
+		for (i = 0; i < nr; i++) {
+			atomic_inc(&ctx->pending);
+
+			r = crypt_submit_block(cc, ctx, batch[i]);
+
+			switch (r) {
+			/* async */
+			case -EBUSY:
+				wait_for_completion(&ctx->restart);
+				INIT_COMPLETION(ctx->restart);
+				/* fall through*/
+			case -EINPROGRESS:
+				continue;
+
+			/* sync */
+			case 0:
+				atomic_dec(&ctx->pending);
+				crypt_free_req(cc, batch[i]);
+				continue;
+
+			/* error */
+			default:
+				atomic_dec(&ctx->pending);
+				while (i < nr)
+					crypt_free_req(cc, batch[i++]);
+				return r;
+			}
 		}
+
+		cond_resched();
 	}
 
 	return 0;
@@ -899,6 +1013,7 @@ static struct dm_crypt_io *crypt_io_alloc(struct dm_target *ti,
 	io->sector = sector;
 	io->error = 0;
 	io->base_io = NULL;
+	io->cpu = raw_smp_processor_id();
 	atomic_set(&io->pending, 0);
 
 	return io;
@@ -1054,6 +1169,89 @@ static void kcryptd_queue_io(struct dm_crypt_io *io)
 	queue_work(cc->io_queue, &io->work);
 }
 
+#define crypt_io_from_node(node) rb_entry((node), struct dm_crypt_io, rb_node)
+
+/*
+ * Encryption finishes in whatever order the kcryptd workers get to it.
+ * Collect the bios and submit each batch in sector order, so the
+ * device sees writes as sequential as they were above us.
+ */
+static int dmcrypt_write(void *data)
+{
+	struct crypt_config *cc = data;
+	struct dm_crypt_io *io;
+
+	while (1) {
+		struct rb_root write_tree;
+		struct blk_plug plug;
+
+		DECLARE_WAITQUEUE(wait, current);
+
+		spin_lock_irq(&cc->write_thread_wait.lock);
+continue_locked:
+
+		if (!RB_EMPTY_ROOT(&cc->write_tree))
+			goto pop_from_list;
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		__add_wait_queue(&cc->write_thread_wait, &wait);
+
+		spin_unlock_irq(&cc->write_thread_wait.lock);
+
+		if (unlikely(kthread_should_stop())) {
+			set_current_state(TASK_RUNNING);
+			remove_wait_queue(&cc->write_thread_wait, &wait);
+			break;
+		}
+
+		schedule();
+
+		set_current_state(TASK_RUNNING);
+		spin_lock_irq(&cc->write_thread_wait.lock);
+		__remove_wait_queue(&cc->write_thread_wait, &wait);
+		goto continue_locked;
+
+pop_from_list:
+		write_tree = cc->write_tree;
+		cc->write_tree = RB_ROOT;
+		spin_unlock_irq(&cc->write_thread_wait.lock);
+
+		blk_start_plug(&plug);
+		do {
+			io = crypt_io_from_node(rb_first(&write_tree));
+			rb_erase(&io->rb_node, &write_tree);
+			kcryptd_io_write(io);
+		} while (!RB_EMPTY_ROOT(&write_tree));
+		blk_finish_plug(&plug);
+	}
+
+	return 0;
+}
+
+static void kcryptd_queue_sorted_write(struct dm_crypt_io *io)
+{
+	struct crypt_config *cc = io->target->private;
+	sector_t sector = io->ctx.bio_out->bi_sector;
+	struct rb_node **rbp, *parent = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cc->write_thread_wait.lock, flags);
+	if (RB_EMPTY_ROOT(&cc->write_tree))
+		wake_up_locked(&cc->write_thread_wait);
+
+	rbp = &cc->write_tree.rb_node;
+	while (*rbp) {
+		parent = *rbp;
+		if (sector < crypt_io_from_node(parent)->ctx.bio_out->bi_sector)
+			rbp = &(*rbp)->rb_left;
+		else
+			rbp = &(*rbp)->rb_right;
+	}
+	rb_link_node(&io->rb_node, parent, rbp);
+	rb_insert_color(&io->rb_node, &cc->write_tree);
+	spin_unlock_irqrestore(&cc->write_thread_wait.lock, flags);
+}
+
 static void kcryptd_crypt_write_io_submit(struct dm_crypt_io *io,
 					  int error, int async)
 {
@@ -1073,7 +1271,9 @@ static void kcryptd_crypt_write_io_submit(struct dm_crypt_io *io,
 
 	clone->bi_sector = cc->start + io->sector;
 
-	if (async)
+	if (test_bit(DM_CRYPT_SORT_WRITES, &cc->flags))
+		kcryptd_queue_sorted_write(io);
+	else if (async)
 		kcryptd_queue_io(io);
 	else
 		generic_make_request(clone);
@@ -1141,8 +1341,12 @@ static void kcryptd_crypt_write_convert(struct dm_crypt_io *io)
 		/*
 		 * With async crypto it is unsafe to share the crypto context
 		 * between fragments, so switch to a new dm_crypt_io structure.
+		 * The same goes for sorted writes, where the io stays queued
+		 * for the write thread after it has been "submitted".
 		 */
-		if (unlikely(!crypt_finished && remaining)) {
+		if (unlikely((!crypt_finished ||
+			      test_bit(DM_CRYPT_SORT_WRITES, &cc->flags)) &&
+			     remaining)) {
 			new_io = crypt_io_alloc(io->target, io->base_bio,
 						sector);
 			crypt_inc_pending(new_io);
@@ -1233,12 +1437,21 @@ static void kcryptd_crypt(struct work_struct *work)
 		kcryptd_crypt_write_convert(io);
 }
 
+/*
+ * Reads complete on whichever CPU took the interrupt; send them back to
+ * the submitting CPU so the decrypted data is cache hot for the reader
+ * and the per-cpu crypto state is spread like the submitters are.
+ */
 static void kcryptd_queue_crypt(struct dm_crypt_io *io)
 {
 	struct crypt_config *cc = io->target->private;
+	int cpu = io->cpu;
 
 	INIT_WORK(&io->work, kcryptd_crypt);
-	queue_work(cc->crypt_queue, &io->work);
+	if (cpu_online(cpu))
+		queue_work_on(cpu, cc->crypt_queue, &io->work);
+	else
+		queue_work(cc->crypt_queue, &io->work);
 }
 
 /*
@@ -1370,6 +1583,8 @@ static void crypt_dtr(struct dm_target *ti)
 		destroy_workqueue(cc->io_queue);
 	if (cc->crypt_queue)
 		destroy_workqueue(cc->crypt_queue);
+	if (cc->write_thread)
+		kthread_stop(cc->write_thread);
 
 	if (cc->cpu)
 		for_each_possible_cpu(cpu) {
@@ -1568,20 +1783,31 @@ bad_mem:
 
 /*
  * Construct an encryption mapping:
- * <cipher> <key> <iv_offset> <dev_path> <start>
+ * <cipher> <key> <iv_offset> <dev_path> <start> [<#opt_params> <opt_params>]
  */
 static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 {
 	struct crypt_config *cc;
 	unsigned int key_size;
 	unsigned long long tmpll;
+	int sort_writes = 0;
 	int ret;
 
-	if (argc != 5) {
+	if (argc < 5) {
 		ti->error = "Not enough arguments";
 		return -EINVAL;
 	}
 
+	/* The only optional parameter so far */
+	if (argc > 5) {
+		if (argc != 7 || strcmp(argv[5], "1") ||
+		    strcasecmp(argv[6], "sort_writes")) {
+			ti->error = "Invalid optional parameters";
+			return -EINVAL;
+		}
+		sort_writes = 1;
+	}
+
 	key_size = strlen(argv[1]) >> 1;
 
 	cc = kzalloc(sizeof(*cc) + key_size * sizeof(u8), GFP_KERNEL);
@@ -1666,6 +1892,21 @@ static int crypt_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		goto bad;
 	}
 
+	if (sort_writes) {
+		init_waitqueue_head(&cc->write_thread_wait);
+		cc->write_tree = RB_ROOT;
+
+		cc->write_thread = kthread_create(dmcrypt_write, cc, "dmcrypt_write");
+		if (IS_ERR(cc->write_thread)) {
+			ret = PTR_ERR(cc->write_thread);
+			cc->write_thread = NULL;
+			ti->error = "Couldn't spawn write thread";
+			goto bad;
+		}
+		wake_up_process(cc->write_thread);
+		set_bit(DM_CRYPT_SORT_WRITES, &cc->flags);
+	}
+
 	ti->num_flush_requests = 1;
 	return 0;
 
@@ -1725,6 +1966,9 @@ static int crypt_status(struct dm_target *ti, status_type_t type,
 
 		DMEMIT(" %llu %s %llu", (unsigned long long)cc->iv_offset,
 				cc->dev->name, (unsigned long long)cc->start);
+
+		if (test_bit(DM_CRYPT_SORT_WRITES, &cc->flags))
+			DMEMIT(" 1 sort_writes");
 		break;
 	}
 	return 0;
@@ -1821,7 +2065,7 @@ static int crypt_iterate_devices(struct dm_target *ti,
 
 static struct target_type crypt_target = {
 	.name   = "crypt",
-	.version = {1, 10, 0},
+	.version = {1, 11, 0},
 	.module = THIS_MODULE,
 	.ctr    = crypt_ctr,
 	.dtr    = crypt_dtr,
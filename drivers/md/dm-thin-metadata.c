@@ -194,6 +194,15 @@ struct dm_thin_device {
 	uint64_t transaction_id;
 	uint32_t creation_time;
 	uint32_t snapshotted_time;
+
+	/*
+	 * Data blocks [prealloc_begin, prealloc_end) are allocated in the
+	 * space map but not yet mapped.  They are handed out to the writes
+	 * following next_virt_block, and given back before each commit.
+	 */
+	dm_block_t next_virt_block;
+	dm_block_t prealloc_begin;
+	dm_block_t prealloc_end;
 };
 
 /*----------------------------------------------------------------
@@ -727,15 +736,47 @@ static int __open_device(struct dm_pool_metadata *pmd,
 	(*td)->transaction_id = le64_to_cpu(details_le.transaction_id);
 	(*td)->creation_time = le32_to_cpu(details_le.creation_time);
 	(*td)->snapshotted_time = le32_to_cpu(details_le.snapshotted_time);
+	(*td)->next_virt_block = 0;
+	(*td)->prealloc_begin = (*td)->prealloc_end = 0;
 
 	list_add(&(*td)->list, &pmd->thin_devices);
 
 	return 0;
 }
 
+static int __release_prealloc(struct dm_thin_device *td)
+{
+	int r;
+	struct dm_pool_metadata *pmd = td->pmd;
+
+	while (td->prealloc_begin < td->prealloc_end) {
+		r = dm_sm_dec_block(pmd->data_sm, td->prealloc_begin);
+		if (r)
+			return r;
+		td->prealloc_begin++;
+	}
+
+	return 0;
+}
+
+static int __release_all_preallocs(struct dm_pool_metadata *pmd)
+{
+	int r;
+	struct dm_thin_device *td;
+
+	list_for_each_entry(td, &pmd->thin_devices, list) {
+		r = __release_prealloc(td);
+		if (r)
+			return r;
+	}
+
+	return 0;
+}
+
 static void __close_device(struct dm_thin_device *td)
 {
-	--td->open_count;
+	if (!--td->open_count)
+		__release_prealloc(td);
 }
 
 static int __create_thin(struct dm_pool_metadata *pmd,
@@ -931,21 +972,72 @@ int dm_pool_delete_thin_device(struct dm_pool_metadata *pmd,
 	return r;
 }
 
+static int __remove(struct dm_thin_device *td, dm_block_t block);
+
+/*
+ * Mappings to remove are collected this many at a time by a range
+ * lookup, since the tree can't change under dm_btree_lookup_range().
+ */
+#define TRIM_BATCH 64
+
+struct trim_batch {
+	unsigned nr;
+	dm_block_t blocks[TRIM_BATCH];
+};
+
+static int __trim_collect(void *context, uint64_t key, void *value_le)
+{
+	struct trim_batch *batch = context;
+
+	batch->blocks[batch->nr++] = key;
+
+	return batch->nr == TRIM_BATCH;
+}
+
 static int __trim_thin_dev(struct dm_thin_device *td, sector_t new_size)
 {
 	struct dm_pool_metadata *pmd = td->pmd;
-	/* FIXME: convert new size to blocks */
-	uint64_t key[2] = { td->id, new_size - 1 };
+	uint64_t key[2] = { td->id, new_size };
+	struct trim_batch *batch;
+	unsigned i;
+	int r;
 
-	td->changed = 1;
+	batch = kmalloc(sizeof(*batch), GFP_KERNEL);
+	if (!batch)
+		return -ENOMEM;
 
 	/*
-	 * We need to truncate all the extraneous mappings.
+	 * We need to truncate all the extraneous mappings.  Each range
+	 * lookup only visits mapped blocks, so this is O(ln(n)) per
+	 * mapping removed however sparse the device is.
 	 *
 	 * FIXME: We have to be careful to do this atomically.
 	 * Perhaps clone the bottom layer first so we can revert?
 	 */
-	return dm_btree_del_gt(&pmd->info, pmd->root, key, &pmd->root);
+	do {
+		batch->nr = 0;
+		r = dm_btree_lookup_range(&pmd->info, pmd->root, key,
+					  ULLONG_MAX, __trim_collect, batch);
+		if (r < 0)
+			break;
+
+		for (i = 0; i < batch->nr; i++) {
+			int r2 = __remove(td, batch->blocks[i]);
+
+			if (r2) {
+				r = r2;
+				break;
+			}
+			td->mapped_blocks--;
+			td->changed = 1;
+		}
+
+		if (batch->nr)
+			key[1] = batch->blocks[batch->nr - 1] + 1;
+	} while (r > 0);
+
+	kfree(batch);
+	return r;
 }
 
 int dm_pool_trim_thin_device(struct dm_pool_metadata *pmd, dm_thin_id dev,
@@ -963,8 +1055,6 @@ int dm_pool_trim_thin_device(struct dm_pool_metadata *pmd, dm_thin_id dev,
 		__close_device(td);
 	}
 
-	/* FIXME: update mapped_blocks */
-
 	up_write(&pmd->root_lock);
 
 	return r;
@@ -1116,6 +1206,56 @@ int dm_thin_insert_block(struct dm_thin_device *td, dm_block_t block,
 	return r;
 }
 
+/*
+ * Mappings are passed to dm_btree_insert_range() in ascending runs of
+ * at most this many.
+ */
+#define INSERT_RUN_MAX 32U
+
+int dm_thin_insert_blocks(struct dm_thin_device *td, unsigned nr,
+			  const dm_block_t *blocks,
+			  const dm_block_t *data_blocks,
+			  unsigned *nr_inserted)
+{
+	int r = 0;
+	unsigned begin, end, i, inserted;
+	__le64 values[INSERT_RUN_MAX];
+	struct dm_pool_metadata *pmd = td->pmd;
+	dm_block_t keys[2] = { td->id, 0 };
+
+	down_write(&pmd->root_lock);
+	pmd->need_commit = 1;
+
+	for (begin = 0; begin < nr; begin = end) {
+		end = begin + 1;
+		while (end < nr && end - begin < INSERT_RUN_MAX &&
+		       blocks[end] > blocks[end - 1])
+			end++;
+
+		for (i = begin; i < end; i++)
+			values[i - begin] = cpu_to_le64(
+				pack_block_time(data_blocks[i], pmd->time));
+
+		/* Blessed by dm_btree_insert_range() itself */
+		r = dm_btree_insert_range(&pmd->info, pmd->root, keys,
+					  blocks + begin, values, end - begin,
+					  &pmd->root, &inserted);
+
+		/* Entries added before a failure are in the tree too */
+		if (inserted) {
+			td->mapped_blocks += inserted;
+			td->changed = 1;
+		}
+		if (r)
+			break;
+	}
+	up_write(&pmd->root_lock);
+
+	/* Only whole runs count: a failed run is all reported as failed */
+	*nr_inserted = begin;
+	return r;
+}
+
 static int __remove(struct dm_thin_device *td, dm_block_t block)
 {
 	int r;
@@ -1156,6 +1296,90 @@ int dm_pool_alloc_data_block(struct dm_pool_metadata *pmd, dm_block_t *result)
 	return r;
 }
 
+/*
+ * Extends the run starting at @begin with up to @max_blocks - 1 free
+ * blocks that follow it.
+ */
+static int __reserve_run(struct dm_pool_metadata *pmd, dm_block_t begin,
+			 dm_block_t max_blocks, dm_block_t *end)
+{
+	int r;
+	uint32_t count;
+	dm_block_t b, nr_blocks;
+
+	r = dm_sm_get_nr_blocks(pmd->data_sm, &nr_blocks);
+	if (r)
+		return r;
+
+	for (b = begin + 1; b < nr_blocks && b < begin + max_blocks; b++) {
+		r = dm_sm_get_count(pmd->data_sm, b, &count);
+		if (r)
+			return r;
+		if (count)
+			break;
+
+		r = dm_sm_inc_block(pmd->data_sm, b);
+		if (r)
+			return r;
+	}
+
+	*end = b;
+	return 0;
+}
+
+int dm_thin_alloc_data_block(struct dm_thin_device *td, dm_block_t block,
+			     dm_block_t max_run, dm_block_t *result)
+{
+	int r;
+	dm_block_t b;
+	struct dm_pool_metadata *pmd = td->pmd;
+
+	down_write(&pmd->root_lock);
+	pmd->need_commit = 1;
+
+	if (block == td->next_virt_block &&
+	    td->prealloc_begin < td->prealloc_end) {
+		*result = td->prealloc_begin++;
+		td->next_virt_block = block + 1;
+		r = 0;
+		goto out;
+	}
+
+	r = __release_prealloc(td);
+	if (r)
+		goto out;
+
+	r = dm_sm_new_block(pmd->data_sm, &b);
+	if (r == -ENOSPC) {
+		/* Other devices may be sitting on free blocks */
+		r = __release_all_preallocs(pmd);
+		if (!r)
+			r = dm_sm_new_block(pmd->data_sm, &b);
+	}
+	if (r)
+		goto out;
+
+	*result = b;
+	td->prealloc_begin = td->prealloc_end = b + 1;
+
+	/*
+	 * Only reserve ahead once the writes look sequential, random
+	 * writes would just churn the space map.
+	 */
+	if (max_run > 1 && block && block == td->next_virt_block) {
+		r = __reserve_run(pmd, b, max_run, &td->prealloc_end);
+		if (r) {
+			td->prealloc_end = b + 1;
+			goto out;
+		}
+	}
+	td->next_virt_block = block + 1;
+
+out:
+	up_write(&pmd->root_lock);
+	return r;
+}
+
 static int __write_changed_details(struct dm_pool_metadata *pmd)
 {
 	int r;
@@ -1209,6 +1433,15 @@ int dm_pool_commit_metadata(struct dm_pool_metadata *pmd)
 	BUILD_BUG_ON(sizeof(struct thin_disk_superblock) > 512);
 
 	down_write(&pmd->root_lock);
+
+	/*
+	 * Reserved data blocks must not be committed as allocated, they
+	 * would leak if we crashed before mapping them.
+	 */
+	r = __release_all_preallocs(pmd);
+	if (r < 0)
+		goto out;
+
 	r = __write_changed_details(pmd);
 	if (r < 0)
 		goto out;
@@ -1257,9 +1490,15 @@ out:
 int dm_pool_get_free_block_count(struct dm_pool_metadata *pmd, dm_block_t *result)
 {
 	int r;
+	struct dm_thin_device *td;
 
 	down_read(&pmd->root_lock);
 	r = dm_sm_get_nr_free(pmd->data_sm, result);
+
+	/* Reserved blocks are given back before they are ever used up */
+	if (!r)
+		list_for_each_entry(td, &pmd->thin_devices, list)
+			*result += td->prealloc_end - td->prealloc_begin;
 	up_read(&pmd->root_lock);
 
 	return r;
@@ -66,7 +66,7 @@ int dm_pool_delete_thin_device(struct dm_pool_metadata *pmd,
 /*
  * Thin devices don't have a size, however they do keep track of the
  * highest mapped block.  This trimming function allows the user to remove
- * mappings above a certain virtual block.
+ * mappings at and above a certain virtual block; @new_size is in blocks.
  */
 int dm_pool_trim_thin_device(struct dm_pool_metadata *pmd, dm_thin_id dev,
 			     sector_t new_size);
@@ -128,12 +128,33 @@ int dm_thin_find_block(struct dm_thin_device *td, dm_block_t block,
  */
 int dm_pool_alloc_data_block(struct dm_pool_metadata *pmd, dm_block_t *result);
 
+/*
+ * Obtain an unused block to map @block of @td.  When @td is being
+ * written sequentially, up to @max_run contiguous data blocks are
+ * reserved for it so that the following blocks are laid out
+ * sequentially too.  Reservations are dropped on commit.
+ */
+int dm_thin_alloc_data_block(struct dm_thin_device *td, dm_block_t block,
+			     dm_block_t max_run, dm_block_t *result);
+
 /*
  * Insert or remove block.
  */
 int dm_thin_insert_block(struct dm_thin_device *td, dm_block_t block,
 			 dm_block_t data_block);
 
+/*
+ * Insert @nr mappings under a single lock.  Ascending runs of blocks are
+ * inserted with one btree descent per leaf rather than one per block,
+ * so the blocks should be sorted.  On error @nr_inserted is set to the
+ * number of leading mappings known to be in place.  The btree may be
+ * half updated, so the others must be failed rather than retried.
+ */
+int dm_thin_insert_blocks(struct dm_thin_device *td, unsigned nr,
+			  const dm_block_t *blocks,
+			  const dm_block_t *data_blocks,
+			  unsigned *nr_inserted);
+
 int dm_thin_remove_block(struct dm_thin_device *td, dm_block_t block);
 
 /*
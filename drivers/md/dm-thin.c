@@ -10,9 +10,11 @@
 #include <linux/dm-io.h>
 #include <linux/dm-kcopyd.h>
 #include <linux/list.h>
+#include <linux/list_sort.h>
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 
 #define	DM_MSG_PREFIX	"thin"
 
@@ -23,6 +25,8 @@
 #define DEFERRED_SET_SIZE 64
 #define MAPPING_POOL_SIZE 1024
 #define PRISON_CELLS 1024
+#define DATA_PREALLOC_RUN 32
+#define MAPPING_BATCH_SIZE 32
 
 /*
  * The block size of the device holding pool data must be
@@ -103,6 +107,10 @@
  * where they can't cause any mischief.  Bios are put in a cell identified
  * by a key, multiple bios can be in the same cell.  When the cell is
  * subsequently unlocked the bios become available.
+ *
+ * Each hash bucket has its own lock, so bios for different blocks rarely
+ * contend.  A cell never moves bucket, so it is always protected by the
+ * lock of the bucket its key hashes to.
  */
 struct bio_prison;
 
@@ -120,13 +128,17 @@ struct cell {
 	struct bio_list bios;
 };
 
-struct bio_prison {
+struct prison_bucket {
 	spinlock_t lock;
+	struct hlist_head cells;
+} ____cacheline_aligned_in_smp;
+
+struct bio_prison {
 	mempool_t *cell_pool;
 
 	unsigned nr_buckets;
 	unsigned hash_mask;
-	struct hlist_head *cells;
+	struct prison_bucket *buckets;
 };
 
 static uint32_t calc_nr_buckets(unsigned nr_cells)
@@ -150,21 +162,31 @@ static struct bio_prison *prison_create(unsigned nr_cells)
 {
 	unsigned i;
 	uint32_t nr_buckets = calc_nr_buckets(nr_cells);
-	size_t len = sizeof(struct bio_prison) +
-		(sizeof(struct hlist_head) * nr_buckets);
-	struct bio_prison *prison = kmalloc(len, GFP_KERNEL);
+	struct bio_prison *prison = kmalloc(sizeof(*prison), GFP_KERNEL);
 
 	if (!prison)
 		return NULL;
 
-	spin_lock_init(&prison->lock);
+	prison->buckets = vmalloc(sizeof(*prison->buckets) * nr_buckets);
+	if (!prison->buckets) {
+		kfree(prison);
+		return NULL;
+	}
+
 	prison->cell_pool = mempool_create_kmalloc_pool(nr_cells,
 							sizeof(struct cell));
+	if (!prison->cell_pool) {
+		vfree(prison->buckets);
+		kfree(prison);
+		return NULL;
+	}
+
 	prison->nr_buckets = nr_buckets;
 	prison->hash_mask = nr_buckets - 1;
-	prison->cells = (struct hlist_head *) (prison + 1);
-	for (i = 0; i < nr_buckets; i++)
-		INIT_HLIST_HEAD(prison->cells + i);
+	for (i = 0; i < nr_buckets; i++) {
+		spin_lock_init(&prison->buckets[i].lock);
+		INIT_HLIST_HEAD(&prison->buckets[i].cells);
+	}
 
 	return prison;
 }
@@ -172,6 +194,7 @@ static struct bio_prison *prison_create(unsigned nr_cells)
 static void prison_destroy(struct bio_prison *prison)
 {
 	mempool_destroy(prison->cell_pool);
+	vfree(prison->buckets);
 	kfree(prison);
 }
 
@@ -183,13 +206,20 @@ static uint32_t hash_key(struct bio_prison *prison, struct cell_key *key)
 	return (uint32_t) (hash & prison->hash_mask);
 }
 
-static struct cell *__search_bucket(struct hlist_head *bucket,
+static struct prison_bucket *cell_bucket(struct cell *cell)
+{
+	struct bio_prison *prison = cell->prison;
+
+	return prison->buckets + hash_key(prison, &cell->key);
+}
+
+static struct cell *__search_bucket(struct prison_bucket *bucket,
 				    struct cell_key *key)
 {
 	struct cell *cell;
 	struct hlist_node *tmp;
 
-	hlist_for_each_entry(cell, tmp, bucket, list)
+	hlist_for_each_entry(cell, tmp, &bucket->cells, list)
 		if (!memcmp(&cell->key, key, sizeof(cell->key)))
 			return cell;
 
@@ -209,26 +239,28 @@ static int bio_detain(struct bio_prison *prison, struct cell_key *key,
 	int r;
 	unsigned long flags;
 	uint32_t hash = hash_key(prison, key);
+	struct prison_bucket *bucket;
 	struct cell *uninitialized_var(cell), *cell2 = NULL;
 
-	BUG_ON(hash > prison->nr_buckets);
+	BUG_ON(hash >= prison->nr_buckets);
+	bucket = prison->buckets + hash;
 
-	spin_lock_irqsave(&prison->lock, flags);
-	cell = __search_bucket(prison->cells + hash, key);
+	spin_lock_irqsave(&bucket->lock, flags);
+	cell = __search_bucket(bucket, key);
 
 	if (!cell) {
 		/*
 		 * Allocate a new cell
 		 */
-		spin_unlock_irqrestore(&prison->lock, flags);
+		spin_unlock_irqrestore(&bucket->lock, flags);
 		cell2 = mempool_alloc(prison->cell_pool, GFP_NOIO);
-		spin_lock_irqsave(&prison->lock, flags);
+		spin_lock_irqsave(&bucket->lock, flags);
 
 		/*
 		 * We've been unlocked, so we have to double check that
 		 * nobody else has inserted this cell in the meantime.
 		 */
-		cell = __search_bucket(prison->cells + hash, key);
+		cell = __search_bucket(bucket, key);
 
 		if (!cell) {
 			cell = cell2;
@@ -238,13 +270,13 @@ static int bio_detain(struct bio_prison *prison, struct cell_key *key,
 			memcpy(&cell->key, key, sizeof(cell->key));
 			cell->count = 0;
 			bio_list_init(&cell->bios);
-			hlist_add_head(&cell->list, prison->cells + hash);
+			hlist_add_head(&cell->list, &bucket->cells);
 		}
 	}
 
 	r = cell->count++;
 	bio_list_add(&cell->bios, inmate);
-	spin_unlock_irqrestore(&prison->lock, flags);
+	spin_unlock_irqrestore(&bucket->lock, flags);
 
 	if (cell2)
 		mempool_free(cell2, prison->cell_pool);
@@ -272,11 +304,11 @@ static void __cell_release(struct cell *cell, struct bio_list *inmates)
 static void cell_release(struct cell *cell, struct bio_list *bios)
 {
 	unsigned long flags;
-	struct bio_prison *prison = cell->prison;
+	struct prison_bucket *bucket = cell_bucket(cell);
 
-	spin_lock_irqsave(&prison->lock, flags);
+	spin_lock_irqsave(&bucket->lock, flags);
 	__cell_release(cell, bios);
-	spin_unlock_irqrestore(&prison->lock, flags);
+	spin_unlock_irqrestore(&bucket->lock, flags);
 }
 
 /*
@@ -287,16 +319,16 @@ static void cell_release(struct cell *cell, struct bio_list *bios)
  */
 static void cell_release_singleton(struct cell *cell, struct bio *bio)
 {
-	struct bio_prison *prison = cell->prison;
+	struct prison_bucket *bucket = cell_bucket(cell);
 	struct bio_list bios;
 	struct bio *b;
 	unsigned long flags;
 
 	bio_list_init(&bios);
 
-	spin_lock_irqsave(&prison->lock, flags);
+	spin_lock_irqsave(&bucket->lock, flags);
 	__cell_release(cell, &bios);
-	spin_unlock_irqrestore(&prison->lock, flags);
+	spin_unlock_irqrestore(&bucket->lock, flags);
 
 	b = bio_list_pop(&bios);
 	BUG_ON(b != bio);
@@ -305,16 +337,16 @@ static void cell_release_singleton(struct cell *cell, struct bio *bio)
 
 static void cell_error(struct cell *cell)
 {
-	struct bio_prison *prison = cell->prison;
+	struct prison_bucket *bucket = cell_bucket(cell);
 	struct bio_list bios;
 	struct bio *bio;
 	unsigned long flags;
 
 	bio_list_init(&bios);
 
-	spin_lock_irqsave(&prison->lock, flags);
+	spin_lock_irqsave(&bucket->lock, flags);
 	__cell_release(cell, &bios);
-	spin_unlock_irqrestore(&prison->lock, flags);
+	spin_unlock_irqrestore(&bucket->lock, flags);
 
 	while ((bio = bio_list_pop(&bios)))
 		bio_io_error(bio);
@@ -848,7 +880,8 @@ static void retry_later(struct bio *bio)
 	spin_unlock_irqrestore(&pool->lock, flags);
 }
 
-static int alloc_data_block(struct thin_c *tc, dm_block_t *result)
+static int alloc_data_block(struct thin_c *tc, dm_block_t block,
+			    dm_block_t *result)
 {
 	int r;
 	dm_block_t free_blocks;
@@ -866,7 +899,7 @@ static int alloc_data_block(struct thin_c *tc, dm_block_t *result)
 		dm_table_event(pool->ti->table);
 	}
 
-	r = dm_pool_alloc_data_block(pool->pmd, result);
+	r = dm_thin_alloc_data_block(tc->td, block, DATA_PREALLOC_RUN, result);
 	if (r)
 		return r;
 
@@ -893,7 +926,7 @@ static void break_sharing(struct thin_c *tc, struct bio *bio, dm_block_t block,
 	int r;
 	dm_block_t data_block;
 
-	r = alloc_data_block(tc, &data_block);
+	r = alloc_data_block(tc, block, &data_block);
 	switch (r) {
 	case 0:
 		schedule_copy(tc, block, lookup_result->block,
@@ -949,7 +982,7 @@ static void provision_block(struct thin_c *tc, struct bio *bio, dm_block_t block
 	int r;
 	dm_block_t data_block;
 
-	r = alloc_data_block(tc, &data_block);
+	r = alloc_data_block(tc, block, &data_block);
 	switch (r) {
 	case 0:
 		schedule_zero(tc, block, data_block, cell, bio);
@@ -1078,29 +1111,21 @@ static void cell_defer_except(struct thin_c *tc, struct cell *cell,
 	wake_worker(pool);
 }
 
-static void process_prepared_mapping(struct new_mapping *m)
+/*
+ * Completes a mapping once it has been inserted into the metadata, or
+ * errors it if @err is set.
+ */
+static void complete_mapping(struct new_mapping *m, int err)
 {
 	struct thin_c *tc = m->tc;
-	struct bio *bio;
-	int r;
+	struct bio *bio = m->bio;
 
-	bio = m->bio;
 	if (bio)
 		bio->bi_end_io = m->saved_bi_end_io;
 
-	if (m->err) {
+	if (err)
 		cell_error(m->cell);
-		return;
-	}
-
-	r = dm_thin_insert_block(tc->td, m->virt_block, m->data_block);
-	if (r) {
-		DMERR("dm_thin_insert_block() failed");
-		cell_error(m->cell);
-		return;
-	}
-
-	if (bio) {
+	else if (bio) {
 		cell_defer_except(tc, m->cell, bio);
 		bio_endio(bio, 0);
 	} else
@@ -1109,19 +1134,81 @@ static void process_prepared_mapping(struct new_mapping *m)
 	mempool_free(m, tc->pool->mapping_pool);
 }
 
+/*
+ * Inserts a batch of mappings, all for the same thin device and sorted
+ * by virtual block, in one go.
+ */
+static void process_prepared_batch(struct new_mapping **batch, unsigned nr)
+{
+	int r;
+	unsigned i, inserted;
+	struct thin_c *tc = batch[0]->tc;
+	dm_block_t virt_blocks[MAPPING_BATCH_SIZE];
+	dm_block_t data_blocks[MAPPING_BATCH_SIZE];
+
+	for (i = 0; i < nr; i++) {
+		virt_blocks[i] = batch[i]->virt_block;
+		data_blocks[i] = batch[i]->data_block;
+	}
+
+	r = dm_thin_insert_blocks(tc->td, nr, virt_blocks, data_blocks,
+				  &inserted);
+	if (r)
+		DMERR("dm_thin_insert_blocks() failed");
+
+	/*
+	 * A failed insert may have left the btree half updated, so the
+	 * mappings it didn't take are errored rather than retried.
+	 */
+	for (i = 0; i < nr; i++)
+		complete_mapping(batch[i], i < inserted ? 0 : r);
+}
+
+static int cmp_mappings(void *priv, struct list_head *a, struct list_head *b)
+{
+	struct new_mapping *ma = container_of(a, struct new_mapping, list);
+	struct new_mapping *mb = container_of(b, struct new_mapping, list);
+
+	if (ma->tc != mb->tc)
+		return ma->tc < mb->tc ? -1 : 1;
+
+	return ma->virt_block < mb->virt_block ? -1 : 1;
+}
+
 static void process_prepared_mappings(struct pool *pool)
 {
 	unsigned long flags;
 	struct list_head maps;
-	struct new_mapping *m;
+	struct new_mapping *m, *tmp;
+	struct new_mapping *batch[MAPPING_BATCH_SIZE];
+	unsigned nr = 0;
 
 	INIT_LIST_HEAD(&maps);
 	spin_lock_irqsave(&pool->lock, flags);
 	list_splice_init(&pool->prepared_mappings, &maps);
 	spin_unlock_irqrestore(&pool->lock, flags);
 
-	list_for_each_entry(m, &maps, list)
-		process_prepared_mapping(m);
+	/*
+	 * Group the mappings by device and order them by block, so each
+	 * batch updates neighbouring btree entries under one lock.
+	 */
+	list_sort(NULL, &maps, cmp_mappings);
+
+	list_for_each_entry_safe(m, tmp, &maps, list) {
+		if (m->err) {
+			complete_mapping(m, m->err);
+			continue;
+		}
+
+		if (nr && (batch[0]->tc != m->tc || nr == MAPPING_BATCH_SIZE)) {
+			process_prepared_batch(batch, nr);
+			nr = 0;
+		}
+		batch[nr++] = m;
+	}
+
+	if (nr)
+		process_prepared_batch(batch, nr);
 }
 
 static void do_worker(struct work_struct *ws)
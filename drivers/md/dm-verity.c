@@ -63,6 +63,10 @@
  * is at most 2, less than one page per side.
  */
 #define MIN_BIOS (MIN_IOS * 2)
+/* Hash prefetches have their own, smaller, bioset so that they can never
+ * eat into the reserve demand reads depend on.
+ */
+#define PREFETCH_BIOS 16
 
 /* MUST be true: SECTOR_SHIFT <= VERITY_BLOCK_SHIFT <= PAGE_SHIFT */
 #define VERITY_BLOCK_SIZE 4096
@@ -101,6 +105,30 @@ module_param(error_behavior, charp, 0644);
 MODULE_PARM_DESC(error_behavior, "Behavior on error "
 				 "(eio, panic, none, notify)");
 
+/* Bios of at least twice this many blocks have their verification split
+ * into work items of at least this many blocks, run on different CPUs.
+ */
+static unsigned int verify_split_blocks = 16;
+module_param(verify_split_blocks, uint, 0644);
+MODULE_PARM_DESC(verify_split_blocks,
+		 "Minimum blocks per parallel verify work item (0 disables)");
+
+/* Memory allowed for remembering verified blocks, which are then not
+ * hashed again when re-read.  0 disables the cache.
+ */
+static unsigned int verified_cache_kb;
+module_param(verified_cache_kb, uint, 0444);
+MODULE_PARM_DESC(verified_cache_kb,
+		 "KiB for the verified block bitmap of a new target (0 disables)");
+
+/* Number of blocks past a sequential read whose hashes are read ahead.
+ * 0 disables hash prefetching.
+ */
+static unsigned int prefetch_blocks = 512;
+module_param(prefetch_blocks, uint, 0644);
+MODULE_PARM_DESC(prefetch_blocks,
+		 "Blocks of hashes to read ahead of sequential reads");
+
 /* Controls whether verity_get_device will wait forever for a device. */
 static int dev_wait;
 module_param(dev_wait, bool, 0444);
@@ -115,13 +143,20 @@ struct verity_stats {
 	unsigned int average_requeues;
 	unsigned int total_requeues;
 	unsigned long long total_requests;
+	/* Sequential reads which found their hashes loaded, or not */
+	unsigned long long prefetch_hits;
+	unsigned long long prefetch_misses;
 };
 
 /* per-requested-bio private data */
 enum verity_io_flags {
 	VERITY_IOFLAGS_CLONED = 0x1,	/* original bio has been cloned */
+	VERITY_IOFLAGS_SEQUENTIAL = 0x2,	/* follows the previous read */
+	VERITY_IOFLAGS_PREFETCH = 0x4,	/* hash readahead, no bio */
 };
 
+struct verity_verify_chunk;
+
 struct dm_verity_io {
 	struct dm_target *target;
 	struct bio *bio;
@@ -134,6 +169,21 @@ struct dm_verity_io {
 	sector_t sector;  /* converted to target sector */
 	u64 block;  /* aligned block index */
 	u64 count;  /* aligned count in blocks */
+
+	/* Used when verification is split across CPUs */
+	struct verity_verify_chunk *chunks;
+	unsigned int nr_chunks;
+	atomic_t verify_pending;
+};
+
+/* A range of the blocks of a bio, verified by one work item. */
+struct verity_verify_chunk {
+	struct work_struct work;
+	struct dm_verity_io *io;
+	unsigned int idx_start;  /* first bio_vec of the range */
+	unsigned int idx_end;  /* one past the last bio_vec */
+	u64 block;  /* block index of idx_start */
+	int error;
 };
 
 struct verity_config {
@@ -152,12 +202,20 @@ struct verity_config {
 	 * in PAGE_SIZE increments.
 	 */
 	struct bio_set *bs;
+	/* Bios for hash prefetches, allocated without waiting */
+	struct bio_set *prefetch_bs;
 
 	char hash_alg[CRYPTO_MAX_ALG_NAME];
 
 	int error_behavior;
 
 	struct verity_stats stats;
+
+	/* Block following the last read, used to detect sequential reads */
+	u64 next_block;
+	/* Outstanding hash prefetches, waited for on destruction */
+	atomic_t prefetch_ios;
+	wait_queue_head_t prefetch_wait;
 };
 
 static struct kmem_cache *_verity_io_pool;
@@ -208,6 +266,14 @@ void verity_stats_total_requests_inc(struct verity_config *vc)
 	vc->stats.total_requests++;
 }
 
+void verity_stats_prefetch_inc(struct verity_config *vc, bool hit)
+{
+	if (hit)
+		vc->stats.prefetch_hits++;
+	else
+		vc->stats.prefetch_misses++;
+}
+
 void verity_stats_average_requeues(struct verity_config *vc, int requeues)
 {
 	/* TODO(wad) */
@@ -243,6 +309,13 @@ static void dm_verity_bio_destructor(struct bio *bio)
 	bio_free(bio, vc->bs);
 }
 
+static void dm_verity_prefetch_bio_destructor(struct bio *bio)
+{
+	struct dm_verity_io *io = bio->bi_private;
+	struct verity_config *vc = io->target->private;
+	bio_free(bio, vc->prefetch_bs);
+}
+
 struct bio *verity_alloc_bioset(struct verity_config *vc, gfp_t gfp_mask,
 				int nr_iovecs)
 {
@@ -264,6 +337,8 @@ static struct dm_verity_io *verity_io_alloc(struct dm_target *ti,
 	io->bio = bio;
 	io->sector = sector;
 	io->error = 0;
+	io->chunks = NULL;
+	io->nr_chunks = 0;
 
 	/* Adjust the sector by the virtual starting sector */
 	io->block = (to_bytes(sector)) >> VERITY_BLOCK_SHIFT;
@@ -551,6 +626,23 @@ static int verity_get_device(struct dm_target *ti, const char *devname,
 
 static void verity_inc_pending(struct dm_verity_io *io);
 
+/* Frees a hash prefetch once all of its reads have completed.  Prefetch
+ * ios come straight from the slab, never from the pool reserve.
+ */
+static void verity_prefetch_done(struct dm_verity_io *io)
+{
+	struct verity_config *vc = io->target->private;
+	unsigned long flags;
+
+	kmem_cache_free(_verity_io_pool, io);
+
+	/* Hold the lock so verity_dtr cannot free vc under wake_up */
+	spin_lock_irqsave(&vc->prefetch_wait.lock, flags);
+	if (atomic_dec_and_test(&vc->prefetch_ios))
+		wake_up_locked(&vc->prefetch_wait);
+	spin_unlock_irqrestore(&vc->prefetch_wait.lock, flags);
+}
+
 static void verity_return_bio_to_caller(struct dm_verity_io *io)
 {
 	struct verity_config *vc = io->target->private;
@@ -589,6 +681,11 @@ static void verity_dec_pending(struct dm_verity_io *io)
 	if (!atomic_dec_and_test(&io->pending))
 		goto done;
 
+	if (io->flags & VERITY_IOFLAGS_PREFETCH) {
+		verity_prefetch_done(io);
+		goto done;
+	}
+
 	if (unlikely(io->error))
 		goto io_error;
 
@@ -617,20 +714,19 @@ io_error:
 
 /* Walks the data set and computes the hash of the data read from the
  * untrusted source device.  The computed hash is then passed to dm-bht
- * for verification.
+ * for verification.  Only the bio_vecs [idx_start, idx_end) are checked,
+ * the first of them holding @block.
  */
-static int verity_verify(struct verity_config *vc,
-			 struct bio *bio)
+static int verity_verify(struct verity_config *vc, struct bio *bio,
+			 unsigned int idx_start, unsigned int idx_end,
+			 u64 block)
 {
 	unsigned int idx;
-	u64 block;
 	int r;
 
 	VERITY_BUG_ON(bio == NULL);
 
-	block = to_bytes(bio->bi_sector) >> VERITY_BLOCK_SHIFT;
-
-	for (idx = bio->bi_idx; idx < bio->bi_vcnt; idx++) {
+	for (idx = idx_start; idx < idx_end; idx++) {
 		struct bio_vec *bv = bio_iovec_idx(bio, idx);
 
 		VERITY_BUG_ON(bv->bv_offset % VERITY_BLOCK_SIZE);
@@ -671,6 +767,102 @@ bad_match:
 	return r;
 }
 
+static void verity_verify_done(struct dm_verity_io *io)
+{
+	struct verity_config *vc = io->target->private;
+
+	/* Free up the bio and tag with the return value */
+	verity_stats_verify_queue_dec(vc);
+	verity_return_bio_to_caller(io);
+}
+
+/* Services the verify workqueue for one chunk of a split io.  The last
+ * chunk to finish completes the io with the first error seen, if any.
+ */
+static void kverityd_verify_chunk(struct work_struct *work)
+{
+	struct verity_verify_chunk *chunk =
+		container_of(work, struct verity_verify_chunk, work);
+	struct dm_verity_io *io = chunk->io;
+	struct verity_config *vc = io->target->private;
+	unsigned int i;
+
+	chunk->error = verity_verify(vc, io->bio, chunk->idx_start,
+				     chunk->idx_end, chunk->block);
+
+	if (!atomic_dec_and_test(&io->verify_pending))
+		return;
+
+	for (i = 0; i < io->nr_chunks; i++) {
+		if (io->chunks[i].error) {
+			io->error = io->chunks[i].error;
+			break;
+		}
+	}
+	kfree(io->chunks);
+	io->chunks = NULL;
+
+	verity_verify_done(io);
+}
+
+/* Splits the verification of a large io into chunks which are queued on
+ * different CPUs, each using its own hash transform.  Returns false if
+ * the io is too small or memory is short, in which case the caller
+ * verifies it in one go.
+ */
+static bool verity_verify_parallel(struct dm_verity_io *io)
+{
+	struct bio *bio = io->bio;
+	unsigned int vecs = bio->bi_vcnt - bio->bi_idx;
+	unsigned int split = ACCESS_ONCE(verify_split_blocks);
+	unsigned int i, idx, per_chunk, nr_chunks;
+	struct verity_verify_chunk *chunks;
+	int cpu;
+
+	/* The parameter may be changed under us: read it only once */
+	if (!split || vecs < 2 * split)
+		return false;
+
+	nr_chunks = min(num_online_cpus(), vecs / split);
+	if (nr_chunks < 2)
+		return false;
+	per_chunk = DIV_ROUND_UP(vecs, nr_chunks);
+	nr_chunks = DIV_ROUND_UP(vecs, per_chunk);
+
+	chunks = kcalloc(nr_chunks, sizeof(*chunks), GFP_NOIO);
+	if (!chunks)
+		return false;
+
+	io->chunks = chunks;
+	io->nr_chunks = nr_chunks;
+	atomic_set(&io->verify_pending, nr_chunks);
+
+	/* kveritydq is per-CPU, so this is stable while we are running */
+	cpu = raw_smp_processor_id();
+	idx = bio->bi_idx;
+	for (i = 0; i < nr_chunks; i++, idx += per_chunk) {
+		struct verity_verify_chunk *chunk = &chunks[i];
+
+		chunk->io = io;
+		chunk->idx_start = idx;
+		chunk->idx_end = min(idx + per_chunk,
+				     (unsigned int)bio->bi_vcnt);
+		chunk->block = io->block + (idx - bio->bi_idx);
+		INIT_WORK(&chunk->work, kverityd_verify_chunk);
+
+		REQTRACE("Block %llu+ chunk %u queued on cpu %d (io:%p)",
+			 ULL(chunk->block), i, cpu, io);
+		/* The io may be completed as soon as the last one is queued */
+		queue_work_on(cpu, kveritydq, &chunk->work);
+
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+	}
+
+	return true;
+}
+
 /* Services the verify workqueue */
 static void kverityd_verify(struct work_struct *work)
 {
@@ -680,11 +872,12 @@ static void kverityd_verify(struct work_struct *work)
 					       work);
 	struct verity_config *vc = io->target->private;
 
-	io->error = verity_verify(vc, io->bio);
+	if (verity_verify_parallel(io))
+		return;
 
-	/* Free up the bio and tag with the return value */
-	verity_stats_verify_queue_dec(vc);
-	verity_return_bio_to_caller(io);
+	io->error = verity_verify(vc, io->bio, io->bio->bi_idx,
+				  io->bio->bi_vcnt, io->block);
+	verity_verify_done(io);
 }
 
 /* Asynchronously called upon the completion of dm-bht I/O.  The status
@@ -713,8 +906,8 @@ static void kverityd_io_bht_populate_end(struct bio *bio, int error)
 
 	/* We bail but assume the tree has been marked bad. */
 	if (unlikely(error)) {
-		DMERR("Failed to read for sector %llu (%u)",
-		      ULL(io->bio->bi_sector), io->bio->bi_size);
+		DMERR("Failed to read hashes for block %llu+%llu",
+		      ULL(io->block), ULL(io->count));
 		io->error = error;
 		/* Pass through the error to verity_dec_pending below */
 	}
@@ -745,13 +938,27 @@ static int kverityd_bht_read_callback(void *ctx, sector_t start, u8 *dst,
 	entry->io_context = ctx;
 
 	/* We should only get page size requests at present. */
-	verity_inc_pending(io);
-	bio = verity_alloc_bioset(vc, GFP_NOIO, 1);
-	if (unlikely(!bio)) {
-		DMCRIT("Out of memory at bio_alloc_bioset");
-		dm_bht_read_completed(entry, -ENOMEM);
-		return -ENOMEM;
+	if (io->flags & VERITY_IOFLAGS_PREFETCH) {
+		/* A prefetch is only a hint: never wait for a bio, and
+		 * leave the entry for the demand read if there is none.
+		 */
+		bio = bio_alloc_bioset(GFP_NOWAIT | __GFP_NOWARN, 1,
+				       vc->prefetch_bs);
+		if (!bio) {
+			dm_bht_read_cancelled(entry);
+			return -ENOMEM;
+		}
+		bio->bi_destructor = dm_verity_prefetch_bio_destructor;
+	} else {
+		bio = verity_alloc_bioset(vc, GFP_NOIO, 1);
+		if (unlikely(!bio)) {
+			DMCRIT("Out of memory at bio_alloc_bioset");
+			dm_bht_read_completed(entry, -ENOMEM);
+			return -ENOMEM;
+		}
+		bio->bi_destructor = dm_verity_bio_destructor;
 	}
+	verity_inc_pending(io);
 	bio->bi_private = (void *) entry;
 	bio->bi_idx = 0;
 	bio->bi_size = VERITY_BLOCK_SIZE;
@@ -760,7 +967,6 @@ static int kverityd_bht_read_callback(void *ctx, sector_t start, u8 *dst,
 	bio->bi_end_io = kverityd_io_bht_populate_end;
 	bio->bi_rw = REQ_META;
 	/* Only need to free the bio since the page is managed by bht */
-	bio->bi_destructor = dm_verity_bio_destructor;
 	bio->bi_vcnt = 1;
 	bio->bi_io_vec->bv_offset = 0;
 	bio->bi_io_vec->bv_len = to_bytes(count);
@@ -805,6 +1011,52 @@ static void kverityd_io_bht_populate(struct dm_verity_io *io)
 		 ULL(io->block), atomic_read(&io->pending) - 1, io);
 }
 
+/* Reads the hash pages needed by the prefetch_blocks blocks from @start
+ * on, so that a sequential reader does not stall on them.  The reads are
+ * tracked by their own io context, which has no bio and is released
+ * once they complete.
+ */
+static void kverityd_io_bht_prefetch(struct dm_target *ti, u64 start)
+{
+	struct verity_config *vc = ti->private;
+	struct dm_verity_io *pio = NULL;
+	unsigned int mask = vc->bht.node_count - 1;
+	u64 end = min_t(u64, start + prefetch_blocks, vc->bht.block_count);
+	u64 block;
+
+	/* Each leaf entry holds the hashes of node_count blocks */
+	for (block = start; block < end; block = (block | mask) + 1) {
+		if (dm_bht_is_populated(&vc->bht, block))
+			continue;
+
+		if (!pio) {
+			/* Leave the pool reserve to demand reads: skip
+			 * the prefetch if the slab cannot satisfy it.
+			 */
+			pio = kmem_cache_alloc(_verity_io_pool,
+					       GFP_NOWAIT | __GFP_NOWARN);
+			if (!pio)
+				return;
+			memset(pio, 0, sizeof(*pio));
+			pio->target = ti;
+			pio->flags = VERITY_IOFLAGS_PREFETCH;
+			pio->block = start;
+			pio->count = end - start;
+			atomic_set(&pio->pending, 1);
+			atomic_inc(&vc->prefetch_ios);
+		}
+
+		if (dm_bht_populate(&vc->bht, pio, block) < 0)
+			break;
+	}
+
+	if (pio) {
+		REQTRACE("Prefetching hashes for %llu+%llu",
+			 ULL(pio->block), ULL(pio->count));
+		verity_dec_pending(pio);
+	}
+}
+
 /* Asynchronously called upon the completion of I/O issued
  * from kverityd_src_io_read. verity_dec_pending() acts as
  * the scheduler/flow manager.
@@ -882,12 +1134,21 @@ static void kverityd_io(struct work_struct *work)
 						  work);
 	struct dm_verity_io *io = container_of(dwork, struct dm_verity_io,
 					       work);
+	struct verity_config *vc = io->target->private;
+	bool first_pass = !(io->flags & VERITY_IOFLAGS_CLONED);
 	VERITY_BUG_ON(!io->bio);
 
+	if (first_pass && (io->flags & VERITY_IOFLAGS_SEQUENTIAL))
+		verity_stats_prefetch_inc(vc, verity_is_bht_populated(io));
+
 	/* Issue requests asynchronously. */
 	verity_inc_pending(io);
 	kverityd_src_io_read(io);
 	kverityd_io_bht_populate(io);
+	/* Stay ahead of a sequential reader */
+	if (first_pass && prefetch_blocks &&
+	    (io->flags & VERITY_IOFLAGS_SEQUENTIAL))
+		kverityd_io_bht_prefetch(io->target, io->block + io->count);
 	verity_dec_pending(io);
 }
 
@@ -943,6 +1204,11 @@ static int verity_map(struct dm_target *ti, struct bio *bio,
 			DMERR_LIMIT("Failed to allocate and init IO data");
 			return DM_MAPIO_REQUEUE;
 		}
+		/* Racy, but only a hint for hash prefetching */
+		if (io->block == vc->next_block)
+			io->flags |= VERITY_IOFLAGS_SEQUENTIAL;
+		vc->next_block = io->block + io->count;
+
 		verity_stats_io_queue_inc(vc);
 		INIT_DELAYED_WORK(&io->work, kverityd_io);
 		queue_delayed_work(kverityd_ioq, &io->work, 0);
@@ -1092,6 +1358,8 @@ static int verity_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		 */
 		return -EINVAL;
 	}
+	atomic_set(&vc->prefetch_ios, 0);
+	init_waitqueue_head(&vc->prefetch_wait);
 
 	/* Calculate the blocks from the given device size */
 	vc->size = ti->len;
@@ -1107,6 +1375,9 @@ static int verity_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	if (hexsalt)
 		dm_bht_set_salt(&vc->bht, hexsalt);
 	dm_bht_set_read_cb(&vc->bht, kverityd_bht_read_callback);
+	if (verified_cache_kb &&
+	    dm_bht_enable_verified_map(&vc->bht, verified_cache_kb * 1024))
+		DMWARN("failed to allocate verified block cache");
 
 	/* payload: device to verify */
 	vc->start = 0;  /* TODO: should this support a starting offset? */
@@ -1178,6 +1449,12 @@ static int verity_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 		goto bad_bs;
 	}
 
+	vc->prefetch_bs = bioset_create(PREFETCH_BIOS, 0);
+	if (!vc->prefetch_bs) {
+		ti->error = "Cannot allocate verity prefetch bioset";
+		goto bad_prefetch_bs;
+	}
+
 	ti->num_flush_requests = 1;
 	ti->private = vc;
 
@@ -1191,6 +1468,8 @@ static int verity_ctr(struct dm_target *ti, unsigned int argc, char **argv)
 	}
 	return 0;
 
+bad_prefetch_bs:
+	bioset_free(vc->bs);
 bad_bs:
 	mempool_destroy(vc->io_pool);
 bad_slab_pool:
@@ -1211,7 +1490,14 @@ static void verity_dtr(struct dm_target *ti)
 {
 	struct verity_config *vc = (struct verity_config *) ti->private;
 
+	DMDEBUG("Waiting for hash prefetches");
+	wait_event(vc->prefetch_wait, !atomic_read(&vc->prefetch_ios));
+	/* verity_prefetch_done may still hold the lock */
+	spin_lock_irq(&vc->prefetch_wait.lock);
+	spin_unlock_irq(&vc->prefetch_wait.lock);
+
 	DMDEBUG("Destroying bs");
+	bioset_free(vc->prefetch_bs);
 	bioset_free(vc->bs);
 	DMDEBUG("Destroying io_pool");
 	mempool_destroy(vc->io_pool);
@@ -1239,12 +1525,16 @@ static int verity_status(struct dm_target *ti, status_type_t type,
 
 	switch (type) {
 	case STATUSTYPE_INFO:
-		DMEMIT("%u %u %u %u %llu",
+		DMEMIT("%u %u %u %u %llu %lu %lu %llu %llu",
 		       vc->stats.io_queue,
 		       vc->stats.verify_queue,
 		       vc->stats.average_requeues,
 		       vc->stats.total_requeues,
-		       vc->stats.total_requests);
+		       vc->stats.total_requests,
+		       atomic_long_read(&vc->bht.verified_hits),
+		       atomic_long_read(&vc->bht.verified_misses),
+		       vc->stats.prefetch_hits,
+		       vc->stats.prefetch_misses);
 		break;
 
 	case STATUSTYPE_TABLE:
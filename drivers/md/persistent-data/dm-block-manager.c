@@ -9,6 +9,8 @@
 #include <linux/dm-io.h>
 #include <linux/slab.h>
 #include <linux/device-mapper.h>
+#include <linux/module.h>
+#include <linux/workqueue.h>
 
 #define DM_MSG_PREFIX "block manager"
 
@@ -17,6 +19,14 @@
 #define SECTOR_SIZE (1 << SECTOR_SHIFT)
 #define MAX_CACHE_SIZE 16U
 
+/*
+ * The cache starts with the number of blocks the client asked for and
+ * grows on demand up to this many, giving memory back via a shrinker.
+ */
+static unsigned max_cache_blocks = 1024;
+module_param(max_cache_blocks, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(max_cache_blocks, "Max number of blocks each block manager may cache");
+
 enum dm_block_state {
 	BS_EMPTY,
 	BS_CLEAN,
@@ -41,6 +51,12 @@ struct dm_block {
 	unsigned write_lock_pending;
 	enum dm_block_state state;
 
+	/*
+	 * Number of threads that have dropped bm->lock while holding on
+	 * to this block.  Such a block is neither recycled nor freed.
+	 */
+	unsigned waiters;
+
 	/*
 	 * Extra flags like REQ_FLUSH and REQ_FUA can be set here.  This is
 	 * mainly as to avoid a race condition in flush_and_unlock() where
@@ -58,7 +74,8 @@ struct dm_block {
 
 struct dm_block_manager {
 	struct block_device *bdev;
-	unsigned cache_size;	/* In bytes */
+	unsigned cache_size;	/* In blocks, never shrunk below this */
+	unsigned max_cache_size;	/* In blocks */
 	unsigned block_size;	/* In bytes */
 	dm_block_t nr_blocks;
 
@@ -74,15 +91,26 @@ struct dm_block_manager {
 	 */
 	spinlock_t lock;
 
+	unsigned nr_allocated;
 	unsigned available_count;
 	unsigned reading_count;
 	unsigned writing_count;
+	unsigned dirty_count;
 
 	struct list_head empty_list;	/* No block assigned */
-	struct list_head clean_list;	/* Unlocked and clean */
-	struct list_head dirty_list;	/* Unlocked and dirty */
+	struct list_head clean_list;	/* Unlocked and clean, LRU first */
+	struct list_head dirty_list;	/* Unlocked and dirty, oldest first */
 	struct list_head error_list;
 
+	/*
+	 * Dirty blocks are written back in the background once they make
+	 * up half the cache, so recycle_block() rarely has to wait.
+	 */
+	struct workqueue_struct *wq;
+	struct work_struct writeback_work;
+
+	struct shrinker shrinker;
+
 	char buffer_cache_name[32];
 	struct kmem_cache *buffer_cache; /* The buffers that store the raw data */
 
@@ -204,6 +232,7 @@ static void __transition(struct dm_block *b, enum dm_block_state new_state)
 		/* DOT: dirty -> writing */
 		BUG_ON(!(b->state == BS_DIRTY));
 		list_del(&b->list);
+		bm->dirty_count--;
 		bm->writing_count++;
 		break;
 
@@ -218,6 +247,7 @@ static void __transition(struct dm_block *b, enum dm_block_state new_state)
 		/* DOT: dirty -> read_locked_dirty */
 		BUG_ON(!((b->state == BS_DIRTY)));
 		list_del(&b->list);
+		bm->dirty_count--;
 		break;
 
 	case BS_WRITE_LOCKED:
@@ -229,6 +259,8 @@ static void __transition(struct dm_block *b, enum dm_block_state new_state)
 
 		if (b->state == BS_CLEAN)
 			bm->available_count--;
+		else
+			bm->dirty_count--;
 		break;
 
 	case BS_DIRTY:
@@ -237,6 +269,7 @@ static void __transition(struct dm_block *b, enum dm_block_state new_state)
 		BUG_ON(!((b->state == BS_WRITE_LOCKED) ||
 			 (b->state == BS_READ_LOCKED_DIRTY)));
 		list_add_tail(&b->list, &bm->dirty_list);
+		bm->dirty_count++;
 		break;
 
 	case BS_ERROR:
@@ -244,6 +277,10 @@ static void __transition(struct dm_block *b, enum dm_block_state new_state)
 		/* DOT: reading -> error */
 		BUG_ON(!((b->state == BS_WRITING) ||
 			 (b->state == BS_READING)));
+		if (b->state == BS_READING)
+			bm->reading_count--;
+		else
+			bm->writing_count--;
 		list_add_tail(&b->list, &bm->error_list);
 		break;
 	}
@@ -314,6 +351,27 @@ static void read_block(struct dm_block *b)
 	submit_io(b, READ, complete_io);
 }
 
+/*
+ * Nobody is waiting for the result of a prefetch, so a failed one is
+ * just forgotten; a later lock will read the block again and see the
+ * error.
+ */
+static void complete_prefetch(unsigned long error, struct dm_block *b)
+{
+	struct dm_block_manager *bm = b->bm;
+	unsigned long flags;
+
+	spin_lock_irqsave(&bm->lock, flags);
+	if (error) {
+		__transition(b, BS_ERROR);
+		__transition(b, BS_EMPTY);
+		wake_up(&b->io_q);
+		wake_up(&bm->io_q);
+	} else
+		__complete_io(0, b);
+	spin_unlock_irqrestore(&bm->lock, flags);
+}
+
 static void write_block(struct dm_block *b)
 {
 	if (b->validator)
@@ -350,7 +408,33 @@ static void write_dirty(struct dm_block_manager *bm, unsigned count)
 
 static void write_all_dirty(struct dm_block_manager *bm)
 {
-	write_dirty(bm, bm->cache_size);
+	write_dirty(bm, UINT_MAX);
+}
+
+/*
+ * Writes back the oldest dirty blocks until only a quarter of the cache
+ * is dirty.
+ */
+static void do_writeback(struct work_struct *ws)
+{
+	struct dm_block_manager *bm =
+		container_of(ws, struct dm_block_manager, writeback_work);
+	unsigned long flags;
+	unsigned count = 0, target;
+
+	spin_lock_irqsave(&bm->lock, flags);
+	target = bm->nr_allocated / 4;
+	if (bm->dirty_count > target)
+		count = bm->dirty_count - target;
+	spin_unlock_irqrestore(&bm->lock, flags);
+
+	if (count)
+		write_dirty(bm, count);
+}
+
+static void __wake_writeback(struct dm_block_manager *bm)
+{
+	queue_work(bm->wq, &bm->writeback_work);
 }
 
 static void __clear_errors(struct dm_block_manager *bm)
@@ -407,16 +491,18 @@ static int __wait_unlocked(struct dm_block *b, unsigned long *flags)
 	__retains(&b->bm->lock)
 {
 	__wait_block(&b->io_q, &b->bm->lock, *flags, schedule,
-		     ((b->state == BS_CLEAN) || (b->state == BS_DIRTY)));
+		     ((b->state == BS_CLEAN) || (b->state == BS_DIRTY) ||
+		      (b->state == BS_EMPTY)));
 }
 
 static int __wait_read_lockable(struct dm_block *b, unsigned long *flags)
 	__retains(&b->bm->lock)
 {
 	__wait_block(&b->io_q, &b->bm->lock, *flags, schedule,
-		     (!b->write_lock_pending && (b->state == BS_CLEAN ||
-						 b->state == BS_DIRTY ||
-						 b->state == BS_READ_LOCKED)));
+		     (b->state == BS_EMPTY ||
+		      (!b->write_lock_pending && (b->state == BS_CLEAN ||
+						  b->state == BS_DIRTY ||
+						  b->state == BS_READ_LOCKED))));
 }
 
 static int __wait_all_writes(struct dm_block_manager *bm, unsigned long *flags)
@@ -433,12 +519,207 @@ static int __wait_all_io(struct dm_block_manager *bm, unsigned long *flags)
 		     !bm->writing_count && !bm->reading_count);
 }
 
+/*
+ * Is there an empty block, or a clean one nobody is waiting on?  A clean
+ * block with waiters can't be recycled, so a clean_list full of them is
+ * no reason to stop waiting.
+ */
+static int __can_recycle(struct dm_block_manager *bm)
+{
+	struct dm_block *b;
+
+	if (!list_empty(&bm->empty_list))
+		return 1;
+
+	list_for_each_entry(b, &bm->clean_list, list)
+		if (!b->waiters)
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Wait until a block can be recycled, or until there is no io in flight
+ * but dirty blocks the caller can write back.  bm->io_q is woken when io
+ * completes, a block is unlocked, or the last waiter leaves a block.
+ */
 static int __wait_clean(struct dm_block_manager *bm, unsigned long *flags)
 	__retains(&bm->lock)
 {
 	__wait_block(&bm->io_q, &bm->lock, *flags, io_schedule,
-		     (!list_empty(&bm->clean_list) ||
-		      (!bm->writing_count)));
+		     (__can_recycle(bm) ||
+		      (!bm->writing_count && !list_empty(&bm->dirty_list))));
+}
+
+/* Drop a waiter, letting recycle_block() know if b may now be reused */
+static void __put_waiter(struct dm_block *b)
+{
+	if (!--b->waiters &&
+	    (b->state == BS_CLEAN || b->state == BS_EMPTY))
+		wake_up(&b->bm->io_q);
+}
+
+/*----------------------------------------------------------------
+ * Low level block management
+ *--------------------------------------------------------------*/
+
+static struct kmem_cache *dm_block_cache;  /* struct dm_block */
+
+static struct dm_block *alloc_block(struct dm_block_manager *bm, gfp_t gfp)
+{
+	struct dm_block *b = kmem_cache_alloc(dm_block_cache, gfp);
+
+	if (!b)
+		return NULL;
+
+	INIT_LIST_HEAD(&b->list);
+	INIT_HLIST_NODE(&b->hlist);
+
+	b->data = kmem_cache_alloc(bm->buffer_cache, gfp);
+	if (!b->data) {
+		kmem_cache_free(dm_block_cache, b);
+		return NULL;
+	}
+
+	b->validator = NULL;
+	b->state = BS_EMPTY;
+	init_waitqueue_head(&b->io_q);
+	b->read_lock_count = 0;
+	b->write_lock_pending = 0;
+	b->waiters = 0;
+	b->io_flags = 0;
+	b->bm = bm;
+
+	return b;
+}
+
+static void free_block(struct dm_block *b)
+{
+	kmem_cache_free(b->bm->buffer_cache, b->data);
+	kmem_cache_free(dm_block_cache, b);
+}
+
+static void free_block_list(struct list_head *head)
+{
+	struct dm_block *b, *tmp;
+
+	list_for_each_entry_safe(b, tmp, head, list)
+		free_block(b);
+}
+
+static int populate_bm(struct dm_block_manager *bm, unsigned count)
+{
+	int i;
+	LIST_HEAD(bs);
+
+	for (i = 0; i < count; i++) {
+		struct dm_block *b = alloc_block(bm, GFP_KERNEL);
+		if (!b) {
+			free_block_list(&bs);
+			return -ENOMEM;
+		}
+
+		list_add(&b->list, &bs);
+	}
+
+	list_replace(&bs, &bm->empty_list);
+	bm->available_count = count;
+	bm->nr_allocated = count;
+
+	return 0;
+}
+
+/*
+ * Adds a freshly allocated block to the empty list, unless the cache
+ * has meanwhile reached its limit.  Returns 0 if @b wasn't used and
+ * should be freed by the caller.
+ */
+static int __add_block(struct dm_block_manager *bm, struct dm_block *b)
+{
+	if (bm->nr_allocated >= bm->max_cache_size)
+		return 0;
+
+	list_add(&b->list, &bm->empty_list);
+	bm->nr_allocated++;
+	bm->available_count++;
+
+	return 1;
+}
+
+/*
+ * Returns an empty block, turning the least recently used clean block
+ * into one if need be.
+ */
+static struct dm_block *__find_free_block(struct dm_block_manager *bm)
+{
+	struct dm_block *b;
+
+	if (!list_empty(&bm->empty_list))
+		return list_first_entry(&bm->empty_list, struct dm_block, list);
+
+	list_for_each_entry(b, &bm->clean_list, list)
+		if (!b->waiters) {
+			__transition(b, BS_EMPTY);
+			return b;
+		}
+
+	return NULL;
+}
+
+/*
+ * Give clean blocks above the initial cache size back to the system,
+ * least recently used first.
+ */
+static int bm_shrink(struct shrinker *shrinker, int nr_to_scan, gfp_t gfp_mask)
+{
+	struct dm_block_manager *bm =
+		container_of(shrinker, struct dm_block_manager, shrinker);
+	struct dm_block *b, *tmp;
+	unsigned long flags;
+	LIST_HEAD(freed);
+	int r;
+
+	spin_lock_irqsave(&bm->lock, flags);
+	if (nr_to_scan) {
+		/*
+		 * Unused blocks go first.  A failed read leaves its block
+		 * empty while lockers may still sleep on b->io_q.
+		 */
+		list_for_each_entry_safe(b, tmp, &bm->empty_list, list) {
+			if (bm->nr_allocated <= bm->cache_size)
+				break;
+
+			if (b->waiters)
+				continue;
+
+			list_move(&b->list, &freed);
+			bm->nr_allocated--;
+			bm->available_count--;
+		}
+
+		list_for_each_entry_safe(b, tmp, &bm->clean_list, list) {
+			if (!nr_to_scan-- || bm->nr_allocated <= bm->cache_size)
+				break;
+
+			if (b->waiters)
+				continue;
+
+			__transition(b, BS_EMPTY);
+			list_move(&b->list, &freed);
+			bm->nr_allocated--;
+			bm->available_count--;
+		}
+	}
+
+	r = 0;
+	if (bm->nr_allocated > bm->cache_size)
+		r = min(bm->available_count,
+			bm->nr_allocated - bm->cache_size);
+	spin_unlock_irqrestore(&bm->lock, flags);
+
+	free_block_list(&freed);
+
+	return r;
 }
 
 /*----------------------------------------------------------------
@@ -457,26 +738,39 @@ static int recycle_block(struct dm_block_manager *bm, dm_block_t where,
 	 */
 	spin_lock_irqsave(&bm->lock, flags);
 	while (1) {
+		available = bm->available_count + bm->writing_count;
+		if (available < bm->nr_allocated / 4)
+			__wake_writeback(bm);
+
+		if (!list_empty(&bm->empty_list)) {
+			b = list_first_entry(&bm->empty_list, struct dm_block, list);
+			break;
+		}
+
 		/*
-		 * Once we can lock and do io concurrently then we should
-		 * probably flush at bm->cache_size / 2 and write _all_
-		 * dirty blocks.
+		 * Grow the cache rather than evict while we're below the
+		 * limit.  The shrinker will trim it again under pressure.
 		 */
-		available = bm->available_count + bm->writing_count;
-		if (available < bm->cache_size / 4) {
+		if (bm->nr_allocated < bm->max_cache_size) {
 			spin_unlock_irqrestore(&bm->lock, flags);
-			write_dirty(bm, bm->cache_size / 4);
+			b = alloc_block(bm, GFP_NOIO | __GFP_NORETRY | __GFP_NOWARN);
 			spin_lock_irqsave(&bm->lock, flags);
+
+			if (b) {
+				if (!__add_block(bm, b))
+					free_block(b);
+				continue;
+			}
 		}
 
-		if (!list_empty(&bm->empty_list)) {
-			b = list_first_entry(&bm->empty_list, struct dm_block, list);
+		b = __find_free_block(bm);
+		if (b)
 			break;
 
-		} else if (!list_empty(&bm->clean_list)) {
-			b = list_first_entry(&bm->clean_list, struct dm_block, list);
-			__transition(b, BS_EMPTY);
-			break;
+		if (!bm->writing_count) {
+			spin_unlock_irqrestore(&bm->lock, flags);
+			write_dirty(bm, max(bm->nr_allocated / 4, 1u));
+			spin_lock_irqsave(&bm->lock, flags);
 		}
 
 		__wait_clean(bm, &flags);
@@ -490,12 +784,13 @@ static int recycle_block(struct dm_block_manager *bm, dm_block_t where,
 		memset(b->data, 0, bm->block_size);
 		__transition(b, BS_CLEAN);
 	} else {
+		/* Stop b being recycled or shrunk once the io completes */
+		b->waiters++;
 		spin_unlock_irqrestore(&bm->lock, flags);
 		read_block(b);
 		spin_lock_irqsave(&bm->lock, flags);
 		__wait_io(b, &flags);
-
-		/* FIXME: Can b have been recycled between io completion and here? */
+		__put_waiter(b);
 
 		/*
 		 * Did the io succeed?
@@ -506,15 +801,16 @@ static int recycle_block(struct dm_block_manager *bm, dm_block_t where,
 			 * immediately.	 Failed writes are revealed during a commit.
 			 */
 			__transition(b, BS_EMPTY);
+			wake_up(&b->io_q);
 			r = -EIO;
-		}
 
-		if (b->validator) {
+		} else if (b->validator) {
 			r = b->validator->check(b->validator, b, bm->block_size);
 			if (r) {
 				DMERR("%s validator check failed for block %llu",
 				      b->validator->name, (unsigned long long)b->where);
 				__transition(b, BS_EMPTY);
+				wake_up(&b->io_q);
 			}
 		}
 	}
@@ -526,68 +822,6 @@ static int recycle_block(struct dm_block_manager *bm, dm_block_t where,
 	return r;
 }
 
-/*----------------------------------------------------------------
- * Low level block management
- *--------------------------------------------------------------*/
-
-static struct kmem_cache *dm_block_cache;  /* struct dm_block */
-
-static struct dm_block *alloc_block(struct dm_block_manager *bm)
-{
-	struct dm_block *b = kmem_cache_alloc(dm_block_cache, GFP_KERNEL);
-
-	if (!b)
-		return NULL;
-
-	INIT_LIST_HEAD(&b->list);
-	INIT_HLIST_NODE(&b->hlist);
-
-	b->data = kmem_cache_alloc(bm->buffer_cache, GFP_KERNEL);
-	if (!b->data) {
-		kmem_cache_free(dm_block_cache, b);
-		return NULL;
-	}
-
-	b->validator = NULL;
-	b->state = BS_EMPTY;
-	init_waitqueue_head(&b->io_q);
-	b->read_lock_count = 0;
-	b->write_lock_pending = 0;
-	b->io_flags = 0;
-	b->bm = bm;
-
-	return b;
-}
-
-static void free_block(struct dm_block *b)
-{
-	kmem_cache_free(b->bm->buffer_cache, b->data);
-	kmem_cache_free(dm_block_cache, b);
-}
-
-static int populate_bm(struct dm_block_manager *bm, unsigned count)
-{
-	int i;
-	LIST_HEAD(bs);
-
-	for (i = 0; i < count; i++) {
-		struct dm_block *b = alloc_block(bm);
-		if (!b) {
-			struct dm_block *tmp;
-			list_for_each_entry_safe(b, tmp, &bs, list)
-				free_block(b);
-			return -ENOMEM;
-		}
-
-		list_add(&b->list, &bs);
-	}
-
-	list_replace(&bs, &bm->empty_list);
-	bm->available_count = count;
-
-	return 0;
-}
-
 /*----------------------------------------------------------------
  * Public interface
  *--------------------------------------------------------------*/
@@ -606,7 +840,8 @@ struct dm_block_manager *dm_block_manager_create(struct block_device *bdev,
 						 unsigned cache_size)
 {
 	unsigned i;
-	unsigned hash_size = calc_hash_size(cache_size);
+	unsigned max_cache_size = max(cache_size, max_cache_blocks);
+	unsigned hash_size = calc_hash_size(max_cache_size);
 	size_t len = sizeof(struct dm_block_manager) +
 		     sizeof(struct hlist_head) * hash_size;
 	struct dm_block_manager *bm;
@@ -617,6 +852,7 @@ struct dm_block_manager *dm_block_manager_create(struct block_device *bdev,
 
 	bm->bdev = bdev;
 	bm->cache_size = max(MAX_CACHE_SIZE, cache_size);
+	bm->max_cache_size = max(bm->cache_size, max_cache_size);
 	bm->block_size = block_size;
 	bm->nr_blocks = i_size_read(bdev->bd_inode);
 	do_div(bm->nr_blocks, block_size);
@@ -630,6 +866,8 @@ struct dm_block_manager *dm_block_manager_create(struct block_device *bdev,
 	bm->available_count = 0;
 	bm->reading_count = 0;
 	bm->writing_count = 0;
+	bm->dirty_count = 0;
+	INIT_WORK(&bm->writeback_work, do_writeback);
 
 	sprintf(bm->buffer_cache_name, "dm_block_buffer-%d-%d",
 		MAJOR(disk_devt(bdev->bd_disk)),
@@ -650,11 +888,21 @@ struct dm_block_manager *dm_block_manager_create(struct block_device *bdev,
 	if (!bm->io)
 		goto bad_buffer_cache;
 
-	if (populate_bm(bm, cache_size) < 0)
+	bm->wq = alloc_ordered_workqueue("dm-block-manager", WQ_MEM_RECLAIM);
+	if (!bm->wq)
 		goto bad_io_client;
 
+	if (populate_bm(bm, bm->cache_size) < 0)
+		goto bad_wq;
+
+	bm->shrinker.shrink = bm_shrink;
+	bm->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&bm->shrinker);
+
 	return bm;
 
+bad_wq:
+	destroy_workqueue(bm->wq);
 bad_io_client:
 	dm_io_client_destroy(bm->io);
 bad_buffer_cache:
@@ -669,9 +917,20 @@ EXPORT_SYMBOL_GPL(dm_block_manager_create);
 void dm_block_manager_destroy(struct dm_block_manager *bm)
 {
 	int i;
+	unsigned long flags;
 	struct dm_block *b, *btmp;
 	struct hlist_node *n, *tmp;
 
+	unregister_shrinker(&bm->shrinker);
+	destroy_workqueue(bm->wq);
+
+	/*
+	 * Prefetches may still be in flight.
+	 */
+	spin_lock_irqsave(&bm->lock, flags);
+	__wait_all_io(bm, &flags);
+	spin_unlock_irqrestore(&bm->lock, flags);
+
 	dm_io_client_destroy(bm->io);
 
 	for (i = 0; i < bm->hash_size; i++)
@@ -711,28 +970,12 @@ static int lock_internal(struct dm_block_manager *bm, dm_block_t block,
 retry:
 	b = __find_block(bm, block);
 	if (b) {
-		if (!need_read)
-			b->validator = v;
-		else {
-			if (b->validator && (v != b->validator)) {
-				DMERR("validator mismatch (old=%s vs new=%s) for block %llu",
-				      b->validator->name, v ? v->name : "NULL",
-				      (unsigned long long)b->where);
-				spin_unlock_irqrestore(&bm->lock, flags);
-				return -EINVAL;
-
-			}
-			if (!b->validator && v) {
-				b->validator = v;
-				r = b->validator->check(b->validator, b, bm->block_size);
-				if (r) {
-					DMERR("%s validator check failed for block %llu",
-					      b->validator->name,
-					      (unsigned long long)b->where);
-					spin_unlock_irqrestore(&bm->lock, flags);
-					return r;
-				}
-			}
+		if (need_read && b->validator && (v != b->validator)) {
+			DMERR("validator mismatch (old=%s vs new=%s) for block %llu",
+			      b->validator->name, v ? v->name : "NULL",
+			      (unsigned long long)b->where);
+			spin_unlock_irqrestore(&bm->lock, flags);
+			return -EINVAL;
 		}
 
 		switch (how) {
@@ -745,9 +988,11 @@ retry:
 					return -EWOULDBLOCK;
 				}
 
+				b->waiters++;
 				__wait_read_lockable(b, &flags);
+				__put_waiter(b);
 
-				if (b->where != block)
+				if (b->where != block || b->state == BS_EMPTY)
 					goto retry;
 			}
 			break;
@@ -760,14 +1005,32 @@ retry:
 				}
 
 				b->write_lock_pending++;
+				b->waiters++;
 				__wait_unlocked(b, &flags);
+				__put_waiter(b);
 				b->write_lock_pending--;
-				if (b->where != block)
+				if (b->where != block || b->state == BS_EMPTY)
 					goto retry;
 			}
 			break;
 		}
 
+		/*
+		 * Only now is the data known to be in place: a prefetched
+		 * block may have still been reading when we found it.
+		 */
+		if (!need_read)
+			b->validator = v;
+		else if (!b->validator && v) {
+			r = v->check(v, b, bm->block_size);
+			if (r) {
+				DMERR("%s validator check failed for block %llu",
+				      v->name, (unsigned long long)b->where);
+				goto out;
+			}
+			b->validator = v;
+		}
+
 	} else if (!can_block) {
 		r = -EWOULDBLOCK;
 		goto out;
@@ -838,6 +1101,45 @@ int dm_bm_write_lock_zero(struct dm_block_manager *bm,
 	return r;
 }
 
+void dm_bm_prefetch(struct dm_block_manager *bm, dm_block_t where)
+{
+	struct dm_block *b, *new = NULL;
+	unsigned long flags;
+
+	if (where >= bm->nr_blocks)
+		return;
+
+	/*
+	 * We mustn't sleep, so any new block is allocated up front.
+	 */
+	if (bm->nr_allocated < bm->max_cache_size)
+		new = alloc_block(bm, GFP_NOWAIT | __GFP_NOWARN);
+
+	spin_lock_irqsave(&bm->lock, flags);
+	if (new && __add_block(bm, new))
+		new = NULL;
+
+	if (__find_block(bm, where)) {
+		spin_unlock_irqrestore(&bm->lock, flags);
+		goto out;
+	}
+
+	b = __find_free_block(bm);
+	if (b) {
+		b->where = where;
+		b->validator = NULL;
+		__transition(b, BS_READING);
+	}
+	spin_unlock_irqrestore(&bm->lock, flags);
+
+	if (b)
+		submit_io(b, READA, complete_prefetch);
+out:
+	if (new)
+		free_block(new);
+}
+EXPORT_SYMBOL_GPL(dm_bm_prefetch);
+
 int dm_bm_unlock(struct dm_block *b)
 {
 	int r = 0;
@@ -848,12 +1150,17 @@ int dm_bm_unlock(struct dm_block *b)
 	case BS_WRITE_LOCKED:
 		__transition(b, BS_DIRTY);
 		wake_up(&b->io_q);
+		wake_up(&b->bm->io_q);
+
+		if (b->bm->dirty_count > b->bm->nr_allocated / 2)
+			__wake_writeback(b->bm);
 		break;
 
 	case BS_READ_LOCKED:
 		if (!--b->read_lock_count) {
 			__transition(b, BS_CLEAN);
 			wake_up(&b->io_q);
+			wake_up(&b->bm->io_q);
 		}
 		break;
 
@@ -861,6 +1168,7 @@ int dm_bm_unlock(struct dm_block *b)
 		if (!--b->read_lock_count) {
 			__transition(b, BS_DIRTY);
 			wake_up(&b->io_q);
+			wake_up(&b->bm->io_q);
 		}
 		break;
 
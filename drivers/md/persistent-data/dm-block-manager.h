@@ -100,6 +100,14 @@ int dm_bm_write_lock_zero(struct dm_block_manager *bm, dm_block_t b,
 
 int dm_bm_unlock(struct dm_block *b);
 
+/*
+ * Starts reading @b into the cache if it isn't there already, so a
+ * later lock won't have to wait.  Never blocks, and quietly does
+ * nothing if there's no free memory.  The validator runs when the block
+ * is first locked.
+ */
+void dm_bm_prefetch(struct dm_block_manager *bm, dm_block_t b);
+
 /*
  * It's a common idiom to have a superblock that should be committed last.
  *
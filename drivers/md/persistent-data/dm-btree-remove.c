@@ -435,6 +435,15 @@ static int rebalance_children(struct shadow_spine *s,
 	if (i < 0)
 		return -ENODATA;
 
+	/*
+	 * A rebalance needs the siblings as well, start reading them while
+	 * we look at the child itself.
+	 */
+	if (i > 0)
+		dm_tm_prefetch(info->tm, value64(n, i - 1));
+	if (i + 1 < le32_to_cpu(n->header.nr_entries))
+		dm_tm_prefetch(info->tm, value64(n, i + 1));
+
 	r = get_nr_entries(info->tm, value64(n, i), &child_entries);
 	if (r)
 		return r;
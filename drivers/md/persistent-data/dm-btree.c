@@ -321,8 +321,10 @@ static int btree_lookup_raw(struct ro_spine *s, dm_block_t block, uint64_t key,
 		if (i < 0 || i >= nr_entries)
 			return -ENODATA;
 
-		if (flags & INTERNAL_NODE)
+		if (flags & INTERNAL_NODE) {
 			block = value64(ro_node(s), i);
+			dm_tm_prefetch(s->info->tm, block);
+		}
 
 	} while (!(flags & LEAF_NODE));
 
@@ -377,6 +379,98 @@ int dm_btree_lookup(struct dm_btree_info *info, dm_block_t root,
 }
 EXPORT_SYMBOL_GPL(dm_btree_lookup);
 
+/*
+ * Visits the entries of the subtree at @block with keys in [@begin, @end).
+ * The depth of a single btree is small, so recursing is fine here.
+ */
+static int walk_range(struct dm_btree_info *info, dm_block_t block,
+		      uint64_t begin, uint64_t end,
+		      dm_btree_range_fn fn, void *context)
+{
+	int i, r = 0;
+	uint32_t flags, nr_entries;
+	struct dm_block *b;
+	struct node *n;
+
+	r = dm_tm_read_lock(info->tm, block, &btree_node_validator, &b);
+	if (r)
+		return r;
+
+	n = dm_block_data(b);
+	flags = le32_to_cpu(n->header.flags);
+	nr_entries = le32_to_cpu(n->header.nr_entries);
+	i = lower_bound(n, begin);
+
+	if (flags & INTERNAL_NODE) {
+		int j;
+
+		/* Child i holds the keys from keys[i] up to keys[i + 1] */
+		if (i < 0)
+			i = 0;
+
+		/* Start reading the siblings we'll visit after the first */
+		for (j = i + 1; j < nr_entries && le64_to_cpu(n->keys[j]) < end; j++)
+			dm_tm_prefetch(info->tm, value64(n, j));
+
+		for (; i < nr_entries && le64_to_cpu(n->keys[i]) < end; i++) {
+			r = walk_range(info, value64(n, i), begin, end,
+				       fn, context);
+			if (r)
+				break;
+		}
+
+	} else {
+		if (i < 0 || le64_to_cpu(n->keys[i]) < begin)
+			i++;
+		for (; i < nr_entries; i++) {
+			uint64_t key = le64_to_cpu(n->keys[i]);
+
+			if (key >= end)
+				break;
+
+			r = fn(context, key,
+			       value_ptr(n, i, info->value_type.size));
+			if (r)
+				break;
+		}
+	}
+
+	dm_tm_unlock(info->tm, b);
+	return r;
+}
+
+int dm_btree_lookup_range(struct dm_btree_info *info, dm_block_t root,
+			  uint64_t *keys, uint64_t end_key,
+			  dm_btree_range_fn fn, void *context)
+{
+	unsigned level, last_level = info->levels - 1;
+	int r = 0;
+	uint64_t rkey;
+	__le64 internal_value_le;
+	struct ro_spine spine;
+
+	/* Find the bottom level tree */
+	init_ro_spine(&spine, info);
+	for (level = 0; level < last_level; level++) {
+		r = btree_lookup_raw(&spine, root, keys[level],
+				     lower_bound, &rkey,
+				     &internal_value_le, sizeof(uint64_t));
+		if (!r && rkey != keys[level])
+			r = -ENODATA;
+		if (r)
+			break;
+
+		root = le64_to_cpu(internal_value_le);
+	}
+	exit_ro_spine(&spine);
+
+	if (r)
+		return r;
+
+	return walk_range(info, root, keys[last_level], end_key, fn, context);
+}
+EXPORT_SYMBOL_GPL(dm_btree_lookup_range);
+
 /*
  * Splits a node by creating a sibling node and shifting half the nodes
  * contents across.  Assumes there is a parent node, and it has room for
@@ -579,19 +673,38 @@ static int btree_split_beneath(struct shadow_spine *s, uint64_t key)
 	return 0;
 }
 
+/*
+ * If @limit is non-NULL it is set to the lowest key that would not be
+ * routed to the leaf we end up in, or ULLONG_MAX if there is none.
+ */
 static int btree_insert_raw(struct shadow_spine *s, dm_block_t root,
 			    struct dm_btree_value_type *vt,
-			    uint64_t key, unsigned *index)
+			    uint64_t key, unsigned *index, uint64_t *limit)
 {
-	int r, i = *index, inc, top = 1;
+	int r, i = *index, inc, top = 1, parent_in_tree = 0;
 	struct node *node;
 
+	if (limit)
+		*limit = ULLONG_MAX;
+
 	for (;;) {
 		r = shadow_step(s, root, vt, &inc);
 		if (r < 0)
 			return r;
 
 		node = dm_block_data(shadow_current(s));
+
+		/*
+		 * Start reading the child we'll most likely descend into, so
+		 * that the read overlaps with the reference count updates of
+		 * a freshly shadowed node and with any split below.
+		 */
+		if (le32_to_cpu(node->header.flags) & INTERNAL_NODE) {
+			int ci = lower_bound(node, key);
+
+			dm_tm_prefetch(s->info->tm, value64(node, ci < 0 ? 0 : ci));
+		}
+
 		if (inc)
 			inc_children(s->info->tm, node, vt);
 
@@ -618,10 +731,24 @@ static int btree_insert_raw(struct shadow_spine *s, dm_block_t root,
 
 			if (r < 0)
 				return r;
+
+			parent_in_tree = 1;
 		}
 
 		node = dm_block_data(shadow_current(s));
 
+		/*
+		 * Look at the parent after any split, which may have added
+		 * a sibling to the right of us.
+		 */
+		if (limit && parent_in_tree) {
+			struct node *parent = dm_block_data(shadow_parent(s));
+			int pi = lower_bound(parent, key);
+
+			if (pi >= 0 && pi + 1 < le32_to_cpu(parent->header.nr_entries))
+				*limit = min(*limit, le64_to_cpu(parent->keys[pi + 1]));
+		}
+
 		i = lower_bound(node, key);
 
 		if (le32_to_cpu(node->header.flags) & LEAF_NODE)
@@ -635,6 +762,7 @@ static int btree_insert_raw(struct shadow_spine *s, dm_block_t root,
 
 		root = value64(node, i);
 		top = 0;
+		parent_in_tree = 1;
 	}
 
 	if (i < 0 || le64_to_cpu(node->keys[i]) != key)
@@ -651,15 +779,18 @@ static int btree_insert_raw(struct shadow_spine *s, dm_block_t root,
 	return 0;
 }
 
-static int insert(struct dm_btree_info *info, dm_block_t root,
-		  uint64_t *keys, void *value, dm_block_t *new_root,
-		  int *inserted)
-		  __dm_written_to_disk(value)
+/*
+ * Walks @s down to the leaf of the bottom level tree that should hold
+ * @leaf_key, creating missing subtrees for @keys[0 .. levels - 2] on the
+ * way.  @index is set to where @leaf_key belongs in that leaf.
+ */
+static int insert_descend(struct shadow_spine *s, struct dm_btree_info *info,
+			  dm_block_t root, uint64_t *keys, uint64_t leaf_key,
+			  unsigned *index, uint64_t *limit)
 {
 	int r, need_insert;
-	unsigned level, index = -1, last_level = info->levels - 1;
+	unsigned level;
 	dm_block_t block = root;
-	struct shadow_spine spine;
 	struct node *n;
 	struct dm_btree_value_type le64_type;
 
@@ -669,16 +800,16 @@ static int insert(struct dm_btree_info *info, dm_block_t root,
 	le64_type.dec = NULL;
 	le64_type.equal = NULL;
 
-	init_shadow_spine(&spine, info);
-
+	*index = -1;
 	for (level = 0; level < (info->levels - 1); level++) {
-		r = btree_insert_raw(&spine, block, &le64_type, keys[level], &index);
+		r = btree_insert_raw(s, block, &le64_type, keys[level], index,
+				     NULL);
 		if (r < 0)
-			goto bad;
+			return r;
 
-		n = dm_block_data(shadow_current(&spine));
-		need_insert = ((index >= le32_to_cpu(n->header.nr_entries)) ||
-			       (le64_to_cpu(n->keys[index]) != keys[level]));
+		n = dm_block_data(shadow_current(s));
+		need_insert = ((*index >= le32_to_cpu(n->header.nr_entries)) ||
+			       (le64_to_cpu(n->keys[*index]) != keys[level]));
 
 		if (need_insert) {
 			dm_block_t new_tree;
@@ -686,54 +817,80 @@ static int insert(struct dm_btree_info *info, dm_block_t root,
 
 			r = dm_btree_empty(info, &new_tree);
 			if (r < 0)
-				goto bad;
+				return r;
 
 			new_le = cpu_to_le64(new_tree);
 			__dm_bless_for_disk(&new_le);
 
-			r = insert_at(sizeof(uint64_t), n, index,
+			r = insert_at(sizeof(uint64_t), n, *index,
 				      keys[level], &new_le);
 			if (r)
-				goto bad;
+				return r;
 		}
 
-		if (level < last_level)
-			block = value64(n, index);
+		block = value64(n, *index);
 	}
 
-	r = btree_insert_raw(&spine, block, &info->value_type,
-			     keys[level], &index);
-	if (r < 0)
-		goto bad;
+	return btree_insert_raw(s, block, &info->value_type, leaf_key, index,
+				limit);
+}
 
-	n = dm_block_data(shadow_current(&spine));
-	need_insert = ((index >= le32_to_cpu(n->header.nr_entries)) ||
-		       (le64_to_cpu(n->keys[index]) != keys[level]));
+/*
+ * Puts @value at @index of leaf @n, either as a new entry or replacing
+ * the one with the same key.
+ */
+static int insert_value(struct dm_btree_info *info, struct node *n,
+			unsigned index, uint64_t key, void *value,
+			int *inserted)
+			__dm_written_to_disk(value)
+{
+	int need_insert = ((index >= le32_to_cpu(n->header.nr_entries)) ||
+			   (le64_to_cpu(n->keys[index]) != key));
 
 	if (need_insert) {
 		if (inserted)
 			*inserted = 1;
 
-		r = insert_at(info->value_type.size, n, index,
-			      keys[level], value);
-		if (r)
-			goto bad_unblessed;
-	} else {
-		if (inserted)
-			*inserted = 0;
-
-		if (info->value_type.dec &&
-		    (!info->value_type.equal ||
-		     !info->value_type.equal(
-			     info->value_type.context,
-			     value_ptr(n, index, info->value_type.size),
-			     value))) {
-			info->value_type.dec(info->value_type.context,
-					     value_ptr(n, index, info->value_type.size));
-		}
-		memcpy_disk(value_ptr(n, index, info->value_type.size),
-			    value, info->value_type.size);
+		return insert_at(info->value_type.size, n, index, key, value);
+	}
+
+	if (inserted)
+		*inserted = 0;
+
+	if (info->value_type.dec &&
+	    (!info->value_type.equal ||
+	     !info->value_type.equal(
+		     info->value_type.context,
+		     value_ptr(n, index, info->value_type.size),
+		     value))) {
+		info->value_type.dec(info->value_type.context,
+				     value_ptr(n, index, info->value_type.size));
 	}
+	memcpy_disk(value_ptr(n, index, info->value_type.size),
+		    value, info->value_type.size);
+	return 0;
+}
+
+static int insert(struct dm_btree_info *info, dm_block_t root,
+		  uint64_t *keys, void *value, dm_block_t *new_root,
+		  int *inserted)
+		  __dm_written_to_disk(value)
+{
+	int r;
+	unsigned index, last_level = info->levels - 1;
+	struct shadow_spine spine;
+
+	init_shadow_spine(&spine, info);
+
+	r = insert_descend(&spine, info, root, keys, keys[last_level], &index,
+			   NULL);
+	if (r < 0)
+		goto bad;
+
+	r = insert_value(info, dm_block_data(shadow_current(&spine)), index,
+			 keys[last_level], value, inserted);
+	if (r)
+		goto bad_unblessed;
 
 	*new_root = shadow_root(&spine);
 	exit_shadow_spine(&spine);
@@ -747,6 +904,80 @@ bad_unblessed:
 	return r;
 }
 
+int dm_btree_insert_range(struct dm_btree_info *info, dm_block_t root,
+			  uint64_t *keys, const uint64_t *leaf_keys,
+			  void *values, unsigned nr, dm_block_t *new_root,
+			  unsigned *nr_inserted)
+{
+	int r = 0, inserted, have_leaf = 0;
+	unsigned e, index, count = 0;
+	uint64_t limit = 0;
+	size_t value_size = info->value_type.size;
+	struct shadow_spine spine;
+	struct node *n = NULL;
+
+	init_shadow_spine(&spine, info);
+
+	for (e = 0; e < nr; e++) {
+		uint64_t key = leaf_keys[e];
+
+		if (e && key <= leaf_keys[e - 1]) {
+			DMERR("dm_btree_insert_range: keys not ascending");
+			r = -EINVAL;
+			break;
+		}
+
+		/*
+		 * Stay in the current leaf while the key belongs there and
+		 * it has room, otherwise walk down from the root again.
+		 */
+		if (!have_leaf || key >= limit ||
+		    le32_to_cpu(n->header.nr_entries) ==
+		    le32_to_cpu(n->header.max_entries)) {
+			if (have_leaf) {
+				root = shadow_root(&spine);
+				exit_shadow_spine(&spine);
+				init_shadow_spine(&spine, info);
+				have_leaf = 0;
+			}
+
+			r = insert_descend(&spine, info, root, keys, key, &index,
+					   &limit);
+			if (r < 0)
+				break;
+
+			n = dm_block_data(shadow_current(&spine));
+			have_leaf = 1;
+		} else {
+			int i = lower_bound(n, key);
+
+			if (i < 0 || le64_to_cpu(n->keys[i]) != key)
+				i++;
+			index = i;
+		}
+
+		__dm_bless_for_disk(values + e * value_size);
+		r = insert_value(info, n, index, key, values + e * value_size,
+				 &inserted);
+		if (r)
+			break;
+
+		count += inserted;
+	}
+
+	if (have_leaf)
+		*new_root = shadow_root(&spine);
+	else
+		*new_root = root;
+	exit_shadow_spine(&spine);
+
+	if (nr_inserted)
+		*nr_inserted = count;
+
+	return r;
+}
+EXPORT_SYMBOL_GPL(dm_btree_insert_range);
+
 int dm_btree_insert(struct dm_btree_info *info, dm_block_t root,
 		    uint64_t *keys, void *value, dm_block_t *new_root)
 		    __dm_written_to_disk(value)
@@ -117,6 +117,22 @@ int dm_btree_del_gt(struct dm_btree_info *info, dm_block_t root, uint64_t *key,
 int dm_btree_lookup(struct dm_btree_info *info, dm_block_t root,
 		    uint64_t *keys, void *value_le);
 
+/*
+ * Calls @fn in key order for each entry of the bottom level tree picked
+ * out by @keys[0 .. levels - 2] whose key lies in [@keys[levels - 1],
+ * @end_key).  @value_le is only valid during the call, and @fn must not
+ * modify the tree.  Each node is read once: O(ln(n) + k).
+ *
+ * Iteration stops as soon as @fn returns non-zero, and that value is
+ * returned.  Returns -ENODATA if the bottom level tree is missing.
+ */
+typedef int (*dm_btree_range_fn)(void *context, uint64_t key,
+				 void *value_le);
+
+int dm_btree_lookup_range(struct dm_btree_info *info, dm_block_t root,
+			  uint64_t *keys, uint64_t end_key,
+			  dm_btree_range_fn fn, void *context);
+
 /*
  * Insertion (or overwrite an existing value).  O(ln(n))
  */
@@ -134,6 +150,22 @@ int dm_btree_insert_notify(struct dm_btree_info *info, dm_block_t root,
 			   int *inserted)
 			   __dm_written_to_disk(value);
 
+/*
+ * Inserts (or overwrites) @nr entries into the bottom level tree picked
+ * out by @keys[0 .. levels - 2].  @leaf_keys must be strictly ascending
+ * and @values holds @nr values, each info->value_type.size bytes.
+ * Consecutive keys that land in the same leaf are added without walking
+ * down from the root again, so clustered keys cost O(ln(n) + nr).
+ *
+ * @nr_inserted, if non-NULL, is set to the number of keys that were not
+ * already present.  As with dm_btree_insert(), the transaction must be
+ * aborted if an error is returned.
+ */
+int dm_btree_insert_range(struct dm_btree_info *info, dm_block_t root,
+			  uint64_t *keys, const uint64_t *leaf_keys,
+			  void *values, unsigned nr, dm_block_t *new_root,
+			  unsigned *nr_inserted);
+
 /*
  * Remove a key if present.  This doesn't remove empty sub trees.  Normally
  * subtrees represent a separate entity, like a snapshot map, so this is
@@ -97,6 +97,11 @@ int dm_tm_read_lock(struct dm_transaction_manager *tm, dm_block_t b,
 
 int dm_tm_unlock(struct dm_transaction_manager *tm, struct dm_block *b);
 
+/*
+ * Hint that @b will be read locked soon.
+ */
+void dm_tm_prefetch(struct dm_transaction_manager *tm, dm_block_t b);
+
 /*
  * Functions for altering the reference count of a block directly.
  */
@@ -68,6 +68,8 @@
 #define BYPASS_THRESHOLD	1
 #define NR_HASH			(PAGE_SIZE / sizeof(struct hlist_head))
 #define HASH_MASK		(NR_HASH - 1)
+#define MAX_STRIPE_BATCH	8	/* stripes handled per device_lock hold */
+#define ANY_GROUP		NUMA_NO_NODE
 
 #define stripe_hash(conf, sect)	(&((conf)->stripe_hashtbl[((sect) >> STRIPE_SHIFT) & HASH_MASK]))
 
@@ -186,6 +188,65 @@ static void return_io(struct bio *return_bi)
 
 static void print_raid5_conf (raid5_conf_t *conf);
 
+static struct workqueue_struct *raid5_wq;
+
+static inline int cpu_to_group(int cpu)
+{
+	return cpu_to_node(cpu);
+}
+
+/* The cpu to run worker @i of the group of @cpu on */
+static int raid5_worker_cpu(int cpu, int i)
+{
+	const struct cpumask *mask = cpumask_of_node(cpu_to_node(cpu));
+
+	while (i--) {
+		cpu = cpumask_next_and(cpu, mask, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first_and(mask, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			return cpumask_any(cpu_online_mask);
+	}
+	return cpu;
+}
+
+/*
+ * Queue @sh on the worker group of its cpu and make sure enough of
+ * the group's workers are running: one, plus one for each further
+ * batch of stripes waiting.  Called with device_lock held.
+ */
+static void raid5_wakeup_stripe_thread(struct stripe_head *sh)
+{
+	raid5_conf_t *conf = sh->raid_conf;
+	struct r5worker_group *group;
+	int thread_cnt;
+	int i, cpu = sh->cpu;
+
+	if (!cpu_online(cpu)) {
+		cpu = cpumask_any(cpu_online_mask);
+		sh->cpu = cpu;
+	}
+
+	group = conf->worker_groups + cpu_to_group(cpu);
+	list_add_tail(&sh->lru, &group->handle_list);
+	group->stripes_cnt++;
+	sh->group = group;
+
+	/* at least one worker must run, or the stripe could be stranded */
+	group->workers[0].working = 1;
+	queue_work_on(cpu, raid5_wq, &group->workers[0].work);
+
+	thread_cnt = group->stripes_cnt / MAX_STRIPE_BATCH - 1;
+	for (i = 1; i < conf->worker_cnt_per_group && thread_cnt > 0; i++) {
+		if (!group->workers[i].working) {
+			group->workers[i].working = 1;
+			queue_work_on(raid5_worker_cpu(cpu, i), raid5_wq,
+				      &group->workers[i].work);
+			thread_cnt--;
+		}
+	}
+}
+
 static int stripe_operations_active(struct stripe_head *sh)
 {
 	return sh->check_state || sh->reconstruct_state ||
@@ -208,6 +269,10 @@ static void __release_stripe(raid5_conf_t *conf, struct stripe_head *sh)
 				plugger_set_plug(&conf->plug);
 			} else {
 				clear_bit(STRIPE_BIT_DELAY, &sh->state);
+				if (conf->worker_cnt_per_group) {
+					raid5_wakeup_stripe_thread(sh);
+					return;
+				}
 				list_add_tail(&sh->lru, &conf->handle_list);
 			}
 			md_wakeup_thread(conf->mddev->thread);
@@ -327,6 +392,7 @@ static void init_stripe(struct stripe_head *sh, sector_t sector, int previous)
 
 	remove_hash(sh);
 
+	sh->cpu = smp_processor_id();
 	sh->generation = conf->generation - previous;
 	sh->disks = previous ? conf->previous_raid_disks : conf->raid_disks;
 	sh->sector = sector;
@@ -3936,18 +4002,32 @@ static int chunk_aligned_read(mddev_t *mddev, struct bio * raid_bio)
  * head of the hold_list has changed, i.e. the head was promoted to the
  * handle_list.
  */
-static struct stripe_head *__get_priority_stripe(raid5_conf_t *conf)
+static struct stripe_head *__get_priority_stripe(raid5_conf_t *conf, int group)
 {
 	struct stripe_head *sh;
+	struct list_head *handle_list = NULL;
+
+	if (conf->worker_cnt_per_group == 0) {
+		handle_list = &conf->handle_list;
+	} else if (group != ANY_GROUP) {
+		handle_list = &conf->worker_groups[group].handle_list;
+	} else {
+		int i;
+		for (i = 0; i < conf->group_cnt; i++) {
+			handle_list = &conf->worker_groups[i].handle_list;
+			if (!list_empty(handle_list))
+				break;
+		}
+	}
 
 	pr_debug("%s: handle: %s hold: %s full_writes: %d bypass_count: %d\n",
 		  __func__,
-		  list_empty(&conf->handle_list) ? "empty" : "busy",
+		  list_empty(handle_list) ? "empty" : "busy",
 		  list_empty(&conf->hold_list) ? "empty" : "busy",
 		  atomic_read(&conf->pending_full_writes), conf->bypass_count);
 
-	if (!list_empty(&conf->handle_list)) {
-		sh = list_entry(conf->handle_list.next, typeof(*sh), lru);
+	if (!list_empty(handle_list)) {
+		sh = list_entry(handle_list->next, typeof(*sh), lru);
 
 		if (list_empty(&conf->hold_list))
 			conf->bypass_count = 0;
@@ -3961,7 +4041,8 @@ static struct stripe_head *__get_priority_stripe(raid5_conf_t *conf)
 					conf->bypass_count = 0;
 			}
 		}
-	} else if (!list_empty(&conf->hold_list) &&
+	} else if (group == ANY_GROUP &&
+		   !list_empty(&conf->hold_list) &&
 		   ((conf->bypass_threshold &&
 		     conf->bypass_count > conf->bypass_threshold) ||
 		    atomic_read(&conf->pending_full_writes) == 0)) {
@@ -3974,6 +4055,10 @@ static struct stripe_head *__get_priority_stripe(raid5_conf_t *conf)
 		return NULL;
 
 	list_del_init(&sh->lru);
+	if (sh->group) {
+		sh->group->stripes_cnt--;
+		sh->group = NULL;
+	}
 	atomic_inc(&sh->count);
 	BUG_ON(atomic_read(&sh->count) != 1);
 	return sh;
@@ -4510,6 +4595,65 @@ static int  retry_aligned_read(raid5_conf_t *conf, struct bio *raid_bio)
 }
 
 
+/*
+ * Take up to MAX_STRIPE_BATCH stripes of @group (ANY_GROUP for raid5d)
+ * in one go, handle them without device_lock and release them together.
+ * Called, and returns, with device_lock held.
+ */
+static int handle_active_stripes(raid5_conf_t *conf, int group)
+{
+	struct stripe_head *batch[MAX_STRIPE_BATCH], *sh;
+	int i, batch_size = 0;
+
+	while (batch_size < MAX_STRIPE_BATCH &&
+	       (sh = __get_priority_stripe(conf, group)) != NULL)
+		batch[batch_size++] = sh;
+
+	if (batch_size == 0)
+		return 0;
+	spin_unlock_irq(&conf->device_lock);
+
+	for (i = 0; i < batch_size; i++)
+		handle_stripe(batch[i]);
+
+	cond_resched();
+
+	spin_lock_irq(&conf->device_lock);
+	for (i = 0; i < batch_size; i++)
+		__release_stripe(conf, batch[i]);
+	return batch_size;
+}
+
+static void raid5_do_work(struct work_struct *work)
+{
+	struct r5worker *worker = container_of(work, struct r5worker, work);
+	struct r5worker_group *group = worker->group;
+	raid5_conf_t *conf = group->conf;
+	int group_id = group - conf->worker_groups;
+	int handled = 0;
+
+	pr_debug("+++ raid5worker active\n");
+
+	spin_lock_irq(&conf->device_lock);
+	while (1) {
+		int batch_size;
+
+		batch_size = handle_active_stripes(conf, group_id);
+		worker->working = 0;
+		if (!batch_size)
+			break;
+		handled += batch_size;
+	}
+	pr_debug("%d stripes handled\n", handled);
+
+	spin_unlock_irq(&conf->device_lock);
+
+	async_tx_issue_pending_all();
+	unplug_slaves(conf->mddev);
+
+	pr_debug("--- raid5worker inactive\n");
+}
+
 /*
  * This is our raid5 kernel thread.
  *
@@ -4519,9 +4663,8 @@ static int  retry_aligned_read(raid5_conf_t *conf, struct bio *raid_bio)
  */
 static void raid5d(mddev_t *mddev)
 {
-	struct stripe_head *sh;
 	raid5_conf_t *conf = mddev->private;
-	int handled;
+	int handled, batch_size;
 
 	pr_debug("+++ raid5d active\n");
 
@@ -4551,18 +4694,10 @@ static void raid5d(mddev_t *mddev)
 			handled++;
 		}
 
-		sh = __get_priority_stripe(conf);
-
-		if (!sh)
+		batch_size = handle_active_stripes(conf, ANY_GROUP);
+		if (!batch_size)
 			break;
-		spin_unlock_irq(&conf->device_lock);
-		
-		handled++;
-		handle_stripe(sh);
-		release_stripe(sh);
-		cond_resched();
-
-		spin_lock_irq(&conf->device_lock);
+		handled += batch_size;
 	}
 	pr_debug("%d stripes handled\n", handled);
 
@@ -4669,6 +4804,60 @@ raid5_preread_bypass_threshold = __ATTR(preread_bypass_threshold,
 					raid5_show_preread_threshold,
 					raid5_store_preread_threshold);
 
+static int alloc_thread_groups(raid5_conf_t *conf, int cnt);
+static void free_thread_groups(struct r5worker_group *groups);
+
+static ssize_t
+raid5_show_group_thread_cnt(mddev_t *mddev, char *page)
+{
+	raid5_conf_t *conf = mddev->private;
+	if (conf)
+		return sprintf(page, "%d\n", conf->worker_cnt_per_group);
+	else
+		return 0;
+}
+
+static ssize_t
+raid5_store_group_thread_cnt(mddev_t *mddev, const char *page, size_t len)
+{
+	raid5_conf_t *conf = mddev->private;
+	struct r5worker_group *old_groups;
+	unsigned long new;
+	int err;
+
+	if (len >= PAGE_SIZE)
+		return -EINVAL;
+	if (!conf)
+		return -ENODEV;
+
+	if (strict_strtoul(page, 10, &new))
+		return -EINVAL;
+	if (new > num_possible_cpus())
+		return -EINVAL;
+	if (new == conf->worker_cnt_per_group)
+		return len;
+
+	/* No stripes may be queued on the old groups while we switch */
+	mddev_suspend(mddev);
+
+	old_groups = conf->worker_groups;
+	if (old_groups)
+		flush_workqueue(raid5_wq);
+
+	err = alloc_thread_groups(conf, new);
+	if (!err)
+		free_thread_groups(old_groups);
+
+	mddev_resume(mddev);
+
+	return err ?: len;
+}
+
+static struct md_sysfs_entry
+raid5_group_thread_cnt = __ATTR(group_thread_cnt, S_IRUGO | S_IWUSR,
+				raid5_show_group_thread_cnt,
+				raid5_store_group_thread_cnt);
+
 static ssize_t
 stripe_cache_active_show(mddev_t *mddev, char *page)
 {
@@ -4686,6 +4875,7 @@ static struct attribute *raid5_attrs[] =  {
 	&raid5_stripecache_size.attr,
 	&raid5_stripecache_active.attr,
 	&raid5_preread_bypass_threshold.attr,
+	&raid5_group_thread_cnt.attr,
 	NULL,
 };
 static struct attribute_group raid5_attrs_group = {
@@ -4731,8 +4921,56 @@ static void raid5_free_percpu(raid5_conf_t *conf)
 	free_percpu(conf->percpu);
 }
 
+static int alloc_thread_groups(raid5_conf_t *conf, int cnt)
+{
+	int i, j;
+	struct r5worker *workers;
+	struct r5worker_group *groups;
+
+	if (cnt == 0) {
+		conf->worker_groups = NULL;
+		conf->group_cnt = 0;
+		conf->worker_cnt_per_group = 0;
+		return 0;
+	}
+
+	groups = kzalloc(sizeof(*groups) * nr_node_ids, GFP_NOIO);
+	workers = kzalloc(sizeof(*workers) * cnt * nr_node_ids, GFP_NOIO);
+	if (!groups || !workers) {
+		kfree(groups);
+		kfree(workers);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nr_node_ids; i++) {
+		struct r5worker_group *group = &groups[i];
+
+		INIT_LIST_HEAD(&group->handle_list);
+		group->conf = conf;
+		group->workers = workers + i * cnt;
+
+		for (j = 0; j < cnt; j++) {
+			group->workers[j].group = group;
+			INIT_WORK(&group->workers[j].work, raid5_do_work);
+		}
+	}
+
+	conf->worker_groups = groups;
+	conf->group_cnt = nr_node_ids;
+	conf->worker_cnt_per_group = cnt;
+	return 0;
+}
+
+static void free_thread_groups(struct r5worker_group *groups)
+{
+	if (groups)
+		kfree(groups[0].workers);
+	kfree(groups);
+}
+
 static void free_conf(raid5_conf_t *conf)
 {
+	free_thread_groups(conf->worker_groups);
 	shrink_stripes(conf);
 	raid5_free_percpu(conf);
 	kfree(conf->disks);
@@ -5235,6 +5473,8 @@ static int stop(mddev_t *mddev)
 
 	md_unregister_thread(mddev->thread);
 	mddev->thread = NULL;
+	if (conf->worker_groups)
+		flush_workqueue(raid5_wq);
 	if (mddev->queue)
 		mddev->queue->backing_dev_info.congested_fn = NULL;
 	plugger_flush(&conf->plug); /* the unplug fn references 'conf'*/
@@ -6033,6 +6273,10 @@ static struct mdk_personality raid4_personality =
 
 static int __init raid5_init(void)
 {
+	raid5_wq = alloc_workqueue("raid5wq", WQ_NON_REENTRANT |
+				   WQ_CPU_INTENSIVE | WQ_MEM_RECLAIM, 0);
+	if (!raid5_wq)
+		return -ENOMEM;
 	register_md_personality(&raid6_personality);
 	register_md_personality(&raid5_personality);
 	register_md_personality(&raid4_personality);
@@ -6044,6 +6288,7 @@ static void raid5_exit(void)
 	unregister_md_personality(&raid6_personality);
 	unregister_md_personality(&raid5_personality);
 	unregister_md_personality(&raid4_personality);
+	destroy_workqueue(raid5_wq);
 }
 
 module_init(raid5_init);
@@ -197,10 +197,31 @@ enum reconstruct_states {
 	reconstruct_state_result,
 };
 
+/*
+ * handle_stripe() work can be spread over a pool of worker threads.
+ * There is one group of workers per NUMA node, each with its own list
+ * of stripes to handle; all lists are still under device_lock.
+ */
+struct r5worker {
+	struct work_struct	work;
+	struct r5worker_group	*group;
+	int			working;
+};
+
+struct r5worker_group {
+	struct list_head	handle_list;
+	struct raid5_private_data *conf;
+	struct r5worker		*workers;
+	int			stripes_cnt;
+};
+
 struct stripe_head {
 	struct hlist_node	hash;
 	struct list_head	lru;	      /* inactive_list or handle_list */
 	struct raid5_private_data *raid_conf;
+	int			cpu;	      /* cpu that submitted to it */
+	struct r5worker_group	*group;	      /* handle_list it is on, if
+					       * any, with worker threads */
 	short			generation;	/* increments with every
 						 * reshape */
 	sector_t		sector;		/* sector of this row */
@@ -373,6 +394,15 @@ struct raid5_private_data {
 
 	struct list_head	handle_list; /* stripes needing handling */
 	struct list_head	hold_list; /* preread ready stripes */
+
+	/* With worker threads, stripes needing handling are queued on the
+	 * group of the cpu that submitted them instead of handle_list.
+	 * raid5d still handles hold_list and anything the workers leave.
+	 */
+	struct r5worker_group	*worker_groups;
+	int			group_cnt;
+	int			worker_cnt_per_group;
+
 	struct list_head	delayed_list; /* stripes that have plugged requests */
 	struct list_head	bitmap_list; /* stripes delaying awaiting bitmap update */
 	struct bio		*retry_read_aligned; /* currently retrying aligned bios   */
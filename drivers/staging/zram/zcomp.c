@@ -0,0 +1,328 @@
+/*
+ * Compressed RAM block device - compression streams
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#define KMSG_COMPONENT "zram"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zcomp.h"
+
+/* Built-in backends, in the order they are listed in sysfs */
+static struct zcomp_backend *backends[] = {
+	&zcomp_lzo,
+#ifdef CONFIG_ZRAM_DEFLATE
+	&zcomp_deflate,
+#endif
+	NULL
+};
+
+/*
+ * Built-in backends take precedence; any other name is looked up
+ * as a compression algorithm of the crypto API.
+ */
+static struct zcomp_backend *find_backend(const char *comp)
+{
+	int i;
+
+	for (i = 0; backends[i]; i++)
+		if (sysfs_streq(comp, backends[i]->name))
+			return backends[i];
+
+#ifdef CONFIG_ZRAM_CRYPTO
+	if (crypto_has_comp(comp, 0, 0))
+		return &zcomp_crypto;
+#endif
+	return NULL;
+}
+
+int zcomp_available_algorithm(const char *comp)
+{
+	return find_backend(comp) != NULL;
+}
+
+/* show available compressors, the selected one in brackets */
+ssize_t zcomp_available_show(const char *comp, char *buf)
+{
+	int i, found = 0;
+	ssize_t sz = 0;
+
+	for (i = 0; backends[i]; i++) {
+		if (!strcmp(comp, backends[i]->name)) {
+			found = 1;
+			sz += sprintf(buf + sz, "[%s] ", backends[i]->name);
+		} else {
+			sz += sprintf(buf + sz, "%s ", backends[i]->name);
+		}
+	}
+
+	/* A crypto API algorithm was selected */
+	if (!found)
+		sz += sprintf(buf + sz, "[%s] ", comp);
+
+	sz += sprintf(buf + sz, "\n");
+	return sz;
+}
+
+static void zcomp_strm_free(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	if (zstrm->private)
+		comp->backend->destroy(zstrm->private);
+	free_pages((unsigned long)zstrm->buffer, 1);
+	kfree(zstrm);
+}
+
+/*
+ * Streams are allocated from the I/O path when a writer finds none
+ * idle, so we must not recurse into the block layer here.
+ */
+static struct zcomp_strm *zcomp_strm_alloc(struct zcomp *comp, gfp_t flags)
+{
+	struct zcomp_strm *zstrm;
+
+	zstrm = kmalloc(sizeof(*zstrm), flags);
+	if (!zstrm)
+		return NULL;
+
+	zstrm->private = comp->backend->create(comp->name, flags);
+	/*
+	 * Allocate 2 pages: 1 for compressed data, plus 1 extra for
+	 * the case when compressed size is larger than the original.
+	 */
+	zstrm->buffer = (void *)__get_free_pages(flags | __GFP_ZERO, 1);
+	if (!zstrm->private || !zstrm->buffer) {
+		zcomp_strm_free(comp, zstrm);
+		return NULL;
+	}
+
+	return zstrm;
+}
+
+/* May a writer allocate a new stream from the I/O path? */
+static int zcomp_may_grow(struct zcomp *comp)
+{
+	return !comp->backend->prealloc_strm &&
+		comp->avail_strm < comp->max_strm;
+}
+
+/*
+ * Get an idle stream, allocating a new one if we are below the
+ * limit, or wait for another writer to release one.
+ */
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (1) {
+		spin_lock(&comp->strm_lock);
+		if (!list_empty(&comp->idle_strm)) {
+			zstrm = list_first_entry(&comp->idle_strm,
+					struct zcomp_strm, list);
+			list_del(&zstrm->list);
+			spin_unlock(&comp->strm_lock);
+			return zstrm;
+		}
+
+		/* All streams are busy and we may not allocate more */
+		if (!zcomp_may_grow(comp)) {
+			spin_unlock(&comp->strm_lock);
+			wait_event(comp->strm_wait,
+				!list_empty(&comp->idle_strm) ||
+				zcomp_may_grow(comp));
+			continue;
+		}
+
+		comp->avail_strm++;
+		spin_unlock(&comp->strm_lock);
+
+		zstrm = zcomp_strm_alloc(comp, GFP_NOIO);
+		if (zstrm)
+			return zstrm;
+
+		/* Out of memory: fall back to waiting for a busy stream */
+		spin_lock(&comp->strm_lock);
+		comp->avail_strm--;
+		spin_unlock(&comp->strm_lock);
+		wait_event(comp->strm_wait, !list_empty(&comp->idle_strm));
+	}
+}
+
+/*
+ * Return the stream to the idle list, or free it if the limit was
+ * lowered while it was in use.
+ */
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	spin_lock(&comp->strm_lock);
+	if (comp->avail_strm <= comp->max_strm) {
+		list_add(&zstrm->list, &comp->idle_strm);
+		spin_unlock(&comp->strm_lock);
+		wake_up(&comp->strm_wait);
+		return;
+	}
+
+	comp->avail_strm--;
+	spin_unlock(&comp->strm_lock);
+	zcomp_strm_free(comp, zstrm);
+	wake_up(&comp->strm_wait);
+}
+
+/*
+ * Allocate streams up to the limit for backends that cannot create
+ * them on the I/O path. Process context only. Running short of
+ * memory is not fatal: writers just share fewer streams.
+ */
+static void zcomp_strm_prealloc(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	if (!comp->backend->prealloc_strm)
+		return;
+
+	while (1) {
+		spin_lock(&comp->strm_lock);
+		if (comp->avail_strm >= comp->max_strm) {
+			spin_unlock(&comp->strm_lock);
+			break;
+		}
+		comp->avail_strm++;
+		spin_unlock(&comp->strm_lock);
+
+		zstrm = zcomp_strm_alloc(comp, GFP_KERNEL);
+		if (!zstrm) {
+			spin_lock(&comp->strm_lock);
+			comp->avail_strm--;
+			spin_unlock(&comp->strm_lock);
+			break;
+		}
+		zcomp_strm_release(comp, zstrm);
+	}
+}
+
+/*
+ * Change the stream limit. Idle streams above the new limit are
+ * freed immediately; busy ones are freed when released.
+ */
+void zcomp_set_max_streams(struct zcomp *comp, int num_strm)
+{
+	struct zcomp_strm *zstrm;
+
+	spin_lock(&comp->strm_lock);
+	comp->max_strm = num_strm;
+	while (comp->avail_strm > num_strm &&
+			!list_empty(&comp->idle_strm)) {
+		zstrm = list_first_entry(&comp->idle_strm,
+				struct zcomp_strm, list);
+		list_del(&zstrm->list);
+		comp->avail_strm--;
+		spin_unlock(&comp->strm_lock);
+		zcomp_strm_free(comp, zstrm);
+		spin_lock(&comp->strm_lock);
+	}
+	spin_unlock(&comp->strm_lock);
+
+	zcomp_strm_prealloc(comp);
+
+	/* Writers may now be allowed to allocate a new stream */
+	wake_up(&comp->strm_wait);
+}
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+			const unsigned char *src, size_t *dst_len)
+{
+	return comp->backend->compress(src, zstrm->buffer, dst_len,
+					zstrm->private);
+}
+
+/*
+ * Readers only need a stream if the backend keeps decompression
+ * state. Must be called before entering atomic context since we
+ * may have to wait for a stream.
+ */
+struct zcomp_strm *zcomp_decompress_begin(struct zcomp *comp)
+{
+	if (!comp->backend->decompress_needs_strm)
+		return NULL;
+
+	return zcomp_strm_find(comp);
+}
+
+void zcomp_decompress_end(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	if (zstrm)
+		zcomp_strm_release(comp, zstrm);
+}
+
+int zcomp_decompress(struct zcomp *comp, struct zcomp_strm *zstrm,
+			const unsigned char *src, size_t src_len,
+			unsigned char *dst)
+{
+	return comp->backend->decompress(src, src_len, dst,
+				zstrm ? zstrm->private : NULL);
+}
+
+void zcomp_destroy(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	while (!list_empty(&comp->idle_strm)) {
+		zstrm = list_first_entry(&comp->idle_strm,
+				struct zcomp_strm, list);
+		list_del(&zstrm->list);
+		zcomp_strm_free(comp, zstrm);
+	}
+	kfree(comp);
+}
+
+/*
+ * One stream is allocated up front so that writers can always make
+ * forward progress, even if later stream allocations fail.
+ */
+struct zcomp *zcomp_create(const char *compress, int max_strm)
+{
+	struct zcomp *comp;
+	struct zcomp_strm *zstrm;
+	struct zcomp_backend *backend;
+
+	backend = find_backend(compress);
+	if (!backend)
+		return NULL;
+
+	comp = kzalloc(sizeof(*comp), GFP_KERNEL);
+	if (!comp)
+		return NULL;
+
+	comp->backend = backend;
+	strlcpy(comp->name, compress, sizeof(comp->name));
+
+	spin_lock_init(&comp->strm_lock);
+	INIT_LIST_HEAD(&comp->idle_strm);
+	init_waitqueue_head(&comp->strm_wait);
+	comp->max_strm = max_strm;
+
+	zstrm = zcomp_strm_alloc(comp, GFP_KERNEL);
+	if (!zstrm) {
+		kfree(comp);
+		return NULL;
+	}
+	list_add(&zstrm->list, &comp->idle_strm);
+	comp->avail_strm = 1;
+
+	zcomp_strm_prealloc(comp);
+
+	return comp;
+}
@@ -0,0 +1,105 @@
+/*
+ * Compressed RAM block device - compression streams
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#ifndef _ZCOMP_H_
+#define _ZCOMP_H_
+
+#include <linux/crypto.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+/*
+ * A compression stream: backend private state (working memory,
+ * crypto transform, ...) plus a buffer large enough to hold the
+ * output for one page (even when it expands). Only one user may
+ * hold a stream at a time.
+ */
+struct zcomp_strm {
+	void *private;
+	void *buffer;	/* 2 pages */
+	struct list_head list;
+};
+
+/*
+ * Compressor backend operations. compress() gets a 2 page output
+ * buffer in dst and updates dst_len with the compressed size;
+ * decompress() always produces exactly one page. Both return 0
+ * on success.
+ */
+struct zcomp_backend {
+	int (*compress)(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *private);
+	int (*decompress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst, void *private);
+
+	void *(*create)(const char *name, gfp_t flags);
+	void (*destroy)(void *private);
+
+	/* Decompression needs the stream private state too */
+	int decompress_needs_strm;
+	/*
+	 * create() may sleep in GFP_KERNEL allocations or module loads,
+	 * so all streams are allocated up front, never on the I/O path.
+	 */
+	int prealloc_strm;
+
+	const char *name;
+};
+
+extern struct zcomp_backend zcomp_lzo;
+#ifdef CONFIG_ZRAM_DEFLATE
+extern struct zcomp_backend zcomp_deflate;
+#endif
+#ifdef CONFIG_ZRAM_CRYPTO
+extern struct zcomp_backend zcomp_crypto;
+#endif
+
+/*
+ * Pool of compression streams shared by all users of a device.
+ * Streams are created on demand up to max_strm; users that find
+ * no idle stream sleep on strm_wait until one is released.
+ */
+struct zcomp {
+	spinlock_t strm_lock;	/* protect idle_strm and counters */
+	struct list_head idle_strm;
+	wait_queue_head_t strm_wait;
+	int avail_strm;		/* no. of streams allocated */
+	int max_strm;		/* upper limit on avail_strm */
+
+	struct zcomp_backend *backend;
+	char name[CRYPTO_MAX_ALG_NAME];
+};
+
+int zcomp_available_algorithm(const char *comp);
+ssize_t zcomp_available_show(const char *comp, char *buf);
+
+struct zcomp *zcomp_create(const char *comp, int max_strm);
+void zcomp_destroy(struct zcomp *comp);
+
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp);
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm);
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+			const unsigned char *src, size_t *dst_len);
+
+struct zcomp_strm *zcomp_decompress_begin(struct zcomp *comp);
+void zcomp_decompress_end(struct zcomp *comp, struct zcomp_strm *zstrm);
+int zcomp_decompress(struct zcomp *comp, struct zcomp_strm *zstrm,
+			const unsigned char *src, size_t src_len,
+			unsigned char *dst);
+
+void zcomp_set_max_streams(struct zcomp *comp, int num_strm);
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ * Compressed RAM block device - crypto API compressor backend
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#include <linux/crypto.h>
+#include <linux/err.h>
+#include <linux/kernel.h>
+
+#include "zcomp.h"
+
+/*
+ * Each stream owns a transform since compression algorithms keep
+ * per-transform state which must not be shared by concurrent users.
+ * crypto_alloc_comp() ignores @flags, hence prealloc_strm below.
+ */
+static void *crypto_create(const char *name, gfp_t flags)
+{
+	struct crypto_comp *tfm;
+
+	tfm = crypto_alloc_comp(name, 0, 0);
+	if (IS_ERR(tfm))
+		return NULL;
+
+	return tfm;
+}
+
+static void crypto_destroy(void *private)
+{
+	crypto_free_comp(private);
+}
+
+static int crypto_compress(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *private)
+{
+	int ret;
+	unsigned int dlen = 2 * PAGE_SIZE;
+
+	ret = crypto_comp_compress(private, src, PAGE_SIZE, dst, &dlen);
+	if (ret)
+		return ret;
+
+	*dst_len = dlen;
+	return 0;
+}
+
+static int crypto_decompress(const unsigned char *src, size_t src_len,
+			unsigned char *dst, void *private)
+{
+	int ret;
+	unsigned int dlen = PAGE_SIZE;
+
+	ret = crypto_comp_decompress(private, src, src_len, dst, &dlen);
+	if (ret)
+		return ret;
+
+	return dlen == PAGE_SIZE ? 0 : -EINVAL;
+}
+
+/* Generic backend: name is whatever crypto_has_comp() accepted */
+struct zcomp_backend zcomp_crypto = {
+	.compress = crypto_compress,
+	.decompress = crypto_decompress,
+	.create = crypto_create,
+	.destroy = crypto_destroy,
+	.decompress_needs_strm = 1,
+	.prealloc_strm = 1,
+	.name = "crypto",
+};
@@ -0,0 +1,130 @@
+/*
+ * Compressed RAM block device - deflate compressor backend
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/zlib.h>
+
+#include "zcomp.h"
+
+/* A page fits entirely in the window: no need for the 32K default */
+#define ZCOMP_DEFLATE_WINBITS	12
+#define ZCOMP_DEFLATE_MEMLEVEL	MAX_MEM_LEVEL
+
+struct zcomp_deflate {
+	struct z_stream_s comp_stream;
+	struct z_stream_s decomp_stream;
+};
+
+static void deflate_destroy(void *private)
+{
+	struct zcomp_deflate *zd = private;
+
+	vfree(zd->comp_stream.workspace);
+	kfree(zd->decomp_stream.workspace);
+	kfree(zd);
+}
+
+/*
+ * __vmalloc() of the deflate workspace allocates its page tables with
+ * GFP_KERNEL whatever @flags say, hence prealloc_strm below.
+ */
+static void *deflate_create(const char *name, gfp_t flags)
+{
+	struct zcomp_deflate *zd;
+
+	zd = kzalloc(sizeof(*zd), flags);
+	if (!zd)
+		return NULL;
+
+	zd->comp_stream.workspace = __vmalloc(zlib_deflate_workspacesize(),
+					flags | __GFP_HIGHMEM, PAGE_KERNEL);
+	zd->decomp_stream.workspace = kmalloc(zlib_inflate_workspacesize(),
+					flags);
+	if (!zd->comp_stream.workspace || !zd->decomp_stream.workspace)
+		goto fail;
+
+	if (zlib_deflateInit2(&zd->comp_stream, Z_DEFAULT_COMPRESSION,
+			Z_DEFLATED, ZCOMP_DEFLATE_WINBITS,
+			ZCOMP_DEFLATE_MEMLEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+		goto fail;
+
+	if (zlib_inflateInit2(&zd->decomp_stream,
+			ZCOMP_DEFLATE_WINBITS) != Z_OK)
+		goto fail;
+
+	return zd;
+
+fail:
+	deflate_destroy(zd);
+	return NULL;
+}
+
+static int deflate_compress(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *private)
+{
+	int ret;
+	struct zcomp_deflate *zd = private;
+	struct z_stream_s *stream = &zd->comp_stream;
+
+	ret = zlib_deflateReset(stream);
+	if (ret != Z_OK)
+		return ret;
+
+	stream->next_in = src;
+	stream->avail_in = PAGE_SIZE;
+	stream->next_out = dst;
+	stream->avail_out = 2 * PAGE_SIZE;
+
+	ret = zlib_deflate(stream, Z_FINISH);
+	if (ret != Z_STREAM_END)
+		return ret == Z_OK ? Z_BUF_ERROR : ret;
+
+	*dst_len = stream->total_out;
+	return 0;
+}
+
+static int deflate_decompress(const unsigned char *src, size_t src_len,
+			unsigned char *dst, void *private)
+{
+	int ret;
+	struct zcomp_deflate *zd = private;
+	struct z_stream_s *stream = &zd->decomp_stream;
+
+	ret = zlib_inflateReset(stream);
+	if (ret != Z_OK)
+		return ret;
+
+	stream->next_in = src;
+	stream->avail_in = src_len;
+	stream->next_out = dst;
+	stream->avail_out = PAGE_SIZE;
+
+	ret = zlib_inflate(stream, Z_FINISH);
+	if (ret != Z_STREAM_END || stream->total_out != PAGE_SIZE)
+		return ret == Z_STREAM_END ? Z_DATA_ERROR : ret;
+
+	return 0;
+}
+
+struct zcomp_backend zcomp_deflate = {
+	.compress = deflate_compress,
+	.decompress = deflate_decompress,
+	.create = deflate_create,
+	.destroy = deflate_destroy,
+	.decompress_needs_strm = 1,
+	.prealloc_strm = 1,
+	.name = "deflate",
+};
@@ -0,0 +1,158 @@
+/*
+ * Compressed RAM block device - same page deduplication
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Project home: http://compcache.googlecode.com
+ */
+
+#include <linux/jhash.h>
+#include <linux/rbtree.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zram_drv.h"
+
+/*
+ * Every compressed object stored while deduplication is enabled has
+ * an entry in zram->dedup_root, ordered by the checksum of its
+ * compressed data. Slots with identical compressed data share one
+ * object; the entry counts how many slots refer to it.
+ *
+ * All functions here are called with zram->tb_lock held for writing.
+ */
+
+u32 zram_dedup_checksum(const unsigned char *cmem, size_t clen)
+{
+	return jhash(cmem, clen, 0);
+}
+
+static int zram_dedup_match(struct zram *zram,
+			struct zram_dedup_entry *entry,
+			const unsigned char *cmem, size_t clen)
+{
+	int match;
+	unsigned char *obj;
+
+	if (entry->size != clen)
+		return 0;
+
+	obj = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+	match = !memcmp(obj + sizeof(struct zobj_header), cmem, clen);
+	zs_unmap_object(zram->mem_pool, entry->handle);
+
+	return match;
+}
+
+/*
+ * Find the leftmost entry with the given checksum. Entries with
+ * equal checksums are adjacent in tree order.
+ */
+static struct rb_node *zram_dedup_first(struct zram *zram, u32 checksum)
+{
+	struct rb_node *node = zram->dedup_root.rb_node;
+	struct rb_node *first = NULL;
+	struct zram_dedup_entry *entry;
+
+	while (node) {
+		entry = rb_entry(node, struct zram_dedup_entry, node);
+		if (checksum < entry->checksum) {
+			node = node->rb_left;
+		} else if (checksum > entry->checksum) {
+			node = node->rb_right;
+		} else {
+			first = node;
+			node = node->rb_left;
+		}
+	}
+
+	return first;
+}
+
+/*
+ * Look for an object whose compressed data is identical to cmem.
+ * On success a reference is taken for the caller.
+ */
+struct zram_dedup_entry *zram_dedup_get(struct zram *zram, u32 checksum,
+			const unsigned char *cmem, size_t clen)
+{
+	struct rb_node *node;
+	struct zram_dedup_entry *entry;
+
+	/* Walk all entries with the same checksum */
+	for (node = zram_dedup_first(zram, checksum); node;
+			node = rb_next(node)) {
+		entry = rb_entry(node, struct zram_dedup_entry, node);
+		if (entry->checksum != checksum)
+			break;
+
+		if (zram_dedup_match(zram, entry, cmem, clen)) {
+			entry->refcount++;
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+/* Start tracking a newly stored object, with one reference. */
+void zram_dedup_insert(struct zram *zram, struct zram_dedup_entry *new,
+			u32 checksum, unsigned long handle, u16 size)
+{
+	struct rb_node **link = &zram->dedup_root.rb_node;
+	struct rb_node *parent = NULL;
+	struct zram_dedup_entry *entry;
+
+	new->checksum = checksum;
+	new->refcount = 1;
+	new->handle = handle;
+	new->size = size;
+
+	while (*link) {
+		parent = *link;
+		entry = rb_entry(parent, struct zram_dedup_entry, node);
+		if (checksum < entry->checksum)
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+
+	rb_link_node(&new->node, parent, link);
+	rb_insert_color(&new->node, &zram->dedup_root);
+}
+
+/*
+ * Drop a reference to the object with the given handle. Returns the
+ * number of references left: if zero, the caller must free the
+ * object. Objects stored without an entry (e.g. when allocating
+ * it failed) are treated as having a single reference.
+ */
+u32 zram_dedup_put(struct zram *zram, u32 checksum, unsigned long handle)
+{
+	struct rb_node *node;
+	struct zram_dedup_entry *entry;
+
+	for (node = zram_dedup_first(zram, checksum); node;
+			node = rb_next(node)) {
+		entry = rb_entry(node, struct zram_dedup_entry, node);
+		if (entry->checksum != checksum)
+			break;
+		if (entry->handle != handle)
+			continue;
+
+		if (--entry->refcount)
+			return entry->refcount;
+
+		rb_erase(&entry->node, &zram->dedup_root);
+		kfree(entry);
+		return 0;
+	}
+
+	return 0;
+}
@@ -24,8 +24,8 @@
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/sched.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
 
@@ -67,6 +67,11 @@ static void zram_stat64_inc(struct zram *zram, u64 *v)
 	zram_stat64_add(zram, v, 1);
 }
 
+static void zram_stat64_dec(struct zram *zram, u64 *v)
+{
+	zram_stat64_sub(zram, v, 1);
+}
+
 static int zram_test_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
@@ -129,15 +134,57 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+/*
+ * Block 0 of the backing device is never used so that the table
+ * entry of a written back page never looks empty.
+ */
+static unsigned long zram_wb_alloc_block(struct zram *zram)
+{
+	unsigned long blk;
+
+	spin_lock(&zram->wb_lock);
+	blk = find_next_zero_bit(zram->wb_bitmap, zram->wb_nr_blocks, 1);
+	if (blk < zram->wb_nr_blocks)
+		__set_bit(blk, zram->wb_bitmap);
+	else
+		blk = 0;
+	spin_unlock(&zram->wb_lock);
+
+	return blk;
+}
+
+static void zram_wb_free_block(struct zram *zram, unsigned long blk)
+{
+	spin_lock(&zram->wb_lock);
+	WARN_ON_ONCE(!test_bit(blk, zram->wb_bitmap));
+	__clear_bit(blk, zram->wb_bitmap);
+	spin_unlock(&zram->wb_lock);
+}
+#endif
+
+static void zram_clear_idle(struct zram *zram, u32 index)
+{
+#ifdef CONFIG_ZRAM_WRITEBACK
+	if (zram->idle_map && test_bit(index, zram->idle_map))
+		clear_bit(index, zram->idle_map);
+#endif
+}
+
+/*
+ * Free memory associated with the given table entry.
+ * Called with zram->tb_lock held for writing, or on reset
+ * when no I/O can be in flight.
+ */
 static void zram_free_page(struct zram *zram, size_t index)
 {
-	u32 clen;
-	void *obj;
+	u32 clen, checksum;
+	struct zobj_header *zheader;
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	unsigned long handle = zram->table[index].handle;
+	u32 size = zram->table[index].size;
 
-	if (unlikely(!page)) {
+	if (unlikely(!handle)) {
 		/*
 		 * No memory is allocated for zero filled pages.
 		 * Simply clear zero page flag.
@@ -149,28 +196,53 @@ static void zram_free_page(struct zram *zram, size_t index)
 		return;
 	}
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* Stop a concurrent writeback of the old contents */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+
+	if (zram_test_flag(zram, index, ZRAM_WB)) {
+		zram_wb_free_block(zram, zram->table[index].wb_index);
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_stat64_dec(zram, &zram->stats.bd_count);
+		zram->table[index].wb_index = 0;
+		return;
+	}
+#endif
+
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page(zram->table[index].page);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(zram->mem_pool, page, offset);
+	clen = size;
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
+	if (zram->use_dedup) {
+		zheader = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+		checksum = zheader->checksum;
+		zs_unmap_object(zram->mem_pool, handle);
+	}
+
+	if (zram->use_dedup && zram_dedup_put(zram, checksum, handle)) {
+		/* Object is still in use by other slots: keep it */
+		zram_stat64_dec(zram, &zram->stats.dedup_pages);
+		zram_stat64_sub(zram, &zram->stats.dedup_bytes_saved, clen);
+		clen = 0;
+		goto out;
+	}
+
+	zs_free(zram->mem_pool, handle);
+
 out:
 	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
 }
 
 static void handle_zero_page(struct page *page)
@@ -190,8 +262,7 @@ static void handle_uncompressed_page(struct zram *zram,
 	unsigned char *user_mem, *cmem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
+	cmem = kmap_atomic(zram->table[index].page, KM_USER1);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
@@ -200,12 +271,350 @@ static void handle_uncompressed_page(struct zram *zram,
 	flush_dcache_page(page);
 }
 
+/*
+ * Decompress the object of the given table entry into page.
+ * Called with zram->tb_lock held.
+ */
+static int zram_decompress_page(struct zram *zram, struct zcomp_strm *zstrm,
+				struct page *page, u32 index)
+{
+	int ret;
+	unsigned long handle = zram->table[index].handle;
+	unsigned char *user_mem, *cmem;
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+
+	ret = zcomp_decompress(zram->comp, zstrm,
+		cmem + sizeof(struct zobj_header),
+		zram->table[index].size, user_mem);
+
+	zs_unmap_object(zram->mem_pool, handle);
+	kunmap_atomic(user_mem, KM_USER0);
+
+	if (likely(!ret))
+		flush_dcache_page(page);
+
+	return ret;
+}
+
+#ifdef CONFIG_ZRAM_WRITEBACK
+/*
+ * Pages on the backing device are read asynchronously: we are called
+ * from zram_make_request(), so bios submitted to the backing device
+ * are only dispatched once we return. The original bio is completed
+ * when the last of these reads does.
+ */
+struct zram_wb_read {
+	struct bio *parent;
+	atomic_t pending;
+	int error;
+};
+
+static void zram_wb_read_put(struct zram_wb_read *wbr, int error)
+{
+	if (error)
+		wbr->error = error;
+
+	if (!atomic_dec_and_test(&wbr->pending))
+		return;
+
+	if (!wbr->error)
+		set_bit(BIO_UPTODATE, &wbr->parent->bi_flags);
+	bio_endio(wbr->parent, wbr->error);
+	kfree(wbr);
+}
+
+static void zram_wb_read_end_io(struct bio *bio, int error)
+{
+	struct zram_wb_read *wbr = bio->bi_private;
+
+	if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
+		error = -EIO;
+	else
+		flush_dcache_page(bio->bi_io_vec[0].bv_page);
+
+	bio_put(bio);
+	zram_wb_read_put(wbr, error);
+}
+
+static int zram_wb_read_page(struct zram *zram, struct zram_wb_read **wbrp,
+			struct bio *parent, struct bio_vec *bvec,
+			unsigned long blk)
+{
+	struct bio *bio;
+	struct zram_wb_read *wbr = *wbrp;
+
+	if (!wbr) {
+		wbr = kmalloc(sizeof(*wbr), GFP_NOIO);
+		if (!wbr)
+			return -ENOMEM;
+
+		wbr->parent = parent;
+		/* Reference dropped when zram_read() is done */
+		atomic_set(&wbr->pending, 1);
+		wbr->error = 0;
+		*wbrp = wbr;
+	}
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = blk << SECTORS_PER_PAGE_SHIFT;
+	if (!bio_add_page(bio, bvec->bv_page, bvec->bv_len, bvec->bv_offset)) {
+		bio_put(bio);
+		return -EIO;
+	}
+	bio->bi_end_io = zram_wb_read_end_io;
+	bio->bi_private = wbr;
+
+	atomic_inc(&wbr->pending);
+	zram_stat64_inc(zram, &zram->stats.bd_reads);
+	submit_bio(READ, bio);
+
+	return 0;
+}
+
+static void zram_wb_write_end_io(struct bio *bio, int error)
+{
+	complete(bio->bi_private);
+}
+
+static int zram_wb_write_page(struct zram *zram, struct page *page,
+			unsigned long blk)
+{
+	int ret;
+	struct bio *bio;
+	DECLARE_COMPLETION_ONSTACK(wait);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = zram->bdev;
+	bio->bi_sector = blk << SECTORS_PER_PAGE_SHIFT;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+	bio->bi_end_io = zram_wb_write_end_io;
+	bio->bi_private = &wait;
+
+	submit_bio(WRITE, bio);
+	wait_for_completion(&wait);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+
+	return ret;
+}
+
+/* Called with zram->tb_lock held */
+static int zram_wb_eligible(struct zram *zram, u32 index, int mode)
+{
+	if (!zram->table[index].handle ||
+			zram_test_flag(zram, index, ZRAM_WB) ||
+			zram_test_flag(zram, index, ZRAM_UNDER_WB))
+		return 0;
+
+	if ((mode & ZRAM_WB_HUGE) &&
+			zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))
+		return 1;
+
+	if ((mode & ZRAM_WB_IDLE) && test_bit(index, zram->idle_map))
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Move pages selected by mode to the backing device. Each page is
+ * copied out under tb_lock and written synchronously; the table
+ * entry is only switched over if the slot was not rewritten or
+ * freed meanwhile (which clears ZRAM_UNDER_WB).
+ */
+void zram_writeback(struct zram *zram, int mode)
+{
+	u32 index;
+	struct page *page;
+
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return;
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		int ret = 0;
+		unsigned long blk = 0;
+		struct zcomp_strm *zstrm;
+
+		zstrm = zcomp_decompress_begin(zram->comp);
+		write_lock(&zram->tb_lock);
+		if (!zram_wb_eligible(zram, index, mode)) {
+			write_unlock(&zram->tb_lock);
+			zcomp_decompress_end(zram->comp, zstrm);
+			continue;
+		}
+
+		zram_set_flag(zram, index, ZRAM_UNDER_WB);
+		if (zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))
+			handle_uncompressed_page(zram, page, index);
+		else
+			ret = zram_decompress_page(zram, zstrm, page, index);
+		write_unlock(&zram->tb_lock);
+		zcomp_decompress_end(zram->comp, zstrm);
+
+		if (!ret) {
+			blk = zram_wb_alloc_block(zram);
+			if (!blk)
+				ret = -ENOSPC;
+		}
+
+		if (!ret) {
+			ret = zram_wb_write_page(zram, page, blk);
+			if (!ret)
+				zram_stat64_inc(zram, &zram->stats.bd_writes);
+		}
+
+		write_lock(&zram->tb_lock);
+		if (!ret && zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+			zram_free_page(zram, index);
+			zram_set_flag(zram, index, ZRAM_WB);
+			zram->table[index].wb_index = blk;
+			zram_stat64_inc(zram, &zram->stats.bd_count);
+			blk = 0;
+		}
+		zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+		write_unlock(&zram->tb_lock);
+
+		/* Slot changed under us: block is not needed */
+		if (blk)
+			zram_wb_free_block(zram, blk);
+
+		/* Backing device is full */
+		if (ret == -ENOSPC)
+			break;
+
+		cond_resched();
+	}
+
+	__free_page(page);
+}
+
+/*
+ * Pages still marked idle at the next period have not been accessed
+ * for at least wb_idle_secs and are written back.
+ */
+static void zram_mark_idle(struct zram *zram)
+{
+	u32 index;
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		read_lock(&zram->tb_lock);
+		if (zram->table[index].handle &&
+				!zram_test_flag(zram, index, ZRAM_WB))
+			set_bit(index, zram->idle_map);
+		read_unlock(&zram->tb_lock);
+	}
+}
+
+static void zram_wb_work(struct work_struct *work)
+{
+	struct zram *zram = container_of(work, struct zram, wb_work.work);
+
+	zram_writeback(zram, ZRAM_WB_HUGE | ZRAM_WB_IDLE);
+	zram_mark_idle(zram);
+
+	if (zram->wb_idle_secs)
+		schedule_delayed_work(&zram->wb_work,
+				zram->wb_idle_secs * HZ);
+}
+
+/* Called with zram->init_lock held */
+void zram_set_wb_idle_secs(struct zram *zram, unsigned int secs)
+{
+	zram->wb_idle_secs = secs;
+
+	if (!zram->init_done || !zram->bdev)
+		return;
+
+	cancel_delayed_work_sync(&zram->wb_work);
+	if (secs)
+		schedule_delayed_work(&zram->wb_work, secs * HZ);
+}
+
+void zram_reset_bdev(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	zram->bdev = NULL;
+
+	vfree(zram->wb_bitmap);
+	zram->wb_bitmap = NULL;
+	zram->wb_nr_blocks = 0;
+
+	kfree(zram->backing_dev_path);
+	zram->backing_dev_path = NULL;
+}
+
+/*
+ * Open (exclusively) the block device at path for use as backing
+ * device, or detach the current one if path is "none". Called with
+ * zram->init_lock held, before the device is initialized.
+ */
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	char *dev_path;
+	unsigned long nr_blocks, *bitmap;
+	struct block_device *bdev;
+
+	zram_reset_bdev(zram);
+	if (!strcmp(path, "none"))
+		return 0;
+
+	dev_path = kstrdup(path, GFP_KERNEL);
+	if (!dev_path)
+		return -ENOMEM;
+
+	bdev = blkdev_get_by_path(path, FMODE_READ | FMODE_WRITE | FMODE_EXCL,
+				zram);
+	if (IS_ERR(bdev)) {
+		kfree(dev_path);
+		return PTR_ERR(bdev);
+	}
+
+	nr_blocks = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	bitmap = vzalloc(BITS_TO_LONGS(nr_blocks) * sizeof(long));
+	if (nr_blocks < 2 || !bitmap) {
+		vfree(bitmap);
+		blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+		kfree(dev_path);
+		return nr_blocks < 2 ? -EINVAL : -ENOMEM;
+	}
+
+	zram->bdev = bdev;
+	zram->backing_dev_path = dev_path;
+	zram->wb_bitmap = bitmap;
+	zram->wb_nr_blocks = nr_blocks;
+
+	pr_info("Using %s as backing device (%lu pages)\n",
+		dev_path, nr_blocks);
+	return 0;
+}
+#endif
+
 static int zram_read(struct zram *zram, struct bio *bio)
 {
 
 	int i;
 	u32 index;
 	struct bio_vec *bvec;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	struct zram_wb_read *wbr = NULL;
+#endif
 
 	if (unlikely(!zram->init_done)) {
 		set_bit(BIO_UPTODATE, &bio->bi_flags);
@@ -218,21 +627,34 @@ static int zram_read(struct zram *zram, struct bio *bio)
 
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
-		size_t clen;
 		struct page *page;
-		struct zobj_header *zheader;
-		unsigned char *user_mem, *cmem;
+		struct zcomp_strm *zstrm;
 
 		page = bvec->bv_page;
+		zram_clear_idle(zram, index);
+
+		/* May sleep, so must be done before taking tb_lock */
+		zstrm = zcomp_decompress_begin(zram->comp);
+
+		/*
+		 * Readers only exclude writers replacing this entry,
+		 * so reads proceed in parallel (limited only by the
+		 * number of streams if the compressor needs one).
+		 */
+		read_lock(&zram->tb_lock);
 
 		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
+			read_unlock(&zram->tb_lock);
+			zcomp_decompress_end(zram->comp, zstrm);
 			handle_zero_page(page);
 			index++;
 			continue;
 		}
 
 		/* Requested page is not present in compressed area */
-		if (unlikely(!zram->table[index].page)) {
+		if (unlikely(!zram->table[index].handle)) {
+			read_unlock(&zram->tb_lock);
+			zcomp_decompress_end(zram->comp, zstrm);
 			pr_debug("Read before write: sector=%lu, size=%u",
 				(ulong)(bio->bi_sector), bio->bi_size);
 			/* Do nothing */
@@ -240,44 +662,68 @@ static int zram_read(struct zram *zram, struct bio *bio)
 			continue;
 		}
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+		/* Page was moved to the backing device */
+		if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+			unsigned long blk = zram->table[index].wb_index;
+
+			read_unlock(&zram->tb_lock);
+			zcomp_decompress_end(zram->comp, zstrm);
+
+			ret = zram_wb_read_page(zram, &wbr, bio, bvec, blk);
+			if (unlikely(ret)) {
+				pr_err("Backing device read failed! "
+					"err=%d, page=%u\n", ret, index);
+				zram_stat64_inc(zram,
+					&zram->stats.failed_reads);
+				goto out;
+			}
+			index++;
+			continue;
+		}
+#endif
+
 		/* Page is stored uncompressed since it's incompressible */
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 			handle_uncompressed_page(zram, page, index);
+			read_unlock(&zram->tb_lock);
+			zcomp_decompress_end(zram->comp, zstrm);
 			index++;
 			continue;
 		}
 
-		user_mem = kmap_atomic(page, KM_USER0);
-		clen = PAGE_SIZE;
-
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
-
-		ret = lzo1x_decompress_safe(
-			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
-
-		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
+		ret = zram_decompress_page(zram, zstrm, page, index);
+		read_unlock(&zram->tb_lock);
+		zcomp_decompress_end(zram->comp, zstrm);
 
 		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
+		if (unlikely(ret)) {
 			pr_err("Decompression failed! err=%d, page=%u\n",
 				ret, index);
 			zram_stat64_inc(zram, &zram->stats.failed_reads);
 			goto out;
 		}
 
-		flush_dcache_page(page);
 		index++;
 	}
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+	if (wbr) {
+		zram_wb_read_put(wbr, 0);
+		return 0;
+	}
+#endif
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return 0;
 
 out:
+#ifdef CONFIG_ZRAM_WRITEBACK
+	if (wbr) {
+		zram_wb_read_put(wbr, -EIO);
+		return 0;
+	}
+#endif
 	bio_io_error(bio);
 	return 0;
 }
@@ -298,42 +744,48 @@ static int zram_write(struct zram *zram, struct bio *bio)
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
 	bio_for_each_segment(bvec, bio, i) {
-		u32 offset;
+		u32 checksum = 0;
 		size_t clen;
+		unsigned long handle = 0;
 		struct zobj_header *zheader;
-		struct page *page, *page_store;
+		struct zcomp_strm *zstrm;
+		struct zram_dedup_entry *dedup = NULL;
+		struct page *page, *page_store = NULL;
 		unsigned char *user_mem, *cmem, *src;
 
 		page = bvec->bv_page;
-		src = zram->compress_buffer;
-
-		/*
-		 * System overwrites unused sectors. Free memory associated
-		 * with this sector now.
-		 */
-		if (zram->table[index].page ||
-				zram_test_flag(zram, index, ZRAM_ZERO))
-			zram_free_page(zram, index);
-
-		mutex_lock(&zram->lock);
+		zram_clear_idle(zram, index);
 
 		user_mem = kmap_atomic(page, KM_USER0);
 		if (page_zero_filled(user_mem)) {
 			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
+			/*
+			 * System overwrites unused sectors. Free memory
+			 * associated with this sector now.
+			 */
+			write_lock(&zram->tb_lock);
+			zram_free_page(zram, index);
 			zram_stat_inc(&zram->stats.pages_zero);
 			zram_set_flag(zram, index, ZRAM_ZERO);
+			write_unlock(&zram->tb_lock);
 			index++;
 			continue;
 		}
+		kunmap_atomic(user_mem, KM_USER0);
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
+		/*
+		 * Getting a stream may sleep until another writer is
+		 * done with it, so do it before mapping the page.
+		 */
+		zstrm = zcomp_strm_find(zram->comp);
+		src = zstrm->buffer;
 
+		user_mem = kmap_atomic(page, KM_USER0);
+		ret = zcomp_compress(zram->comp, zstrm, user_mem, &clen);
 		kunmap_atomic(user_mem, KM_USER0);
 
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
+		if (unlikely(ret)) {
+			zcomp_strm_release(zram->comp, zstrm);
 			pr_err("Compression failed! err=%d\n", ret);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
@@ -345,10 +797,12 @@ static int zram_write(struct zram *zram, struct bio *bio)
 		 * errors which has side effect of hanging the system.
 		 */
 		if (unlikely(clen > max_zpage_size)) {
+			zcomp_strm_release(zram->comp, zstrm);
+			zstrm = NULL;
+
 			clen = PAGE_SIZE;
 			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
 				pr_info("Error allocating memory for "
 					"incompressible page: %u\n", index);
 				zram_stat64_inc(zram,
@@ -356,52 +810,98 @@ static int zram_write(struct zram *zram, struct bio *bio)
 				goto out;
 			}
 
-			offset = 0;
-			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
 			src = kmap_atomic(page, KM_USER0);
+			cmem = kmap_atomic(page_store, KM_USER1);
+			memcpy(cmem, src, PAGE_SIZE);
+			kunmap_atomic(cmem, KM_USER1);
+			kunmap_atomic(src, KM_USER0);
 			goto memstore;
 		}
 
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
-				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
+		if (zram->use_dedup) {
+			checksum = zram_dedup_checksum(src, clen);
+
+			write_lock(&zram->tb_lock);
+			dedup = zram_dedup_get(zram, checksum, src, clen);
+			if (dedup) {
+				/* Share the existing identical object */
+				zram_free_page(zram, index);
+				zram->table[index].handle = dedup->handle;
+				zram->table[index].size = dedup->size;
+
+				zram_stat_inc(&zram->stats.pages_stored);
+				if (clen <= PAGE_SIZE / 2)
+					zram_stat_inc(
+						&zram->stats.good_compress);
+				zram_stat64_inc(zram,
+					&zram->stats.dedup_pages);
+				zram_stat64_add(zram,
+					&zram->stats.dedup_bytes_saved, clen);
+				write_unlock(&zram->tb_lock);
+
+				zcomp_strm_release(zram->comp, zstrm);
+				index++;
+				continue;
+			}
+			write_unlock(&zram->tb_lock);
+
+			/*
+			 * Entry for the new object. If this fails, the
+			 * object is simply stored without being shared.
+			 */
+			dedup = kmalloc(sizeof(*dedup), GFP_NOIO);
+		}
+
+		handle = zs_malloc(zram->mem_pool, clen + sizeof(*zheader),
+				GFP_NOIO | __GFP_HIGHMEM);
+		if (unlikely(!handle)) {
+			kfree(dedup);
+			zcomp_strm_release(zram->comp, zstrm);
 			pr_info("Error allocating memory for compressed "
 				"page: %u, size=%zu\n", index, clen);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
 		}
 
-memstore:
-		zram->table[index].offset = offset;
-
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
-
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
+		zheader = (struct zobj_header *)cmem;
 #if 0
 		/* Back-reference needed for memory defragmentation */
-		if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-			zheader = (struct zobj_header *)cmem;
-			zheader->table_idx = index;
-			cmem += sizeof(*zheader);
-		}
+		zheader->table_idx = index;
 #endif
+		zheader->checksum = checksum;
+		memcpy(cmem + sizeof(*zheader), src, clen);
+		zs_unmap_object(zram->mem_pool, handle);
 
-		memcpy(cmem, src, clen);
+		zcomp_strm_release(zram->comp, zstrm);
 
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			kunmap_atomic(src, KM_USER0);
+memstore:
+		/*
+		 * Publish the new object. Any memory associated with
+		 * the previous contents of this sector is freed now.
+		 */
+		write_lock(&zram->tb_lock);
+		zram_free_page(zram, index);
+
+		if (unlikely(!zstrm)) {
+			zram->table[index].page = page_store;
+			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+			zram_stat_inc(&zram->stats.pages_expand);
+		} else {
+			zram->table[index].handle = handle;
+		}
+		zram->table[index].size = clen;
+		if (dedup)
+			zram_dedup_insert(zram, dedup, checksum,
+					handle, clen);
 
 		/* Update stats */
 		zram_stat64_add(zram, &zram->stats.compr_size, clen);
 		zram_stat_inc(&zram->stats.pages_stored);
 		if (clen <= PAGE_SIZE / 2)
 			zram_stat_inc(&zram->stats.good_compress);
+		write_unlock(&zram->tb_lock);
 
-		mutex_unlock(&zram->lock);
 		index++;
 	}
 
@@ -465,34 +965,35 @@ void zram_reset_device(struct zram *zram)
 	mutex_lock(&zram->init_lock);
 	zram->init_done = 0;
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
-
-	/* Free all pages that are still in this zram device */
-	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
-
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	cancel_delayed_work_sync(&zram->wb_work);
+#endif
 
-		if (!page)
-			continue;
+	/* Free various per-device buffers */
+	if (zram->comp)
+		zcomp_destroy(zram->comp);
+	zram->comp = NULL;
 
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
-	}
+	/*
+	 * Free all pages that are still in this zram device. Shared
+	 * objects are freed once their last slot is released.
+	 * The table may not exist yet if initialization failed early.
+	 */
+	if (zram->table)
+		for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++)
+			zram_free_page(zram, index);
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+#ifdef CONFIG_ZRAM_WRITEBACK
+	vfree(zram->idle_map);
+	zram->idle_map = NULL;
+	zram_reset_bdev(zram);
+#endif
+
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
@@ -516,16 +1017,10 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
+	zram->comp = zcomp_create(zram->compressor, zram->max_comp_streams);
+	if (!zram->comp) {
+		pr_err("Error initializing %s compressor\n",
+			zram->compressor);
 		ret = -ENOMEM;
 		goto fail;
 	}
@@ -540,19 +1035,38 @@ int zram_init_device(struct zram *zram)
 		goto fail;
 	}
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+	if (zram->bdev) {
+		zram->idle_map = vzalloc(BITS_TO_LONGS(num_pages) *
+					sizeof(long));
+		if (!zram->idle_map) {
+			pr_err("Error allocating idle page map\n");
+			ret = -ENOMEM;
+			goto fail;
+		}
+	}
+#endif
+
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool();
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
 		goto fail;
 	}
 
+	zram->dedup_root = RB_ROOT;
+
 	zram->init_done = 1;
+#ifdef CONFIG_ZRAM_WRITEBACK
+	if (zram->bdev && zram->wb_idle_secs)
+		schedule_delayed_work(&zram->wb_work,
+				zram->wb_idle_secs * HZ);
+#endif
 	mutex_unlock(&zram->init_lock);
 
 	pr_debug("Initialization done!\n");
@@ -571,7 +1085,9 @@ void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	write_lock(&zram->tb_lock);
 	zram_free_page(zram, index);
+	write_unlock(&zram->tb_lock);
 	zram_stat64_inc(zram, &zram->stats.notify_free);
 }
 
@@ -584,9 +1100,18 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	mutex_init(&zram->lock);
 	mutex_init(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	rwlock_init(&zram->tb_lock);
+
+	/* One compression stream per CPU unless told otherwise */
+	zram->max_comp_streams = num_online_cpus();
+	strlcpy(zram->compressor, default_compressor,
+		sizeof(zram->compressor));
+#ifdef CONFIG_ZRAM_WRITEBACK
+	spin_lock_init(&zram->wb_lock);
+	INIT_DELAYED_WORK(&zram->wb_work, zram_wb_work);
+#endif
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -721,6 +1246,10 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+#ifdef CONFIG_ZRAM_WRITEBACK
+		/* Backing device may be set on a device never used */
+		zram_reset_bdev(zram);
+#endif
 	}
 
 	unregister_blkdev(zram_major, "zram");
@@ -17,8 +17,11 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/rbtree.h>
+#include <linux/workqueue.h>
 
-#include "xvmalloc.h"
+#include "zcomp.h"
+#include "zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -31,11 +34,14 @@ static const unsigned max_num_devices = 32;
  *
  * It stores back-reference to table entry which points to this
  * object. This is required to support memory defragmentation.
+ * The checksum of the compressed data is used to find the object
+ * again when deduplication is enabled.
  */
 struct zobj_header {
 #if 0
 	u32 table_idx;
 #endif
+	u32 checksum;
 };
 
 /*-- Configurable parameters */
@@ -43,6 +49,9 @@ struct zobj_header {
 /* Default zram disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
+/* Default compression algorithm */
+static const char default_compressor[] = "lzo";
+
 /*
  * Pages that compress to size greater than this are stored
  * uncompressed in memory.
@@ -51,8 +60,8 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -70,6 +79,12 @@ enum zram_pageflags {
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Page is stored on the backing device */
+	ZRAM_WB,
+
+	/* Page is being written to the backing device */
+	ZRAM_UNDER_WB,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
@@ -77,12 +92,25 @@ enum zram_pageflags {
 
 /* Allocated for each disk page */
 struct table {
-	struct page *page;
-	u16 offset;
+	union {
+		unsigned long handle;	/* compressed object */
+		struct page *page;	/* ZRAM_UNCOMPRESSED page */
+		unsigned long wb_index;	/* block on backing device */
+	};
+	u16 size;	/* object size (excluding header) */
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
 } __attribute__((aligned(4)));
 
+/* Shared compressed object (see zram_dedup.c) */
+struct zram_dedup_entry {
+	struct rb_node node;
+	u32 checksum;
+	u32 refcount;	/* no. of table entries using this object */
+	unsigned long handle;
+	u16 size;
+};
+
 struct zram_stats {
 	u64 compr_size;		/* compressed size of pages stored */
 	u64 num_reads;		/* failed + successful */
@@ -91,6 +119,11 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
+	u64 dedup_pages;	/* no. of pages sharing another's object */
+	u64 dedup_bytes_saved;	/* compressed bytes not stored twice */
+	u64 bd_count;		/* no. of pages on backing device */
+	u64 bd_reads;		/* no. of pages read from backing device */
+	u64 bd_writes;		/* no. of pages written to backing device */
 	u32 pages_zero;		/* no. of zero filled pages */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
@@ -98,13 +131,11 @@ struct zram_stats {
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	struct zcomp *comp;	/* pool of compression streams */
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
+	rwlock_t tb_lock;	/* protect table entries and 32-bit stats */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -115,6 +146,26 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
+	/* Max no. of concurrent compressions (writers) */
+	int max_comp_streams;
+	/* Compression algorithm, can only be changed before init */
+	char compressor[CRYPTO_MAX_ALG_NAME];
+	/* Share identical objects, can only be changed before init */
+	int use_dedup;
+	struct rb_root dedup_root;	/* protected by tb_lock */
+#ifdef CONFIG_ZRAM_WRITEBACK
+	/* Backing device, can only be changed before init */
+	struct block_device *bdev;
+	char *backing_dev_path;
+	unsigned long *wb_bitmap;	/* blocks in use on bdev */
+	unsigned long wb_nr_blocks;
+	spinlock_t wb_lock;		/* protect wb_bitmap */
+	/* Slots not accessed since they were last marked idle */
+	unsigned long *idle_map;
+	/* Period for marking pages idle and writing them back */
+	unsigned int wb_idle_secs;
+	struct delayed_work wb_work;
+#endif
 
 	struct zram_stats stats;
 };
@@ -128,4 +179,24 @@ extern struct attribute_group zram_disk_attr_group;
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
 
+#ifdef CONFIG_ZRAM_WRITEBACK
+/* Modes for zram_writeback() */
+#define ZRAM_WB_HUGE	(1 << 0)	/* incompressible pages */
+#define ZRAM_WB_IDLE	(1 << 1)	/* pages marked idle */
+
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_reset_bdev(struct zram *zram);
+extern void zram_writeback(struct zram *zram, int mode);
+extern void zram_set_wb_idle_secs(struct zram *zram, unsigned int secs);
+#endif
+
+extern u32 zram_dedup_checksum(const unsigned char *cmem, size_t clen);
+extern struct zram_dedup_entry *zram_dedup_get(struct zram *zram,
+			u32 checksum, const unsigned char *cmem, size_t clen);
+extern void zram_dedup_insert(struct zram *zram,
+			struct zram_dedup_entry *new, u32 checksum,
+			unsigned long handle, u16 size);
+extern u32 zram_dedup_put(struct zram *zram, u32 checksum,
+			unsigned long handle);
+
 #endif
@@ -0,0 +1,571 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * Objects are grouped in size classes ZS_SIZE_CLASS_DELTA bytes
+ * apart. Each class packs its objects back to back into zspages of
+ * pages_per_zspage pages, chosen to minimize the space wasted at
+ * the end of the zspage. An object may thus straddle two pages, in
+ * which case zs_map_object() hands out a per-cpu copy.
+ *
+ * Users refer to objects through handles, never through addresses,
+ * so zs_compact() can move objects out of sparsely used zspages and
+ * release them.
+ */
+
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+#define OBJ_FREE_BIT	1
+
+static int get_size_class_index(int size)
+{
+	int idx = 0;
+
+	if (likely(size > ZS_MIN_ALLOC_SIZE))
+		idx = DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE,
+				ZS_SIZE_CLASS_DELTA);
+
+	return idx;
+}
+
+/*
+ * Pick the number of pages per zspage (up to ZS_MAX_PAGES_PER_ZSPAGE)
+ * giving the best ratio of usable to total space for this class.
+ */
+static int get_pages_per_zspage(int class_size)
+{
+	int i, max_usedpc = 0;
+	int max_usedpc_pages = 1;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		int zspage_size, waste, usedpc;
+
+		zspage_size = i * PAGE_SIZE;
+		waste = zspage_size % class_size;
+		usedpc = (zspage_size - waste) * 100 / zspage_size;
+
+		if (usedpc > max_usedpc) {
+			max_usedpc = usedpc;
+			max_usedpc_pages = i;
+		}
+	}
+
+	return max_usedpc_pages;
+}
+
+static enum fullness_group get_fullness_group(struct size_class *class,
+					struct zspage *zspage)
+{
+	if (zspage->inuse == class->objs_per_zspage)
+		return ZS_FULL;
+
+	if (zspage->inuse * 4 > class->objs_per_zspage *
+				ZS_ALMOST_FULL_QUARTERS)
+		return ZS_ALMOST_FULL;
+
+	return ZS_ALMOST_EMPTY;
+}
+
+/* Called with class->lock held */
+static void insert_zspage(struct size_class *class, struct zspage *zspage)
+{
+	zspage->fullness = get_fullness_group(class, zspage);
+	list_add(&zspage->list, &class->fullness_list[zspage->fullness]);
+}
+
+/* Called with class->lock held */
+static void fix_fullness_group(struct size_class *class,
+				struct zspage *zspage)
+{
+	enum fullness_group fullness;
+
+	fullness = get_fullness_group(class, zspage);
+	if (fullness == zspage->fullness)
+		return;
+
+	zspage->fullness = fullness;
+	list_move(&zspage->list, &class->fullness_list[fullness]);
+}
+
+static void free_zspage(struct zs_pool *pool, struct zspage *zspage)
+{
+	int i;
+	struct size_class *class = zspage->class;
+
+	for (i = 0; i < class->pages_per_zspage; i++)
+		__free_page(zspage->pages[i]);
+	atomic_long_sub(class->pages_per_zspage, &pool->pages_allocated);
+
+	kfree(zspage->objs);
+	kfree(zspage);
+}
+
+static struct zspage *alloc_zspage(struct zs_pool *pool,
+				struct size_class *class, gfp_t flags)
+{
+	int i;
+	struct zspage *zspage;
+	gfp_t meta_flags = flags & ~__GFP_HIGHMEM;
+
+	zspage = kzalloc(sizeof(*zspage), meta_flags);
+	if (!zspage)
+		return NULL;
+
+	zspage->class = class;
+	zspage->objs = kmalloc(class->objs_per_zspage * sizeof(*zspage->objs),
+				meta_flags);
+	if (!zspage->objs)
+		goto fail;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(flags);
+		if (!zspage->pages[i])
+			goto fail;
+	}
+	atomic_long_add(class->pages_per_zspage, &pool->pages_allocated);
+
+	/* Chain all objects on the free list */
+	for (i = 0; i < class->objs_per_zspage; i++)
+		zspage->objs[i] = ((i + 1) << 1) | OBJ_FREE_BIT;
+	zspage->free_idx = 0;
+
+	return zspage;
+
+fail:
+	for (i = 0; i < class->pages_per_zspage; i++)
+		if (zspage->pages[i])
+			__free_page(zspage->pages[i]);
+	kfree(zspage->objs);
+	kfree(zspage);
+	return NULL;
+}
+
+/* Called with class->lock held */
+static struct zspage *find_get_zspage(struct size_class *class)
+{
+	int i;
+
+	for (i = ZS_ALMOST_FULL; i < __NR_ZS_FULLNESS_GROUPS; i++) {
+		if (!list_empty(&class->fullness_list[i]))
+			return list_first_entry(&class->fullness_list[i],
+						struct zspage, list);
+	}
+
+	return NULL;
+}
+
+/* Called with class->lock held, zspage must not be full */
+static unsigned int obj_alloc(struct zspage *zspage, struct zs_handle *zh)
+{
+	unsigned int idx = zspage->free_idx;
+
+	zspage->free_idx = zspage->objs[idx] >> 1;
+	zspage->objs[idx] = (unsigned long)zh;
+	zspage->inuse++;
+
+	zh->zspage = zspage;
+	zh->idx = idx;
+
+	return idx;
+}
+
+/* Called with class->lock held */
+static void obj_free(struct zspage *zspage, unsigned int idx)
+{
+	zspage->objs[idx] = (zspage->free_idx << 1) | OBJ_FREE_BIT;
+	zspage->free_idx = idx;
+	zspage->inuse--;
+}
+
+/*
+ * Create a memory pool. Allocates size classes and the per-cpu
+ * buffers used to map objects straddling pages.
+ */
+struct zs_pool *zs_create_pool(void)
+{
+	int i, cpu;
+	struct zs_pool *pool;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		int j;
+		struct size_class *class = &pool->size_class[i];
+
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage *
+					PAGE_SIZE / class->size;
+		spin_lock_init(&class->lock);
+		for (j = 0; j < __NR_ZS_FULLNESS_GROUPS; j++)
+			INIT_LIST_HEAD(&class->fullness_list[j]);
+	}
+
+	rwlock_init(&pool->migrate_lock);
+	atomic_long_set(&pool->pages_allocated, 0);
+	atomic_long_set(&pool->pages_compacted, 0);
+
+	pool->map_area = alloc_percpu(struct zs_map_area);
+	if (!pool->map_area)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		struct zs_map_area *area = per_cpu_ptr(pool->map_area, cpu);
+
+		area->buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!area->buf)
+			goto fail;
+	}
+
+	return pool;
+
+fail:
+	zs_destroy_pool(pool);
+	return NULL;
+}
+
+/* All objects must have been freed */
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i, cpu;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		int j;
+		struct size_class *class = &pool->size_class[i];
+
+		for (j = 0; j < __NR_ZS_FULLNESS_GROUPS; j++)
+			WARN_ON(!list_empty(&class->fullness_list[j]));
+	}
+
+	if (pool->map_area) {
+		for_each_possible_cpu(cpu)
+			kfree(per_cpu_ptr(pool->map_area, cpu)->buf);
+		free_percpu(pool->map_area);
+	}
+
+	kfree(pool);
+}
+
+/**
+ * zs_malloc - Allocate object of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of object to allocate
+ * @flags: gfp flags for the backing pages (may include __GFP_HIGHMEM)
+ *
+ * On success, returns a non-zero handle for the object, which
+ * must be mapped with zs_map_object() to access it. Returns 0
+ * on failure or if size > ZS_MAX_ALLOC_SIZE.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags)
+{
+	struct zs_handle *zh;
+	struct zspage *zspage;
+	struct size_class *class;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	zh = kmalloc(sizeof(*zh), flags & ~__GFP_HIGHMEM);
+	if (!zh)
+		return 0;
+
+	class = &pool->size_class[get_size_class_index(size)];
+
+	spin_lock(&class->lock);
+	zspage = find_get_zspage(class);
+	if (!zspage) {
+		spin_unlock(&class->lock);
+		zspage = alloc_zspage(pool, class, flags);
+		if (unlikely(!zspage)) {
+			kfree(zh);
+			return 0;
+		}
+
+		spin_lock(&class->lock);
+		insert_zspage(class, zspage);
+		class->objs_allocated += class->objs_per_zspage;
+	}
+
+	obj_alloc(zspage, zh);
+	fix_fullness_group(class, zspage);
+	class->objs_inuse++;
+	spin_unlock(&class->lock);
+
+	return (unsigned long)zh;
+}
+
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	struct zs_handle *zh = (struct zs_handle *)handle;
+	struct zspage *zspage;
+	struct size_class *class;
+
+	/* Keep compaction from freeing zh->zspage under us */
+	read_lock(&pool->migrate_lock);
+	class = zh->zspage->class;
+
+	spin_lock(&class->lock);
+	zspage = zh->zspage;
+	obj_free(zspage, zh->idx);
+	class->objs_inuse--;
+
+	if (zspage->inuse) {
+		fix_fullness_group(class, zspage);
+		zspage = NULL;
+	} else {
+		list_del(&zspage->list);
+		class->objs_allocated -= class->objs_per_zspage;
+	}
+	spin_unlock(&class->lock);
+	read_unlock(&pool->migrate_lock);
+
+	if (zspage)
+		free_zspage(pool, zspage);
+	kfree(zh);
+}
+
+/* Locate an object: page holding its start and offset within it */
+static struct page *obj_location(struct zs_handle *zh, unsigned int *offset,
+				int *size)
+{
+	unsigned long off;
+	struct size_class *class = zh->zspage->class;
+
+	off = (unsigned long)zh->idx * class->size;
+	*offset = off & ~PAGE_MASK;
+	*size = class->size;
+
+	return zh->zspage->pages[off >> PAGE_SHIFT];
+}
+
+/* Copy between an object and a linear buffer, page by page */
+static void copy_object(struct zs_handle *zh, char *buf, int to_obj)
+{
+	int size, len;
+	unsigned int offset;
+	unsigned long off;
+	struct page **page;
+	char *addr;
+
+	size = zh->zspage->class->size;
+	off = (unsigned long)zh->idx * size;
+	page = &zh->zspage->pages[off >> PAGE_SHIFT];
+	offset = off & ~PAGE_MASK;
+
+	while (size) {
+		len = min_t(int, size, PAGE_SIZE - offset);
+
+		addr = kmap_atomic(*page, KM_USER1);
+		if (to_obj)
+			memcpy(addr + offset, buf, len);
+		else
+			memcpy(buf, addr + offset, len);
+		kunmap_atomic(addr, KM_USER1);
+
+		buf += len;
+		size -= len;
+		offset = 0;
+		page++;
+	}
+}
+
+/**
+ * zs_map_object - get address of allocated object from handle.
+ * @pool: pool from which the object was allocated
+ * @handle: handle returned from zs_malloc
+ * @mm: access intended through the mapping
+ *
+ * Only one object may be mapped at a time on a given CPU and the
+ * caller must not sleep until zs_unmap_object(). The object cannot
+ * be moved by compaction while it is mapped. Uses KM_USER1.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm)
+{
+	int size;
+	unsigned int offset;
+	struct page *page;
+	struct zs_map_area *area;
+	struct zs_handle *zh = (struct zs_handle *)handle;
+
+	read_lock(&pool->migrate_lock);
+
+	area = this_cpu_ptr(pool->map_area);
+	page = obj_location(zh, &offset, &size);
+	if (offset + size <= PAGE_SIZE) {
+		area->vm_addr = kmap_atomic(page, KM_USER1);
+		return area->vm_addr + offset;
+	}
+
+	/* Object straddles a page boundary: use bounce buffer */
+	area->vm_addr = NULL;
+	area->mm = mm;
+	if (mm != ZS_MM_WO)
+		copy_object(zh, area->buf, 0);
+
+	return area->buf;
+}
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
+{
+	struct zs_map_area *area = this_cpu_ptr(pool->map_area);
+	struct zs_handle *zh = (struct zs_handle *)handle;
+
+	if (area->vm_addr)
+		kunmap_atomic(area->vm_addr, KM_USER1);
+	else if (area->mm != ZS_MM_RO)
+		copy_object(zh, area->buf, 1);
+
+	read_unlock(&pool->migrate_lock);
+}
+
+/*
+ * Pick a zspage to move objects of src into: the fullest candidate
+ * first, so that almost full zspages fill up and almost empty ones
+ * drain. Called with class->lock held.
+ */
+static struct zspage *find_dst_zspage(struct size_class *class,
+					struct zspage *src)
+{
+	struct zspage *zspage;
+	int i;
+
+	for (i = ZS_ALMOST_FULL; i < __NR_ZS_FULLNESS_GROUPS; i++) {
+		list_for_each_entry(zspage, &class->fullness_list[i], list)
+			if (zspage != src)
+				return zspage;
+	}
+
+	return NULL;
+}
+
+/* Called with migrate_lock held for writing and class->lock held */
+static void migrate_object(struct zs_pool *pool, struct zspage *src,
+				unsigned int idx, struct zspage *dst)
+{
+	struct zs_handle *zh = (struct zs_handle *)src->objs[idx];
+	char *buf = this_cpu_ptr(pool->map_area)->buf;
+
+	copy_object(zh, buf, 0);
+	obj_free(src, idx);
+	obj_alloc(dst, zh);
+	copy_object(zh, buf, 1);
+}
+
+/*
+ * Empty the least used zspages of a class into the others, as long
+ * as the free space elsewhere in the class can absorb a whole zspage.
+ * Returns the number of pages freed.
+ */
+static unsigned long compact_class(struct zs_pool *pool,
+				struct size_class *class)
+{
+	unsigned int idx;
+	unsigned long freed = 0;
+	struct zspage *src, *dst;
+	struct list_head *almost_empty = &class->fullness_list[ZS_ALMOST_EMPTY];
+
+	while (1) {
+		write_lock(&pool->migrate_lock);
+		spin_lock(&class->lock);
+
+		if (class->objs_allocated - class->objs_inuse <
+				class->objs_per_zspage ||
+				list_empty(almost_empty)) {
+			spin_unlock(&class->lock);
+			write_unlock(&pool->migrate_lock);
+			break;
+		}
+
+		src = list_entry(almost_empty->prev, struct zspage, list);
+		for (idx = 0; idx < class->objs_per_zspage && src->inuse; idx++) {
+			if (src->objs[idx] & OBJ_FREE_BIT)
+				continue;
+
+			/* cannot fail: the rest of the class has room */
+			dst = find_dst_zspage(class, src);
+			migrate_object(pool, src, idx, dst);
+			fix_fullness_group(class, dst);
+		}
+
+		BUG_ON(src->inuse);
+		list_del(&src->list);
+		class->objs_allocated -= class->objs_per_zspage;
+
+		spin_unlock(&class->lock);
+		write_unlock(&pool->migrate_lock);
+
+		free_zspage(pool, src);
+		freed += class->pages_per_zspage;
+		cond_resched();
+	}
+
+	return freed;
+}
+
+/**
+ * zs_compact - release sparsely used zspages.
+ * @pool: pool to compact
+ *
+ * Moves objects out of almost empty zspages into other zspages of
+ * the same class and frees the emptied ones. Handles stay valid.
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long freed = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		freed += compact_class(pool, &pool->size_class[i]);
+
+	atomic_long_add(freed, &pool->pages_compacted);
+	return freed;
+}
+
+/* Memory used by the pool, including fragmentation */
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+
+/* Memory allocated in zspages but not used by any object */
+u64 zs_get_frag_bytes(struct zs_pool *pool)
+{
+	int i;
+	u64 used = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock(&class->lock);
+		used += (u64)class->objs_inuse * class->size;
+		spin_unlock(&class->lock);
+	}
+
+	return zs_get_total_size_bytes(pool) - used;
+}
+
+u64 zs_get_pages_compacted(struct zs_pool *pool)
+{
+	return atomic_long_read(&pool->pages_compacted);
+}
@@ -0,0 +1,113 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * Copyright (C) 2008, 2009, 2010  Nitin Gupta
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/* User configurable params */
+
+/*
+ * Objects of one size class are packed back to back into a
+ * "zspage" made of up to this many (not necessarily contiguous)
+ * pages, so objects may straddle page boundaries.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+/* Size classes are separated by ZS_SIZE_CLASS_DELTA bytes */
+#define ZS_SIZE_CLASS_DELTA	(PAGE_SIZE >> 8)
+#define ZS_SIZE_CLASSES		((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) \
+					/ ZS_SIZE_CLASS_DELTA + 1)
+
+/*
+ * zspages with more than this fraction (in quarters) of their
+ * objects in use are "almost full": allocations prefer them, while
+ * compaction moves objects out of the "almost empty" ones.
+ */
+#define ZS_ALMOST_FULL_QUARTERS	3
+
+/* End of user params */
+
+enum fullness_group {
+	ZS_FULL,
+	ZS_ALMOST_FULL,
+	ZS_ALMOST_EMPTY,
+	__NR_ZS_FULLNESS_GROUPS,
+};
+
+struct size_class;
+
+struct zspage {
+	struct list_head list;		/* in class fullness list */
+	struct size_class *class;
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+	unsigned int inuse;		/* no. of objects allocated */
+	unsigned int free_idx;		/* first free object */
+	enum fullness_group fullness;
+	/*
+	 * For each object: its handle if allocated, otherwise
+	 * (index of next free object << 1) | 1.
+	 */
+	unsigned long *objs;
+};
+
+/*
+ * A handle points to one of these. Compaction moves the object and
+ * updates the location, so handles stay valid.
+ */
+struct zs_handle {
+	struct zspage *zspage;
+	unsigned int idx;
+};
+
+struct size_class {
+	spinlock_t lock;
+	int size;			/* object size */
+	int pages_per_zspage;
+	int objs_per_zspage;
+	struct list_head fullness_list[__NR_ZS_FULLNESS_GROUPS];
+
+	/* stats */
+	unsigned long objs_allocated;	/* objects in all zspages */
+	unsigned long objs_inuse;
+};
+
+/* Bounce buffer for objects straddling a page boundary */
+struct zs_map_area {
+	char *buf;
+	char *vm_addr;		/* page mapping, NULL if bounced */
+	enum zs_mapmode mm;
+};
+
+struct zs_pool {
+	struct size_class size_class[ZS_SIZE_CLASSES];
+
+	/*
+	 * Held for reading while an object is mapped and for writing
+	 * while compaction moves objects.
+	 */
+	rwlock_t migrate_lock;
+	struct zs_map_area __percpu *map_area;
+
+	/* stats */
+	atomic_long_t pages_allocated;
+	atomic_long_t pages_compacted;
+};
+
+#endif
@@ -77,6 +77,44 @@ static struct buffer_head *get_block_length(struct super_block *sb,
 }
 
 
+/*
+ * Submit the reads of a datablock without waiting for them to complete,
+ * so that a later squashfs_read_data() of the block finds its
+ * buffer_heads in flight or already up to date.  Errors are ignored,
+ * they will be reported when the block is read.
+ */
+void squashfs_prefetch_block(struct super_block *sb, u64 index, int length)
+{
+	struct squashfs_sb_info *msblk = sb->s_fs_info;
+	struct buffer_head **bh;
+	u64 cur_index = index >> msblk->devblksize_log2;
+	int b, blocks;
+
+	length = SQUASHFS_COMPRESSED_SIZE_BLOCK(length);
+	if (length <= 0 || length > msblk->block_size ||
+			(index + length) > msblk->bytes_used)
+		return;
+
+	blocks = ((index + length - 1) >> msblk->devblksize_log2) -
+		cur_index + 1;
+	bh = kcalloc(blocks, sizeof(*bh), GFP_KERNEL);
+	if (bh == NULL)
+		return;
+
+	for (b = 0; b < blocks; b++, cur_index++) {
+		bh[b] = sb_getblk(sb, cur_index);
+		if (bh[b] == NULL)
+			break;
+	}
+
+	ll_rw_block(READ, b, bh);
+
+	while (b--)
+		put_bh(bh[b]);
+	kfree(bh);
+}
+
+
 /*
  * Read and decompress a metadata block or datablock.  Length is non-zero
  * if a datablock is being read (the size is stored elsewhere in the
@@ -92,7 +130,7 @@ int squashfs_read_data(struct super_block *sb, void **buffer, u64 index,
 	struct buffer_head **bh;
 	int offset = index & ((1 << msblk->devblksize_log2) - 1);
 	u64 cur_index = index >> msblk->devblksize_log2;
-	int bytes, compressed, b = 0, k = 0, page = 0, avail;
+	int bytes, compressed, b = 0, k = 0, page = 0, avail, i;
 
 	bh = kcalloc(((srclength + msblk->devblksize - 1)
 		>> msblk->devblksize_log2) + 1, sizeof(*bh), GFP_KERNEL);
@@ -157,6 +195,16 @@ int squashfs_read_data(struct super_block *sb, void **buffer, u64 index,
 		ll_rw_block(READ, b - 1, bh + 1);
 	}
 
+	/*
+	 * Wait for the whole block to be read before decompressing it,
+	 * decompressors may run with preemption disabled.
+	 */
+	for (i = 0; i < b; i++) {
+		wait_on_buffer(bh[i]);
+		if (!buffer_uptodate(bh[i]))
+			goto block_release;
+	}
+
 	if (compressed) {
 		length = squashfs_decompress(msblk, buffer, bh, b, offset,
 			 length, srclength, pages);
@@ -166,13 +214,7 @@ int squashfs_read_data(struct super_block *sb, void **buffer, u64 index,
 		/*
 		 * Block is uncompressed.
 		 */
-		int i, in, pg_offset = 0;
-
-		for (i = 0; i < b; i++) {
-			wait_on_buffer(bh[i]);
-			if (!buffer_uptodate(bh[i]))
-				goto block_release;
-		}
+		int in, pg_offset = 0;
 
 		for (bytes = length; k < b; k++) {
 			in = min(bytes, msblk->devblksize - offset);
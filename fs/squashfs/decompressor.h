@@ -23,36 +23,60 @@
  * decompressor.h
  */
 
+/*
+ * The decompress function is passed one of the streams returned by init.
+ * It must not sleep, the buffer_heads have already been read.
+ */
 struct squashfs_decompressor {
 	void	*(*init)(struct squashfs_sb_info *);
 	void	(*free)(void *);
-	int	(*decompress)(struct squashfs_sb_info *, void **,
+	int	(*decompress)(struct squashfs_sb_info *, void *, void **,
 		struct buffer_head **, int, int, int, int, int);
 	int	id;
 	char	*name;
 	int	supported;
 };
 
-static inline void *squashfs_decompressor_init(struct squashfs_sb_info *msblk)
+/*
+ * Decompressor stream handling, selected at mount time by the threads=
+ * option: either a single stream shared by all readers, or one stream
+ * per CPU so concurrent readers decompress in parallel.
+ */
+struct squashfs_decompressor_thread_ops {
+	void	*(*create)(struct squashfs_sb_info *);
+	void	(*destroy)(struct squashfs_sb_info *);
+	int	(*decompress)(struct squashfs_sb_info *, void **,
+		struct buffer_head **, int, int, int, int, int);
+	char	*name;
+};
+
+static inline void *squashfs_decompressor_create(struct squashfs_sb_info *msblk)
 {
-	return msblk->decompressor->init(msblk);
+	return msblk->thread_ops->create(msblk);
 }
 
-static inline void squashfs_decompressor_free(struct squashfs_sb_info *msblk,
-	void *s)
+static inline void squashfs_decompressor_destroy(struct squashfs_sb_info *msblk)
 {
-	if (msblk->decompressor)
-		msblk->decompressor->free(s);
+	if (msblk->stream)
+		msblk->thread_ops->destroy(msblk);
 }
 
 static inline int squashfs_decompress(struct squashfs_sb_info *msblk,
 	void **buffer, struct buffer_head **bh, int b, int offset, int length,
 	int srclength, int pages)
 {
-	return msblk->decompressor->decompress(msblk, buffer, bh, b, offset,
+	return msblk->thread_ops->decompress(msblk, buffer, bh, b, offset,
 		length, srclength, pages);
 }
 
+/* decompressor_single.c */
+extern const struct squashfs_decompressor_thread_ops
+	squashfs_decompressor_single;
+
+/* decompressor_percpu.c */
+extern const struct squashfs_decompressor_thread_ops
+	squashfs_decompressor_percpu;
+
 #ifdef CONFIG_SQUASHFS_XZ
 extern const struct squashfs_decompressor squashfs_xz_comp_ops;
 #endif
@@ -0,0 +1,111 @@
+/*
+ * Squashfs - a compressed read only filesystem for Linux
+ *
+ * Copyright (c) 2002, 2003, 2004, 2005, 2006, 2007, 2008, 2009
+ * Phillip Lougher <phillip@lougher.demon.co.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2,
+ * or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ * decompressor_percpu.c
+ */
+
+#include <linux/types.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/buffer_head.h>
+
+#include "squashfs_fs.h"
+#include "squashfs_fs_sb.h"
+#include "decompressor.h"
+#include "squashfs.h"
+
+/*
+ * This file implements multi-threaded decompression using one
+ * decompressor stream per CPU.  Readers on different CPUs decompress in
+ * parallel; a reader keeps preemption disabled while it uses the stream
+ * of its CPU, which is why decompressors must not sleep.
+ */
+
+struct squashfs_stream {
+	void		*stream;
+};
+
+static void percpu_free_streams(struct squashfs_sb_info *msblk,
+	struct squashfs_stream __percpu *percpu)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct squashfs_stream *stream = per_cpu_ptr(percpu, cpu);
+
+		if (stream->stream)
+			msblk->decompressor->free(stream->stream);
+	}
+	free_percpu(percpu);
+}
+
+
+static void *percpu_create(struct squashfs_sb_info *msblk)
+{
+	struct squashfs_stream __percpu *percpu;
+	int cpu;
+
+	percpu = alloc_percpu(struct squashfs_stream);
+	if (percpu == NULL)
+		return NULL;
+
+	for_each_possible_cpu(cpu) {
+		struct squashfs_stream *stream = per_cpu_ptr(percpu, cpu);
+
+		stream->stream = msblk->decompressor->init(msblk);
+		if (stream->stream == NULL) {
+			percpu_free_streams(msblk, percpu);
+			return NULL;
+		}
+	}
+
+	return (__force void *) percpu;
+}
+
+
+static void percpu_destroy(struct squashfs_sb_info *msblk)
+{
+	percpu_free_streams(msblk,
+		(struct squashfs_stream __percpu *) msblk->stream);
+}
+
+
+static int percpu_decompress(struct squashfs_sb_info *msblk, void **buffer,
+	struct buffer_head **bh, int b, int offset, int length, int srclength,
+	int pages)
+{
+	int res;
+	struct squashfs_stream __percpu *percpu =
+		(struct squashfs_stream __percpu *) msblk->stream;
+	struct squashfs_stream *stream = get_cpu_ptr(percpu);
+
+	res = msblk->decompressor->decompress(msblk, stream->stream, buffer,
+		bh, b, offset, length, srclength, pages);
+	put_cpu_ptr(stream);
+
+	return res;
+}
+
+const struct squashfs_decompressor_thread_ops squashfs_decompressor_percpu = {
+	.create = percpu_create,
+	.destroy = percpu_destroy,
+	.decompress = percpu_decompress,
+	.name = "percpu"
+};
@@ -371,11 +371,121 @@ static int read_blocklist(struct inode *inode, int index, u64 *block)
 }
 
 
+/*
+ * Release the pages grabbed by squashfs_readpage_direct(), other than the
+ * page squashfs_readpage() was called with.
+ */
+static void squashfs_release_pages(struct page *target_page,
+	struct page **page, int pages)
+{
+	int i;
+
+	for (i = 0; i < pages; i++) {
+		if (page[i] == NULL || page[i] == target_page)
+			continue;
+		unlock_page(page[i]);
+		page_cache_release(page[i]);
+	}
+}
+
+
+/*
+ * Decompress a datablock straight into the page cache pages it covers,
+ * rather than into the read_page cache and then copying it.  This is only
+ * done if all the pages of the block can be grabbed (and none of them are
+ * already up to date or in highmem), otherwise -EAGAIN is returned and the
+ * caller falls back to reading the block through the cache.
+ *
+ * On success all the pages, including target_page, are up to date and
+ * unlocked.  On failure target_page is left locked.
+ */
+static int squashfs_readpage_direct(struct page *target_page, u64 block,
+	int bsize)
+{
+	struct inode *inode = target_page->mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int mask = (1 << (msblk->block_log - PAGE_CACHE_SHIFT)) - 1;
+	int start_index = target_page->index & ~mask;
+	int end_index = start_index | mask;
+	int file_pages = (i_size_read(inode) + PAGE_CACHE_SIZE - 1) >>
+		PAGE_CACHE_SHIFT;
+	int i, pages, bytes, res = -EAGAIN;
+	struct page **page;
+	void **pageaddr;
+
+	/* The last block of the file may cover fewer pages */
+	if (end_index >= file_pages)
+		end_index = file_pages - 1;
+	pages = end_index - start_index + 1;
+
+	page = kcalloc(pages, sizeof(*page), GFP_KERNEL);
+	pageaddr = kcalloc(pages, sizeof(*pageaddr), GFP_KERNEL);
+	if (page == NULL || pageaddr == NULL)
+		goto out;
+
+	for (i = 0; i < pages; i++) {
+		if (start_index + i == target_page->index)
+			page[i] = target_page;
+		else {
+			page[i] = grab_cache_page_nowait(target_page->mapping,
+				start_index + i);
+			if (page[i] == NULL || PageUptodate(page[i]))
+				goto release_pages;
+		}
+
+		/*
+		 * Keeping a whole block of highmem pages kmapped could
+		 * exhaust the kmap pool, use the cache for those.
+		 */
+		if (PageHighMem(page[i]))
+			goto release_pages;
+	}
+
+	for (i = 0; i < pages; i++)
+		pageaddr[i] = kmap(page[i]);
+
+	res = squashfs_read_data(inode->i_sb, pageaddr, block, bsize, NULL,
+		msblk->block_size, pages);
+
+	/* Zero the part of the pages past the end of the data */
+	for (i = 0; res >= 0 && i < pages; i++) {
+		bytes = max_t(int, res - i * PAGE_CACHE_SIZE, 0);
+		if (bytes < PAGE_CACHE_SIZE)
+			memset(pageaddr[i] + bytes, 0,
+				PAGE_CACHE_SIZE - bytes);
+	}
+
+	for (i = 0; i < pages; i++) {
+		kunmap(page[i]);
+		if (res < 0)
+			continue;
+		flush_dcache_page(page[i]);
+		SetPageUptodate(page[i]);
+	}
+
+	if (res < 0) {
+		ERROR("Unable to read page, block %llx, size %x\n", block,
+			bsize);
+		goto release_pages;
+	}
+
+	unlock_page(target_page);
+	res = 0;
+
+release_pages:
+	squashfs_release_pages(target_page, page, pages);
+out:
+	kfree(pageaddr);
+	kfree(page);
+	return res;
+}
+
+
 static int squashfs_readpage(struct file *file, struct page *page)
 {
 	struct inode *inode = page->mapping->host;
 	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
-	int bytes, i, offset = 0, sparse = 0;
+	int bytes, i, res, offset = 0, sparse = 0;
 	struct squashfs_cache_entry *buffer = NULL;
 	void *pageaddr;
 
@@ -410,8 +520,16 @@ static int squashfs_readpage(struct file *file, struct page *page)
 			sparse = 1;
 		} else {
 			/*
-			 * Read and decompress datablock.
+			 * Try to decompress the datablock directly into the
+			 * page cache, if not read and decompress it into
+			 * the read_page cache.
 			 */
+			res = squashfs_readpage_direct(page, block, bsize);
+			if (res == 0)
+				return 0;
+			else if (res != -EAGAIN)
+				goto error_out;
+
 			buffer = squashfs_get_datablock(inode->i_sb,
 								block, bsize);
 			if (buffer->error) {
@@ -496,6 +614,57 @@ out:
 }
 
 
+static int squashfs_readpages_filler(void *data, struct page *page)
+{
+	return squashfs_readpage(data, page);
+}
+
+
+/*
+ * Readahead.  The reads of all the datablocks covered by the readahead
+ * window are submitted up front, so the device works on them while the
+ * blocks are decompressed one after the other by squashfs_readpage().
+ */
+static int squashfs_readpages(struct file *file, struct address_space *mapping,
+	struct list_head *pages, unsigned nr_pages)
+{
+	struct inode *inode = mapping->host;
+	struct squashfs_sb_info *msblk = inode->i_sb->s_fs_info;
+	int shift = msblk->block_log - PAGE_CACHE_SHIFT;
+	int file_end = i_size_read(inode) >> msblk->block_log;
+	int index, last = -1;
+	struct page *page;
+
+	TRACE("Entered squashfs_readpages, %u pages, start block %llx\n",
+				nr_pages, squashfs_i(inode)->start);
+
+	/* Pages are on the list in reverse order */
+	list_for_each_entry_reverse(page, pages, lru) {
+		u64 block = 0;
+		int bsize;
+
+		index = page->index >> shift;
+		if (index == last)
+			continue;
+		last = index;
+
+		/* The rest is in the fragment, if any */
+		if (index > file_end || (index == file_end &&
+				squashfs_i(inode)->fragment_block !=
+				SQUASHFS_INVALID_BLK))
+			break;
+
+		bsize = read_blocklist(inode, index, &block);
+		if (bsize > 0)
+			squashfs_prefetch_block(inode->i_sb, block, bsize);
+	}
+
+	return read_cache_pages(mapping, pages, squashfs_readpages_filler,
+		file);
+}
+
+
 const struct address_space_operations squashfs_aops = {
-	.readpage = squashfs_readpage
+	.readpage = squashfs_readpage,
+	.readpages = squashfs_readpages
 };
@@ -9,6 +9,7 @@
 #ifndef __LINUX_DM_BHT_H
 #define __LINUX_DM_BHT_H
 
+#include <asm/atomic.h>
 #include <linux/compiler.h>
 #include <linux/crypto.h>
 #include <linux/types.h>
@@ -106,6 +107,14 @@ struct dm_bht {
 	/* Callbacks for reading and/or writing to the hash device */
 	dm_bht_callback read_cb;
 	dm_bht_callback write_cb;
+
+	/* Optional cache of data blocks verified since creation.  Only the
+	 * first verified_map_blocks blocks are tracked, one bit each.
+	 */
+	unsigned long *verified_map;  /* NULL if disabled */
+	unsigned int verified_map_blocks;
+	atomic_long_t verified_hits;  /* verifies skipped due to the map */
+	atomic_long_t verified_misses;  /* verifies which hashed the data */
 };
 
 /* Constructor for struct dm_bht instances. */
@@ -124,6 +133,10 @@ int dm_bht_root_hexdigest(struct dm_bht *bht, u8 *hexdigest, int available);
 void dm_bht_set_salt(struct dm_bht *bht, const char *hexsalt);
 int dm_bht_salt(struct dm_bht *bht, char *hexsalt);
 
+/* Verified block cache */
+int dm_bht_enable_verified_map(struct dm_bht *bht, size_t max_bytes);
+void dm_bht_invalidate_verified_map(struct dm_bht *bht);
+
 /* Functions for loading in data from disk for verification */
 bool dm_bht_is_populated(struct dm_bht *bht, unsigned int block);
 int dm_bht_populate(struct dm_bht *bht, void *read_cb_ctx,
@@ -142,5 +155,6 @@ int dm_bht_store_block(struct dm_bht *bht, unsigned int block,
 int dm_bht_zeroread_callback(void *ctx, sector_t start, u8 *dst, sector_t count,
 			     struct dm_bht_entry *entry);
 void dm_bht_read_completed(struct dm_bht_entry *entry, int status);
+void dm_bht_read_cancelled(struct dm_bht_entry *entry);
 void dm_bht_write_completed(struct dm_bht_entry *entry, int status);
 #endif  /* __LINUX_DM_BHT_H */
@@ -72,6 +72,7 @@
 #include <linux/ctype.h>
 #include <linux/ftrace.h>
 #include <linux/slab.h>
+#include <linux/blkdev.h>
 
 #include <asm/tlb.h>
 #include <asm/irq_regs.h>
@@ -3938,6 +3939,14 @@ asmlinkage void __sched schedule(void)
 	struct rq *rq;
 	int cpu;
 
+	/*
+	 * If we are going to sleep and we have plugged IO queued, make
+	 * sure to submit it to avoid deadlocks.
+	 */
+	if (current->state && !(preempt_count() & PREEMPT_ACTIVE) &&
+	    blk_needs_flush_plug(current))
+		blk_flush_plug(current);
+
 need_resched:
 	preempt_disable();
 	cpu = smp_processor_id();
@@ -5332,6 +5341,7 @@ void __sched io_schedule(void)
 {
 	struct rq *rq = raw_rq();
 
+	blk_flush_plug(current);
 	delayacct_blkio_start();
 	atomic_inc(&rq->nr_iowait);
 	current->in_iowait = 1;
@@ -5347,6 +5357,7 @@ long __sched io_schedule_timeout(long timeout)
 	struct rq *rq = raw_rq();
 	long ret;
 
+	blk_flush_plug(current);
 	delayacct_blkio_start();
 	atomic_inc(&rq->nr_iowait);
 	current->in_iowait = 1;
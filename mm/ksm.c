@@ -23,7 +23,6 @@
 #include <linux/pagemap.h>
 #include <linux/rmap.h>
 #include <linux/spinlock.h>
-#include <linux/jhash.h>
 #include <linux/delay.h>
 #include <linux/kthread.h>
 #include <linux/wait.h>
@@ -35,6 +34,7 @@
 #include <linux/ksm.h>
 #include <linux/hash.h>
 #include <linux/freezer.h>
+#include <linux/vmalloc.h>
 
 #include <asm/tlbflush.h>
 #include "internal.h"
@@ -79,34 +79,49 @@
  *    compare it against the stable tree, and then against the unstable tree.)
  */
 
+struct ksm_scan;
+
 /**
  * struct mm_slot - ksm information per mm that is being scanned
  * @link: link to the mm_slots hash list
- * @mm_list: link into the mm_slots list, rooted in ksm_mm_head
+ * @mm_list: link into the mm_slots list, rooted in its scanner's mm_head
  * @rmap_list: head for this mm_slot's singly-linked list of rmap_items
  * @mm: the mm that this information is valid for
+ * @scan: the scanner this mm is assigned to
  */
 struct mm_slot {
 	struct hlist_node link;
 	struct list_head mm_list;
 	struct rmap_item *rmap_list;
 	struct mm_struct *mm;
+	struct ksm_scan *scan;
 };
 
 /**
  * struct ksm_scan - cursor for scanning
+ * @mm_head: head of the list of mm_slots assigned to this scanner
  * @mm_slot: the current mm_slot we are scanning
  * @address: the next address inside that to be scanned
  * @rmap_list: link to the next rmap to be scanned in the rmap_list
- * @seqnr: count of completed full scans (needed when removing unstable node)
+ * @seqnr: count of completed full scans of this scanner's mm_slots
+ * @passed: has completed a full scan since the unstable tree was reset
+ * @pages_scanned: the number of pages this scanner has looked at
+ * @thread: the ksmd thread running this scanner, if any
  *
- * There is only the one ksm_scan instance of this cursor structure.
+ * There is one ksm_scan for each ksmd thread.  The mm_slots are
+ * partitioned between them, but they all share the one unstable tree
+ * and the one stable tree, so identical pages meet whichever ksmd
+ * scans them.
  */
 struct ksm_scan {
+	struct mm_slot mm_head;
 	struct mm_slot *mm_slot;
 	unsigned long address;
 	struct rmap_item **rmap_list;
 	unsigned long seqnr;
+	bool passed;
+	unsigned long pages_scanned;
+	struct task_struct *thread;
 };
 
 /**
@@ -114,11 +129,15 @@ struct ksm_scan {
  * @node: rb node of this ksm page in the stable tree
  * @hlist: hlist head of rmap_items using this ksm page
  * @kpfn: page frame number of this ksm page
+ * @hash_node: link into the stable_hash chain of this checksum
+ * @checksum: checksum of the (write-protected, so unchanging) ksm page
  */
 struct stable_node {
 	struct rb_node node;
 	struct hlist_head hlist;
 	unsigned long kpfn;
+	struct hlist_node hash_node;
+	u32 checksum;
 };
 
 /**
@@ -155,16 +174,27 @@ struct rmap_item {
 static struct rb_root root_stable_tree = RB_ROOT;
 static struct rb_root root_unstable_tree = RB_ROOT;
 
+/* Count of unstable tree resets: its low bits are kept in rmap_items */
+static unsigned long ksm_unstable_seqnr;
+
+/*
+ * Hash index of the stable tree by page checksum, so that looking up a
+ * candidate ksm page takes one memcmp on average instead of a tree walk.
+ * Sized from the amount of memory in ksm_init().
+ */
+static struct hlist_head *stable_hash;
+static unsigned int stable_hash_shift;
+
 #define MM_SLOTS_HASH_SHIFT 10
 #define MM_SLOTS_HASH_HEADS (1 << MM_SLOTS_HASH_SHIFT)
 static struct hlist_head mm_slots_hash[MM_SLOTS_HASH_HEADS];
 
-static struct mm_slot ksm_mm_head = {
-	.mm_list = LIST_HEAD_INIT(ksm_mm_head.mm_list),
-};
-static struct ksm_scan ksm_scan = {
-	.mm_slot = &ksm_mm_head,
-};
+#define KSM_MAX_THREADS	16
+static struct ksm_scan ksm_scans[KSM_MAX_THREADS];
+
+/* Number of ksmd threads, and the scanner the next new mm goes to */
+static unsigned int ksm_nr_threads = 1;
+static unsigned int ksm_next_scan;
 
 static struct kmem_cache *rmap_item_cache;
 static struct kmem_cache *stable_node_cache;
@@ -180,7 +210,7 @@ static unsigned long ksm_pages_sharing;
 static unsigned long ksm_pages_unshared;
 
 /* The number of rmap_items in use: to calculate pages_volatile */
-static unsigned long ksm_rmap_items;
+static atomic_long_t ksm_rmap_items = ATOMIC_LONG_INIT(0);
 
 /* Number of pages ksmd should scan in one batch */
 static unsigned int ksm_thread_pages_to_scan = 100;
@@ -194,7 +224,23 @@ static unsigned int ksm_thread_sleep_millisecs = 20;
 static unsigned int ksm_run = KSM_RUN_STOP;
 
 static DECLARE_WAIT_QUEUE_HEAD(ksm_thread_wait);
-static DEFINE_MUTEX(ksm_thread_mutex);
+
+/*
+ * ksmd threads hold ksm_thread_sem for reading while they scan a batch;
+ * unmerging, memory hotremove and repartitioning the mm_slots take it
+ * for writing.  ksm_stable_mutex protects the stable tree, stable_hash
+ * and the pages_shared/sharing counts; it nests inside the page lock of
+ * a ksm page.  ksm_threads_mutex serializes starting and stopping ksmds.
+ *
+ * ksm_unstable_mutex protects the unstable tree, its seqnr and the
+ * pages_unshared count; it is held only to search and insert in the tree,
+ * never across a merge.  Each ksmd takes it with its own mm's mmap_sem
+ * held, so under it the mmap_sem of an mm in the tree is only trylocked.
+ */
+static DECLARE_RWSEM(ksm_thread_sem);
+static DEFINE_MUTEX(ksm_stable_mutex);
+static DEFINE_MUTEX(ksm_unstable_mutex);
+static DEFINE_MUTEX(ksm_threads_mutex);
 static DEFINE_SPINLOCK(ksm_mmlist_lock);
 
 #define KSM_KMEM_CACHE(__struct, __flags) kmem_cache_create("ksm_"#__struct,\
@@ -239,13 +285,13 @@ static inline struct rmap_item *alloc_rmap_item(void)
 
 	rmap_item = kmem_cache_zalloc(rmap_item_cache, GFP_KERNEL);
 	if (rmap_item)
-		ksm_rmap_items++;
+		atomic_long_inc(&ksm_rmap_items);
 	return rmap_item;
 }
 
 static inline void free_rmap_item(struct rmap_item *rmap_item)
 {
-	ksm_rmap_items--;
+	atomic_long_dec(&ksm_rmap_items);
 	rmap_item->mm = NULL;	/* debug safety */
 	kmem_cache_free(rmap_item_cache, rmap_item);
 }
@@ -387,18 +433,10 @@ static int break_ksm(struct vm_area_struct *vma, unsigned long addr)
 	return (ret & VM_FAULT_OOM) ? -ENOMEM : 0;
 }
 
-static void break_cow(struct rmap_item *rmap_item)
+static void break_cow_addr(struct mm_struct *mm, unsigned long addr)
 {
-	struct mm_struct *mm = rmap_item->mm;
-	unsigned long addr = rmap_item->address;
 	struct vm_area_struct *vma;
 
-	/*
-	 * It is not an accident that whenever we want to break COW
-	 * to undo, we also need to drop a reference to the anon_vma.
-	 */
-	ksm_drop_anon_vma(rmap_item);
-
 	down_read(&mm->mmap_sem);
 	if (ksm_test_exit(mm))
 		goto out;
@@ -412,6 +450,17 @@ out:
 	up_read(&mm->mmap_sem);
 }
 
+static void break_cow(struct rmap_item *rmap_item)
+{
+	/*
+	 * It is not an accident that whenever we want to break COW
+	 * to undo, we also need to drop a reference to the anon_vma.
+	 */
+	ksm_drop_anon_vma(rmap_item);
+
+	break_cow_addr(rmap_item->mm, rmap_item->address);
+}
+
 static struct page *page_trans_compound_anon(struct page *page)
 {
 	if (PageTransCompound(page)) {
@@ -433,7 +482,9 @@ static struct page *get_mergeable_page(struct rmap_item *rmap_item)
 	struct vm_area_struct *vma;
 	struct page *page;
 
-	down_read(&mm->mmap_sem);
+	/* Under ksm_unstable_mutex: see the comment above it */
+	if (!down_read_trylock(&mm->mmap_sem))
+		return NULL;
 	if (ksm_test_exit(mm))
 		goto out;
 	vma = find_vma(mm, addr);
@@ -471,6 +522,7 @@ static void remove_node_from_stable_tree(struct stable_node *stable_node)
 		cond_resched();
 	}
 
+	hlist_del(&stable_node->hash_node);
 	rb_erase(&stable_node->node, &root_stable_tree);
 	free_stable_node(stable_node);
 }
@@ -493,7 +545,7 @@ static void remove_node_from_stable_tree(struct stable_node *stable_node)
  * a page to put something that might look like our key in page->mapping.
  *
  * include/linux/pagemap.h page_cache_get_speculative() is a good reference,
- * but this is different - made simpler by ksm_thread_mutex being held, but
+ * but this is different - made simpler by ksm_stable_mutex being held, but
  * interesting for assuming that no other use of the struct page could ever
  * put our expected_mapping into page->mapping (or a field of the union which
  * coincides with page->mapping).  The RCU calls are not for KSM at all, but
@@ -535,44 +587,68 @@ stale:
  */
 static void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
 {
-	if (rmap_item->address & STABLE_FLAG) {
-		struct stable_node *stable_node;
-		struct page *page;
+	struct stable_node *stable_node;
+	struct page *page;
 
+	/*
+	 * Another ksmd finding the ksm page stale may take the rmap_item
+	 * out of the stable tree under us: check again under the mutex.
+	 */
+	if (rmap_item->address & STABLE_FLAG) {
+		mutex_lock(&ksm_stable_mutex);
+		if (!(rmap_item->address & STABLE_FLAG)) {
+			mutex_unlock(&ksm_stable_mutex);
+			goto out;
+		}
 		stable_node = rmap_item->head;
 		page = get_ksm_page(stable_node);
+		mutex_unlock(&ksm_stable_mutex);
 		if (!page)
 			goto out;
 
+		/* Our reference keeps stable_node from going stale now */
 		lock_page(page);
 		hlist_del(&rmap_item->hlist);
-		unlock_page(page);
-		put_page(page);
-
+		mutex_lock(&ksm_stable_mutex);
 		if (stable_node->hlist.first)
 			ksm_pages_sharing--;
 		else
 			ksm_pages_shared--;
+		mutex_unlock(&ksm_stable_mutex);
+		unlock_page(page);
+		put_page(page);
 
 		ksm_drop_anon_vma(rmap_item);
 		rmap_item->address &= PAGE_MASK;
 
 	} else if (rmap_item->address & UNSTABLE_FLAG) {
 		unsigned char age;
+
+		/*
+		 * Another ksmd may have taken this rmap_item out of the
+		 * tree to merge with it: check again under the mutex.
+		 */
+		mutex_lock(&ksm_unstable_mutex);
+		if (!(rmap_item->address & UNSTABLE_FLAG)) {
+			mutex_unlock(&ksm_unstable_mutex);
+			goto out;
+		}
 		/*
 		 * Usually ksmd can and must skip the rb_erase, because
-		 * root_unstable_tree was already reset to RB_ROOT.
+		 * the unstable tree was already reset to RB_ROOT.
 		 * But be careful when an mm is exiting: do the rb_erase
-		 * if this rmap_item was inserted by this scan, rather
-		 * than left over from before.
+		 * if this rmap_item was inserted since the last reset,
+		 * rather than left over from before.  The tree is only
+		 * reset once every ksmd has completed a scan, so the age
+		 * of an rmap_item stays small while it is unstable.
 		 */
-		age = (unsigned char)(ksm_scan.seqnr - rmap_item->address);
-		BUG_ON(age > 1);
+		age = (unsigned char)(ksm_unstable_seqnr - rmap_item->address);
 		if (!age)
 			rb_erase(&rmap_item->node, &root_unstable_tree);
 
 		ksm_pages_unshared--;
 		rmap_item->address &= PAGE_MASK;
+		mutex_unlock(&ksm_unstable_mutex);
 	}
 out:
 	cond_resched();		/* we're called from many long loops */
@@ -623,7 +699,7 @@ static int unmerge_ksm_pages(struct vm_area_struct *vma,
 /*
  * Only called through the sysfs control interface:
  */
-static int unmerge_and_remove_all_rmap_items(void)
+static int unmerge_scan_rmap_items(struct ksm_scan *scan)
 {
 	struct mm_slot *mm_slot;
 	struct mm_struct *mm;
@@ -631,12 +707,12 @@ static int unmerge_and_remove_all_rmap_items(void)
 	int err = 0;
 
 	spin_lock(&ksm_mmlist_lock);
-	ksm_scan.mm_slot = list_entry(ksm_mm_head.mm_list.next,
+	scan->mm_slot = list_entry(scan->mm_head.mm_list.next,
 						struct mm_slot, mm_list);
 	spin_unlock(&ksm_mmlist_lock);
 
-	for (mm_slot = ksm_scan.mm_slot;
-			mm_slot != &ksm_mm_head; mm_slot = ksm_scan.mm_slot) {
+	for (mm_slot = scan->mm_slot;
+			mm_slot != &scan->mm_head; mm_slot = scan->mm_slot) {
 		mm = mm_slot->mm;
 		down_read(&mm->mmap_sem);
 		for (vma = mm->mmap; vma; vma = vma->vm_next) {
@@ -653,7 +729,7 @@ static int unmerge_and_remove_all_rmap_items(void)
 		remove_trailing_rmap_items(mm_slot, &mm_slot->rmap_list);
 
 		spin_lock(&ksm_mmlist_lock);
-		ksm_scan.mm_slot = list_entry(mm_slot->mm_list.next,
+		scan->mm_slot = list_entry(mm_slot->mm_list.next,
 						struct mm_slot, mm_list);
 		if (ksm_test_exit(mm)) {
 			hlist_del(&mm_slot->link);
@@ -670,25 +746,82 @@ static int unmerge_and_remove_all_rmap_items(void)
 		}
 	}
 
-	ksm_scan.seqnr = 0;
+	scan->seqnr = 0;
 	return 0;
 
 error:
 	up_read(&mm->mmap_sem);
 	spin_lock(&ksm_mmlist_lock);
-	ksm_scan.mm_slot = &ksm_mm_head;
+	scan->mm_slot = &scan->mm_head;
 	spin_unlock(&ksm_mmlist_lock);
 	return err;
 }
+
+static int unmerge_and_remove_all_rmap_items(void)
+{
+	int i, err;
+
+	for (i = 0; i < KSM_MAX_THREADS; i++) {
+		err = unmerge_scan_rmap_items(&ksm_scans[i]);
+		if (err)
+			return err;
+	}
+	return 0;
+}
+
+/*
+ * Deal the mm_slots out round robin to the first @nr scanners.
+ * Called with ksm_thread_sem held for writing.
+ */
+static void ksm_repartition(unsigned int nr)
+{
+	struct mm_slot *mm_slot, *next;
+	struct ksm_scan *scan;
+	LIST_HEAD(mm_list);
+	int i;
+
+	spin_lock(&ksm_mmlist_lock);
+	for (i = 0; i < KSM_MAX_THREADS; i++) {
+		scan = &ksm_scans[i];
+		list_splice_tail_init(&scan->mm_head.mm_list, &mm_list);
+		scan->mm_slot = &scan->mm_head;
+	}
+
+	ksm_nr_threads = nr;
+	ksm_next_scan = 0;
+	list_for_each_entry_safe(mm_slot, next, &mm_list, mm_list) {
+		scan = &ksm_scans[ksm_next_scan++ % nr];
+		mm_slot->scan = scan;
+		list_move_tail(&mm_slot->mm_list, &scan->mm_head.mm_list);
+	}
+	spin_unlock(&ksm_mmlist_lock);
+}
 #endif /* CONFIG_SYSFS */
 
+/*
+ * Checksum a page a native word at a time.  Each of the four lanes is an
+ * xor-multiply chain, bijective in every word, so any single changed word
+ * changes the lane; the lanes are independent so their multiplies overlap.
+ */
 static u32 calc_checksum(struct page *page)
 {
-	u32 checksum;
-	void *addr = kmap_atomic(page, KM_USER0);
-	checksum = jhash2(addr, PAGE_SIZE / 4, 17);
+	unsigned long a = 0, b = 0, c = 0, d = 0;
+	unsigned long *addr;
+	int i;
+
+	addr = kmap_atomic(page, KM_USER0);
+	for (i = 0; i < PAGE_SIZE / sizeof(long); i += 4) {
+		a = (a ^ addr[i]) * GOLDEN_RATIO_PRIME;
+		b = (b ^ addr[i + 1]) * GOLDEN_RATIO_PRIME;
+		c = (c ^ addr[i + 2]) * GOLDEN_RATIO_PRIME;
+		d = (d ^ addr[i + 3]) * GOLDEN_RATIO_PRIME;
+	}
 	kunmap_atomic(addr, KM_USER0);
-	return checksum;
+
+	a = (a * GOLDEN_RATIO_PRIME) ^ b;
+	a = (a * GOLDEN_RATIO_PRIME) ^ c;
+	a = (a * GOLDEN_RATIO_PRIME) ^ d;
+	return hash_long(a, 32);
 }
 
 static int memcmp_pages(struct page *page1, struct page *page2)
@@ -955,6 +1088,33 @@ out:
 	return err;
 }
 
+/*
+ * try_to_merge_tree_page - merge page, found in the unstable tree mapped
+ * at @addr in @mm, into kpage.  Its rmap_item is not ours to hold on to,
+ * so unlike try_to_merge_with_ksm_page no anon_vma reference is taken:
+ * its own ksmd adds it to the stable tree when it next comes round.
+ *
+ * This function returns 0 if the pages were merged, -EFAULT otherwise.
+ */
+static int try_to_merge_tree_page(struct mm_struct *mm, unsigned long addr,
+				  struct page *page, struct page *kpage)
+{
+	struct vm_area_struct *vma;
+	int err = -EFAULT;
+
+	down_read(&mm->mmap_sem);
+	if (ksm_test_exit(mm))
+		goto out;
+	vma = find_vma(mm, addr);
+	if (!vma || vma->vm_start > addr)
+		goto out;
+
+	err = try_to_merge_one_page(vma, page, kpage);
+out:
+	up_read(&mm->mmap_sem);
+	return err;
+}
+
 /*
  * try_to_merge_two_pages - take two identical pages and prepare them
  * to be merged into one page.
@@ -967,15 +1127,16 @@ out:
  */
 static struct page *try_to_merge_two_pages(struct rmap_item *rmap_item,
 					   struct page *page,
-					   struct rmap_item *tree_rmap_item,
+					   struct mm_struct *tree_mm,
+					   unsigned long tree_addr,
 					   struct page *tree_page)
 {
 	int err;
 
 	err = try_to_merge_with_ksm_page(rmap_item, page, NULL);
 	if (!err) {
-		err = try_to_merge_with_ksm_page(tree_rmap_item,
-							tree_page, page);
+		err = try_to_merge_tree_page(tree_mm, tree_addr,
+					     tree_page, page);
 		/*
 		 * If that fails, we have a ksm page with only one pte
 		 * pointing to it: so break it.
@@ -992,13 +1153,19 @@ static struct page *try_to_merge_two_pages(struct rmap_item *rmap_item,
  * This function checks if there is a page inside the stable tree
  * with identical content to the page that we are scanning right now.
  *
+ * Every ksm page in the stable tree is also hashed by its checksum, so
+ * only the pages in the stable_hash chain of @page's checksum need to be
+ * compared.  The checksum of @page is returned in @checksum, for the
+ * caller to reuse; it is left alone if @page is a ksm page already.
+ *
  * This function returns the stable tree node of identical content if found,
  * NULL otherwise.
  */
-static struct page *stable_tree_search(struct page *page)
+static struct page *stable_tree_search(struct page *page, u32 *checksum)
 {
-	struct rb_node *node = root_stable_tree.rb_node;
 	struct stable_node *stable_node;
+	struct hlist_node *hnode, *next;
+	struct hlist_head *head;
 
 	stable_node = page_stable_node(page);
 	if (stable_node) {			/* ksm page forked */
@@ -1006,27 +1173,28 @@ static struct page *stable_tree_search(struct page *page)
 		return page;
 	}
 
-	while (node) {
+	*checksum = calc_checksum(page);
+	head = &stable_hash[hash_32(*checksum, stable_hash_shift)];
+
+	mutex_lock(&ksm_stable_mutex);
+	hlist_for_each_entry_safe(stable_node, hnode, next, head, hash_node) {
 		struct page *tree_page;
-		int ret;
 
-		cond_resched();
-		stable_node = rb_entry(node, struct stable_node, node);
+		if (stable_node->checksum != *checksum)
+			continue;
+
+		/* This may remove a stale stable_node from the chain */
 		tree_page = get_ksm_page(stable_node);
 		if (!tree_page)
-			return NULL;
-
-		ret = memcmp_pages(page, tree_page);
+			continue;
 
-		if (ret < 0) {
-			put_page(tree_page);
-			node = node->rb_left;
-		} else if (ret > 0) {
-			put_page(tree_page);
-			node = node->rb_right;
-		} else
+		if (pages_identical(page, tree_page)) {
+			mutex_unlock(&ksm_stable_mutex);
 			return tree_page;
+		}
+		put_page(tree_page);
 	}
+	mutex_unlock(&ksm_stable_mutex);
 
 	return NULL;
 }
@@ -1042,8 +1210,9 @@ static struct stable_node *stable_tree_insert(struct page *kpage)
 {
 	struct rb_node **new = &root_stable_tree.rb_node;
 	struct rb_node *parent = NULL;
-	struct stable_node *stable_node;
+	struct stable_node *stable_node = NULL;
 
+	mutex_lock(&ksm_stable_mutex);
 	while (*new) {
 		struct page *tree_page;
 		int ret;
@@ -1052,7 +1221,7 @@ static struct stable_node *stable_tree_insert(struct page *kpage)
 		stable_node = rb_entry(*new, struct stable_node, node);
 		tree_page = get_ksm_page(stable_node);
 		if (!tree_page)
-			return NULL;
+			goto fail;
 
 		ret = memcmp_pages(kpage, tree_page);
 		put_page(tree_page);
@@ -1068,23 +1237,36 @@ static struct stable_node *stable_tree_insert(struct page *kpage)
 			 * find this node: because at that time our page was
 			 * not yet write-protected, so may have changed since.
 			 */
-			return NULL;
+			goto fail;
 		}
 	}
 
 	stable_node = alloc_stable_node();
 	if (!stable_node)
-		return NULL;
+		goto out;
 
 	rb_link_node(&stable_node->node, parent, new);
 	rb_insert_color(&stable_node->node, &root_stable_tree);
 
+	/*
+	 * kpage is write-protected by now, unlike when the scanned page
+	 * was checksummed: checksum it again for the index.
+	 */
+	stable_node->checksum = calc_checksum(kpage);
+	hlist_add_head(&stable_node->hash_node,
+		       &stable_hash[hash_32(stable_node->checksum,
+					    stable_hash_shift)]);
+
 	INIT_HLIST_HEAD(&stable_node->hlist);
 
 	stable_node->kpfn = page_to_pfn(kpage);
 	set_page_stable_node(kpage, stable_node);
-
+out:
+	mutex_unlock(&ksm_stable_mutex);
 	return stable_node;
+fail:
+	stable_node = NULL;
+	goto out;
 }
 
 /*
@@ -1100,6 +1282,8 @@ static struct stable_node *stable_tree_insert(struct page *kpage)
  *
  * This function does both searching and inserting, because they share
  * the same walking algorithm in an rbtree.
+ *
+ * Called with ksm_unstable_mutex held.
  */
 static
 struct rmap_item *unstable_tree_search_insert(struct rmap_item *rmap_item,
@@ -1145,7 +1329,7 @@ struct rmap_item *unstable_tree_search_insert(struct rmap_item *rmap_item,
 	}
 
 	rmap_item->address |= UNSTABLE_FLAG;
-	rmap_item->address |= (ksm_scan.seqnr & SEQNR_MASK);
+	rmap_item->address |= (ksm_unstable_seqnr & SEQNR_MASK);
 	rb_link_node(&rmap_item->node, parent, new);
 	rb_insert_color(&rmap_item->node, &root_unstable_tree);
 
@@ -1161,6 +1345,7 @@ struct rmap_item *unstable_tree_search_insert(struct rmap_item *rmap_item,
 static void stable_tree_append(struct rmap_item *rmap_item,
 			       struct stable_node *stable_node)
 {
+	mutex_lock(&ksm_stable_mutex);
 	rmap_item->head = stable_node;
 	rmap_item->address |= STABLE_FLAG;
 	hlist_add_head(&rmap_item->hlist, &stable_node->hlist);
@@ -1169,6 +1354,7 @@ static void stable_tree_append(struct rmap_item *rmap_item,
 		ksm_pages_sharing++;
 	else
 		ksm_pages_shared++;
+	mutex_unlock(&ksm_stable_mutex);
 }
 
 /*
@@ -1185,14 +1371,16 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 	struct rmap_item *tree_rmap_item;
 	struct page *tree_page = NULL;
 	struct stable_node *stable_node;
+	struct mm_struct *tree_mm;
+	unsigned long tree_addr;
 	struct page *kpage;
-	unsigned int checksum;
+	u32 checksum;
 	int err;
 
 	remove_rmap_item_from_tree(rmap_item);
 
 	/* We first start with searching the page inside the stable tree */
-	kpage = stable_tree_search(page);
+	kpage = stable_tree_search(page, &checksum);
 	if (kpage) {
 		err = try_to_merge_with_ksm_page(rmap_item, page, kpage);
 		if (!err) {
@@ -1214,46 +1402,60 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 	 * don't want to insert it in the unstable tree, and we don't want
 	 * to waste our time searching for something identical to it there.
 	 */
-	checksum = calc_checksum(page);
 	if (rmap_item->oldchecksum != checksum) {
 		rmap_item->oldchecksum = checksum;
 		return;
 	}
 
+	mutex_lock(&ksm_unstable_mutex);
 	tree_rmap_item =
 		unstable_tree_search_insert(rmap_item, page, &tree_page);
-	if (tree_rmap_item) {
-		kpage = try_to_merge_two_pages(rmap_item, page,
-						tree_rmap_item, tree_page);
-		put_page(tree_page);
+	if (!tree_rmap_item) {
+		mutex_unlock(&ksm_unstable_mutex);
+		return;
+	}
+	/*
+	 * Take the rmap_item we matched out of the unstable tree, so that
+	 * no other ksmd merges with it too, and let go of the mutex before
+	 * merging: the merge needs both mmap_sems.  Its own ksmd may free
+	 * that rmap_item as soon as we let go, so keep only its mm, pinned,
+	 * and address; try_to_merge_one_page() checks the pages again.
+	 */
+	tree_mm = tree_rmap_item->mm;
+	tree_addr = tree_rmap_item->address & PAGE_MASK;
+	atomic_inc(&tree_mm->mm_count);
+	rb_erase(&tree_rmap_item->node, &root_unstable_tree);
+	tree_rmap_item->address &= PAGE_MASK;
+	ksm_pages_unshared--;
+	mutex_unlock(&ksm_unstable_mutex);
+
+	kpage = try_to_merge_two_pages(rmap_item, page,
+				       tree_mm, tree_addr, tree_page);
+	put_page(tree_page);
+	/*
+	 * As soon as we merge this page, we want to insert it as new node
+	 * in the stable tree.  The other rmap_item joins it when its ksmd
+	 * next finds the ksm page mapped there, as after a fork.
+	 */
+	if (kpage) {
+		lock_page(kpage);
+		stable_node = stable_tree_insert(kpage);
+		if (stable_node)
+			stable_tree_append(rmap_item, stable_node);
+		unlock_page(kpage);
+
 		/*
-		 * As soon as we merge this page, we want to remove the
-		 * rmap_item of the page we have merged with from the unstable
-		 * tree, and insert it instead as new node in the stable tree.
+		 * If we fail to insert the page into the stable tree,
+		 * we will have 2 virtual addresses that are pointing
+		 * to a ksm page left outside the stable tree,
+		 * in which case we need to break_cow on both.
 		 */
-		if (kpage) {
-			remove_rmap_item_from_tree(tree_rmap_item);
-
-			lock_page(kpage);
-			stable_node = stable_tree_insert(kpage);
-			if (stable_node) {
-				stable_tree_append(tree_rmap_item, stable_node);
-				stable_tree_append(rmap_item, stable_node);
-			}
-			unlock_page(kpage);
-
-			/*
-			 * If we fail to insert the page into the stable tree,
-			 * we will have 2 virtual addresses that are pointing
-			 * to a ksm page left outside the stable tree,
-			 * in which case we need to break_cow on both.
-			 */
-			if (!stable_node) {
-				break_cow(tree_rmap_item);
-				break_cow(rmap_item);
-			}
+		if (!stable_node) {
+			break_cow_addr(tree_mm, tree_addr);
+			break_cow(rmap_item);
 		}
 	}
+	mmdrop(tree_mm);
 }
 
 static struct rmap_item *get_next_rmap_item(struct mm_slot *mm_slot,
@@ -1284,18 +1486,48 @@ static struct rmap_item *get_next_rmap_item(struct mm_slot *mm_slot,
 	return rmap_item;
 }
 
-static struct rmap_item *scan_get_next_rmap_item(struct page **page)
+/*
+ * The unstable tree is reset once every ksmd with mm_slots to scan has
+ * been through all of them since it was last reset: until then, a page
+ * must stay in the tree for the slower ksmds to compare theirs against.
+ */
+static void unstable_tree_pass_done(struct ksm_scan *scan)
+{
+	int i;
+
+	mutex_lock(&ksm_unstable_mutex);
+	scan->passed = true;
+
+	spin_lock(&ksm_mmlist_lock);
+	for (i = 0; i < ksm_nr_threads; i++) {
+		if (!ksm_scans[i].passed &&
+		    !list_empty(&ksm_scans[i].mm_head.mm_list))
+			break;
+	}
+	spin_unlock(&ksm_mmlist_lock);
+
+	if (i == ksm_nr_threads) {
+		root_unstable_tree = RB_ROOT;
+		ksm_unstable_seqnr++;
+		for (i = 0; i < KSM_MAX_THREADS; i++)
+			ksm_scans[i].passed = false;
+	}
+	mutex_unlock(&ksm_unstable_mutex);
+}
+
+static struct rmap_item *scan_get_next_rmap_item(struct ksm_scan *scan,
+						 struct page **page)
 {
 	struct mm_struct *mm;
 	struct mm_slot *slot;
 	struct vm_area_struct *vma;
 	struct rmap_item *rmap_item;
 
-	if (list_empty(&ksm_mm_head.mm_list))
+	if (list_empty(&scan->mm_head.mm_list))
 		return NULL;
 
-	slot = ksm_scan.mm_slot;
-	if (slot == &ksm_mm_head) {
+	slot = scan->mm_slot;
+	if (slot == &scan->mm_head) {
 		/*
 		 * A number of pages can hang around indefinitely on per-cpu
 		 * pagevecs, raised page count preventing write_protect_page
@@ -1308,15 +1540,13 @@ static struct rmap_item *scan_get_next_rmap_item(struct page **page)
 		 */
 		lru_add_drain_all();
 
-		root_unstable_tree = RB_ROOT;
-
 		spin_lock(&ksm_mmlist_lock);
 		slot = list_entry(slot->mm_list.next, struct mm_slot, mm_list);
-		ksm_scan.mm_slot = slot;
+		scan->mm_slot = slot;
 		spin_unlock(&ksm_mmlist_lock);
 next_mm:
-		ksm_scan.address = 0;
-		ksm_scan.rmap_list = &slot->rmap_list;
+		scan->address = 0;
+		scan->rmap_list = &slot->rmap_list;
 	}
 
 	mm = slot->mm;
@@ -1324,60 +1554,60 @@ next_mm:
 	if (ksm_test_exit(mm))
 		vma = NULL;
 	else
-		vma = find_vma(mm, ksm_scan.address);
+		vma = find_vma(mm, scan->address);
 
 	for (; vma; vma = vma->vm_next) {
 		if (!(vma->vm_flags & VM_MERGEABLE))
 			continue;
-		if (ksm_scan.address < vma->vm_start)
-			ksm_scan.address = vma->vm_start;
+		if (scan->address < vma->vm_start)
+			scan->address = vma->vm_start;
 		if (!vma->anon_vma)
-			ksm_scan.address = vma->vm_end;
+			scan->address = vma->vm_end;
 
-		while (ksm_scan.address < vma->vm_end) {
+		while (scan->address < vma->vm_end) {
 			if (ksm_test_exit(mm))
 				break;
-			*page = follow_page(vma, ksm_scan.address, FOLL_GET);
+			*page = follow_page(vma, scan->address, FOLL_GET);
 			if (IS_ERR_OR_NULL(*page)) {
-				ksm_scan.address += PAGE_SIZE;
+				scan->address += PAGE_SIZE;
 				cond_resched();
 				continue;
 			}
 			if (PageAnon(*page) ||
 			    page_trans_compound_anon(*page)) {
-				flush_anon_page(vma, *page, ksm_scan.address);
+				flush_anon_page(vma, *page, scan->address);
 				flush_dcache_page(*page);
 				rmap_item = get_next_rmap_item(slot,
-					ksm_scan.rmap_list, ksm_scan.address);
+					scan->rmap_list, scan->address);
 				if (rmap_item) {
-					ksm_scan.rmap_list =
+					scan->rmap_list =
 							&rmap_item->rmap_list;
-					ksm_scan.address += PAGE_SIZE;
+					scan->address += PAGE_SIZE;
 				} else
 					put_page(*page);
 				up_read(&mm->mmap_sem);
 				return rmap_item;
 			}
 			put_page(*page);
-			ksm_scan.address += PAGE_SIZE;
+			scan->address += PAGE_SIZE;
 			cond_resched();
 		}
 	}
 
 	if (ksm_test_exit(mm)) {
-		ksm_scan.address = 0;
-		ksm_scan.rmap_list = &slot->rmap_list;
+		scan->address = 0;
+		scan->rmap_list = &slot->rmap_list;
 	}
 	/*
 	 * Nuke all the rmap_items that are above this current rmap:
 	 * because there were no VM_MERGEABLE vmas with such addresses.
 	 */
-	remove_trailing_rmap_items(slot, ksm_scan.rmap_list);
+	remove_trailing_rmap_items(slot, scan->rmap_list);
 
 	spin_lock(&ksm_mmlist_lock);
-	ksm_scan.mm_slot = list_entry(slot->mm_list.next,
+	scan->mm_slot = list_entry(slot->mm_list.next,
 						struct mm_slot, mm_list);
-	if (ksm_scan.address == 0) {
+	if (scan->address == 0) {
 		/*
 		 * We've completed a full scan of all vmas, holding mmap_sem
 		 * throughout, and found no VM_MERGEABLE: so do the same as
@@ -1401,63 +1631,103 @@ next_mm:
 	}
 
 	/* Repeat until we've completed scanning the whole list */
-	slot = ksm_scan.mm_slot;
-	if (slot != &ksm_mm_head)
+	slot = scan->mm_slot;
+	if (slot != &scan->mm_head)
 		goto next_mm;
 
-	ksm_scan.seqnr++;
+	scan->seqnr++;
+	unstable_tree_pass_done(scan);
 	return NULL;
 }
 
 /**
  * ksm_do_scan  - the ksm scanner main worker function.
+ * @scan - the scanner whose mm_slots we are to scan.
  * @scan_npages - number of pages we want to scan before we return.
  */
-static void ksm_do_scan(unsigned int scan_npages)
+static void ksm_do_scan(struct ksm_scan *scan, unsigned int scan_npages)
 {
 	struct rmap_item *rmap_item;
 	struct page *uninitialized_var(page);
 
 	while (scan_npages-- && likely(!freezing(current))) {
 		cond_resched();
-		rmap_item = scan_get_next_rmap_item(&page);
+		rmap_item = scan_get_next_rmap_item(scan, &page);
 		if (!rmap_item)
 			return;
+		scan->pages_scanned++;
 		if (!PageKsm(page) || !in_stable_tree(rmap_item))
 			cmp_and_merge_page(page, rmap_item);
 		put_page(page);
 	}
 }
 
-static int ksmd_should_run(void)
+static int ksmd_should_run(struct ksm_scan *scan)
 {
-	return (ksm_run & KSM_RUN_MERGE) && !list_empty(&ksm_mm_head.mm_list);
+	return (ksm_run & KSM_RUN_MERGE) && !list_empty(&scan->mm_head.mm_list);
 }
 
-static int ksm_scan_thread(void *nothing)
+static int ksm_scan_thread(void *data)
 {
+	struct ksm_scan *scan = data;
+
 	set_freezable();
 	set_user_nice(current, 5);
 
 	while (!kthread_should_stop()) {
-		mutex_lock(&ksm_thread_mutex);
-		if (ksmd_should_run())
-			ksm_do_scan(ksm_thread_pages_to_scan);
-		mutex_unlock(&ksm_thread_mutex);
+		down_read(&ksm_thread_sem);
+		if (ksmd_should_run(scan))
+			ksm_do_scan(scan, ksm_thread_pages_to_scan);
+		up_read(&ksm_thread_sem);
 
 		try_to_freeze();
 
-		if (ksmd_should_run()) {
+		if (ksmd_should_run(scan)) {
 			schedule_timeout_interruptible(
 				msecs_to_jiffies(ksm_thread_sleep_millisecs));
 		} else {
 			wait_event_freezable(ksm_thread_wait,
-				ksmd_should_run() || kthread_should_stop());
+				ksmd_should_run(scan) || kthread_should_stop());
 		}
 	}
 	return 0;
 }
 
+/*
+ * Start the ksmd thread of scanner @i, if it is not running yet.
+ * Called with ksm_threads_mutex held.
+ */
+static int ksm_start_thread(int i)
+{
+	struct ksm_scan *scan = &ksm_scans[i];
+	struct task_struct *thread;
+
+	if (scan->thread)
+		return 0;
+
+	if (i)
+		thread = kthread_run(ksm_scan_thread, scan, "ksmd/%d", i);
+	else
+		thread = kthread_run(ksm_scan_thread, scan, "ksmd");
+	if (IS_ERR(thread)) {
+		printk(KERN_ERR "ksm: creating kthread failed\n");
+		return PTR_ERR(thread);
+	}
+
+	scan->thread = thread;
+	return 0;
+}
+
+static void ksm_stop_thread(int i)
+{
+	struct ksm_scan *scan = &ksm_scans[i];
+
+	if (scan->thread) {
+		kthread_stop(scan->thread);
+		scan->thread = NULL;
+	}
+}
+
 int ksm_madvise(struct vm_area_struct *vma, unsigned long start,
 		unsigned long end, int advice, unsigned long *vm_flags)
 {
@@ -1504,23 +1774,27 @@ int ksm_madvise(struct vm_area_struct *vma, unsigned long start,
 int __ksm_enter(struct mm_struct *mm)
 {
 	struct mm_slot *mm_slot;
+	struct ksm_scan *scan;
 	int needs_wakeup;
 
 	mm_slot = alloc_mm_slot();
 	if (!mm_slot)
 		return -ENOMEM;
 
-	/* Check ksm_run too?  Would need tighter locking */
-	needs_wakeup = list_empty(&ksm_mm_head.mm_list);
-
 	spin_lock(&ksm_mmlist_lock);
 	insert_to_mm_slots_hash(mm, mm_slot);
+	scan = &ksm_scans[ksm_next_scan++ % ksm_nr_threads];
+	mm_slot->scan = scan;
+
+	/* Check ksm_run too?  Would need tighter locking */
+	needs_wakeup = list_empty(&scan->mm_head.mm_list);
+
 	/*
 	 * Insert just behind the scanning cursor, to let the area settle
 	 * down a little; when fork is followed by immediate exec, we don't
 	 * want ksmd to waste time setting up and tearing down an rmap_list.
 	 */
-	list_add_tail(&mm_slot->mm_list, &ksm_scan.mm_slot->mm_list);
+	list_add_tail(&mm_slot->mm_list, &scan->mm_slot->mm_list);
 	spin_unlock(&ksm_mmlist_lock);
 
 	set_bit(MMF_VM_MERGEABLE, &mm->flags);
@@ -1548,14 +1822,14 @@ void __ksm_exit(struct mm_struct *mm)
 
 	spin_lock(&ksm_mmlist_lock);
 	mm_slot = get_mm_slot(mm);
-	if (mm_slot && ksm_scan.mm_slot != mm_slot) {
+	if (mm_slot && mm_slot->scan->mm_slot != mm_slot) {
 		if (!mm_slot->rmap_list) {
 			hlist_del(&mm_slot->link);
 			list_del(&mm_slot->mm_list);
 			easy_to_free = 1;
 		} else {
 			list_move(&mm_slot->mm_list,
-				  &ksm_scan.mm_slot->mm_list);
+				  &mm_slot->scan->mm_slot->mm_list);
 		}
 	}
 	spin_unlock(&ksm_mmlist_lock);
@@ -1793,13 +2067,13 @@ static int ksm_memory_callback(struct notifier_block *self,
 		/*
 		 * Keep it very simple for now: just lock out ksmd and
 		 * MADV_UNMERGEABLE while any memory is going offline.
-		 * mutex_lock_nested() is necessary because lockdep was alarmed
-		 * that here we take ksm_thread_mutex inside notifier chain
+		 * down_write_nested() is necessary because lockdep was alarmed
+		 * that here we take ksm_thread_sem inside notifier chain
 		 * mutex, and later take notifier chain mutex inside
-		 * ksm_thread_mutex to unlock it.   But that's safe because both
+		 * ksm_thread_sem to unlock it.   But that's safe because both
 		 * are inside mem_hotplug_mutex.
 		 */
-		mutex_lock_nested(&ksm_thread_mutex, SINGLE_DEPTH_NESTING);
+		down_write_nested(&ksm_thread_sem, SINGLE_DEPTH_NESTING);
 		break;
 
 	case MEM_OFFLINE:
@@ -1808,13 +2082,15 @@ static int ksm_memory_callback(struct notifier_block *self,
 		 * be a few stable_nodes left over, still pointing to struct
 		 * pages which have been offlined: prune those from the tree.
 		 */
+		mutex_lock(&ksm_stable_mutex);
 		while ((stable_node = ksm_check_stable_tree(mn->start_pfn,
 					mn->start_pfn + mn->nr_pages)) != NULL)
 			remove_node_from_stable_tree(stable_node);
+		mutex_unlock(&ksm_stable_mutex);
 		/* fallthrough */
 
 	case MEM_CANCEL_OFFLINE:
-		mutex_unlock(&ksm_thread_mutex);
+		up_write(&ksm_thread_sem);
 		break;
 	}
 	return NOTIFY_OK;
@@ -1903,7 +2179,7 @@ static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
 	 * on the list for when ksmd may be set running again).
 	 */
 
-	mutex_lock(&ksm_thread_mutex);
+	down_write(&ksm_thread_sem);
 	if (ksm_run != flags) {
 		ksm_run = flags;
 		if (flags & KSM_RUN_UNMERGE) {
@@ -1916,7 +2192,7 @@ static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
 			}
 		}
 	}
-	mutex_unlock(&ksm_thread_mutex);
+	up_write(&ksm_thread_sem);
 
 	if (flags & KSM_RUN_MERGE)
 		wake_up_interruptible(&ksm_thread_wait);
@@ -1951,8 +2227,8 @@ static ssize_t pages_volatile_show(struct kobject *kobj,
 {
 	long ksm_pages_volatile;
 
-	ksm_pages_volatile = ksm_rmap_items - ksm_pages_shared
-				- ksm_pages_sharing - ksm_pages_unshared;
+	ksm_pages_volatile = atomic_long_read(&ksm_rmap_items) -
+		ksm_pages_shared - ksm_pages_sharing - ksm_pages_unshared;
 	/*
 	 * It was not worth any locking to calculate that statistic,
 	 * but it might therefore sometimes be negative: conceal that.
@@ -1963,13 +2239,85 @@ static ssize_t pages_volatile_show(struct kobject *kobj,
 }
 KSM_ATTR_RO(pages_volatile);
 
+/* A full scan is complete when every ksmd has been through its mm_slots */
 static ssize_t full_scans_show(struct kobject *kobj,
 			       struct kobj_attribute *attr, char *buf)
 {
-	return sprintf(buf, "%lu\n", ksm_scan.seqnr);
+	unsigned long seqnr = ULONG_MAX;
+	int i;
+
+	for (i = 0; i < ksm_nr_threads; i++)
+		seqnr = min(seqnr, ksm_scans[i].seqnr);
+	return sprintf(buf, "%lu\n", seqnr);
 }
 KSM_ATTR_RO(full_scans);
 
+static ssize_t threads_show(struct kobject *kobj,
+			    struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_nr_threads);
+}
+
+static ssize_t threads_store(struct kobject *kobj,
+			     struct kobj_attribute *attr,
+			     const char *buf, size_t count)
+{
+	unsigned long nr;
+	int i, err;
+
+	err = strict_strtoul(buf, 10, &nr);
+	if (err || nr < 1 || nr > KSM_MAX_THREADS)
+		return -EINVAL;
+
+	mutex_lock(&ksm_threads_mutex);
+	if (nr == ksm_nr_threads)
+		goto out;
+
+	/* New threads idle until they are given mm_slots below */
+	for (i = ksm_nr_threads; i < nr; i++) {
+		err = ksm_start_thread(i);
+		if (err) {
+			while (--i >= ksm_nr_threads)
+				ksm_stop_thread(i);
+			mutex_unlock(&ksm_threads_mutex);
+			return err;
+		}
+	}
+
+	/*
+	 * Stop surplus threads before taking ksm_thread_sem: they may be
+	 * waiting for it, and kthread_stop() waits for them.
+	 */
+	for (i = nr; i < ksm_nr_threads; i++)
+		ksm_stop_thread(i);
+
+	down_write(&ksm_thread_sem);
+	ksm_repartition(nr);
+	up_write(&ksm_thread_sem);
+out:
+	mutex_unlock(&ksm_threads_mutex);
+
+	wake_up_interruptible(&ksm_thread_wait);
+
+	return count;
+}
+KSM_ATTR(threads);
+
+/* One line per ksmd: pages scanned, full scans of its own mm_slots */
+static ssize_t thread_stats_show(struct kobject *kobj,
+				 struct kobj_attribute *attr, char *buf)
+{
+	ssize_t sz = 0;
+	int i;
+
+	for (i = 0; i < ksm_nr_threads; i++)
+		sz += sprintf(buf + sz, "%d %lu %lu\n", i,
+			      ksm_scans[i].pages_scanned,
+			      ksm_scans[i].seqnr);
+	return sz;
+}
+KSM_ATTR_RO(thread_stats);
+
 static struct attribute *ksm_attrs[] = {
 	&sleep_millisecs_attr.attr,
 	&pages_to_scan_attr.attr,
@@ -1979,6 +2327,8 @@ static struct attribute *ksm_attrs[] = {
 	&pages_unshared_attr.attr,
 	&pages_volatile_attr.attr,
 	&full_scans_attr.attr,
+	&threads_attr.attr,
+	&thread_stats_attr.attr,
 	NULL,
 };
 
@@ -1990,25 +2340,36 @@ static struct attribute_group ksm_attr_group = {
 
 static int __init ksm_init(void)
 {
-	struct task_struct *ksm_thread;
-	int err;
+	struct ksm_scan *scan;
+	int i, err;
+
+	for (i = 0; i < KSM_MAX_THREADS; i++) {
+		scan = &ksm_scans[i];
+		INIT_LIST_HEAD(&scan->mm_head.mm_list);
+		scan->mm_slot = &scan->mm_head;
+	}
 
 	err = ksm_slab_init();
 	if (err)
 		goto out;
 
-	ksm_thread = kthread_run(ksm_scan_thread, NULL, "ksmd");
-	if (IS_ERR(ksm_thread)) {
-		printk(KERN_ERR "ksm: creating kthread failed\n");
-		err = PTR_ERR(ksm_thread);
+	/* One chain per 64 pages of memory, between 2^8 and 2^20 chains */
+	stable_hash_shift = clamp_t(int, ilog2(totalram_pages) - 6, 8, 20);
+	stable_hash = vzalloc(sizeof(*stable_hash) << stable_hash_shift);
+	if (!stable_hash) {
+		err = -ENOMEM;
 		goto out_free;
 	}
 
+	err = ksm_start_thread(0);
+	if (err)
+		goto out_free;
+
 #ifdef CONFIG_SYSFS
 	err = sysfs_create_group(mm_kobj, &ksm_attr_group);
 	if (err) {
 		printk(KERN_ERR "ksm: register sysfs failed\n");
-		kthread_stop(ksm_thread);
+		ksm_stop_thread(0);
 		goto out_free;
 	}
 #else
@@ -2018,7 +2379,7 @@ static int __init ksm_init(void)
 
 #ifdef CONFIG_MEMORY_HOTREMOVE
 	/*
-	 * Choose a high priority since the callback takes ksm_thread_mutex:
+	 * Choose a high priority since the callback takes ksm_thread_sem:
 	 * later callbacks could only be taking locks which nest within that.
 	 */
 	hotplug_memory_notifier(ksm_memory_callback, 100);
@@ -2026,6 +2387,7 @@ static int __init ksm_init(void)
 	return 0;
 
 out_free:
+	vfree(stable_hash);
 	ksm_slab_free();
 out:
 	return err;
@@ -23,7 +23,6 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/mm_inline.h>
-#include <linux/buffer_head.h>	/* for try_to_release_page() */
 #include <linux/percpu_counter.h>
 #include <linux/percpu.h>
 #include <linux/cpu.h>
@@ -37,7 +36,19 @@
 /* How many pages do we try to swap or page in/out together? */
 int page_cluster;
 
-static DEFINE_PER_CPU(struct pagevec[NR_LRU_LISTS], lru_add_pvecs);
+/*
+ * New LRU pages are queued per cpu and moved onto the zone lists in
+ * batches of this size, so that zone->lru_lock is taken once per batch
+ * (per zone) rather than once per pagevec.
+ */
+#define LRU_ADD_BATCH	(4 * PAGEVEC_SIZE)
+
+struct lru_add_cache {
+	unsigned int nr;
+	struct page *pages[LRU_ADD_BATCH];
+};
+
+static DEFINE_PER_CPU(struct lru_add_cache[NR_LRU_LISTS], lru_add_caches);
 static DEFINE_PER_CPU(struct pagevec, lru_rotate_pvecs);
 
 /*
@@ -295,14 +306,60 @@ void mark_page_accessed(struct page *page)
 
 EXPORT_SYMBOL(mark_page_accessed);
 
+/*
+ * Add the passed pages to the LRU, then drop the caller's refcount on
+ * them.  The pages are handled one zone at a time so that each
+ * zone->lru_lock is taken only once however the zones interleave.
+ */
+static void __lru_add_pages(struct page **pages, int nr, enum lru_list lru,
+			    int cold)
+{
+	DECLARE_BITMAP(added, LRU_ADD_BATCH);
+	int active = is_active_lru(lru);
+	int file = is_file_lru(lru);
+	int first, i;
+
+	VM_BUG_ON(is_unevictable_lru(lru));
+	VM_BUG_ON(nr > LRU_ADD_BATCH);
+
+	bitmap_zero(added, nr);
+	for (first = 0; first < nr;
+	     first = find_next_zero_bit(added, nr, first + 1)) {
+		struct zone *zone = page_zone(pages[first]);
+
+		spin_lock_irq(&zone->lru_lock);
+		for (i = first; i < nr; i++) {
+			struct page *page = pages[i];
+
+			if (test_bit(i, added) || page_zone(page) != zone)
+				continue;
+			__set_bit(i, added);
+
+			VM_BUG_ON(PageActive(page));
+			VM_BUG_ON(PageUnevictable(page));
+			VM_BUG_ON(PageLRU(page));
+			SetPageLRU(page);
+			if (active)
+				SetPageActive(page);
+			update_page_reclaim_stat(zone, page, file, active);
+			add_page_to_lru_list(zone, page, lru);
+		}
+		spin_unlock_irq(&zone->lru_lock);
+	}
+	release_pages(pages, nr, cold);
+}
+
 void __lru_cache_add(struct page *page, enum lru_list lru)
 {
-	struct pagevec *pvec = &get_cpu_var(lru_add_pvecs)[lru];
+	struct lru_add_cache *cache = &get_cpu_var(lru_add_caches)[lru];
 
 	page_cache_get(page);
-	if (!pagevec_add(pvec, page))
-		____pagevec_lru_add(pvec, lru);
-	put_cpu_var(lru_add_pvecs);
+	cache->pages[cache->nr++] = page;
+	if (cache->nr == LRU_ADD_BATCH) {
+		__lru_add_pages(cache->pages, cache->nr, lru, 0);
+		cache->nr = 0;
+	}
+	put_cpu_var(lru_add_caches);
 }
 EXPORT_SYMBOL(__lru_cache_add);
 
@@ -353,14 +410,17 @@ void add_page_to_unevictable_list(struct page *page)
  */
 static void drain_cpu_pagevecs(int cpu)
 {
-	struct pagevec *pvecs = per_cpu(lru_add_pvecs, cpu);
+	struct lru_add_cache *caches = per_cpu(lru_add_caches, cpu);
 	struct pagevec *pvec;
 	int lru;
 
 	for_each_lru(lru) {
-		pvec = &pvecs[lru - LRU_BASE];
-		if (pagevec_count(pvec))
-			____pagevec_lru_add(pvec, lru);
+		struct lru_add_cache *cache = &caches[lru - LRU_BASE];
+
+		if (cache->nr) {
+			__lru_add_pages(cache->pages, cache->nr, lru, 0);
+			cache->nr = 0;
+		}
 	}
 
 	pvec = &per_cpu(lru_rotate_pvecs, cpu);
@@ -522,60 +582,12 @@ void lru_add_page_tail(struct zone* zone,
  */
 void ____pagevec_lru_add(struct pagevec *pvec, enum lru_list lru)
 {
-	int i;
-	struct zone *zone = NULL;
-
-	VM_BUG_ON(is_unevictable_lru(lru));
-
-	for (i = 0; i < pagevec_count(pvec); i++) {
-		struct page *page = pvec->pages[i];
-		struct zone *pagezone = page_zone(page);
-		int file;
-		int active;
-
-		if (pagezone != zone) {
-			if (zone)
-				spin_unlock_irq(&zone->lru_lock);
-			zone = pagezone;
-			spin_lock_irq(&zone->lru_lock);
-		}
-		VM_BUG_ON(PageActive(page));
-		VM_BUG_ON(PageUnevictable(page));
-		VM_BUG_ON(PageLRU(page));
-		SetPageLRU(page);
-		active = is_active_lru(lru);
-		file = is_file_lru(lru);
-		if (active)
-			SetPageActive(page);
-		update_page_reclaim_stat(zone, page, file, active);
-		add_page_to_lru_list(zone, page, lru);
-	}
-	if (zone)
-		spin_unlock_irq(&zone->lru_lock);
-	release_pages(pvec->pages, pvec->nr, pvec->cold);
+	__lru_add_pages(pvec->pages, pagevec_count(pvec), lru, pvec->cold);
 	pagevec_reinit(pvec);
 }
 
 EXPORT_SYMBOL(____pagevec_lru_add);
 
-/*
- * Try to drop buffers from the pages in a pagevec
- */
-void pagevec_strip(struct pagevec *pvec)
-{
-	int i;
-
-	for (i = 0; i < pagevec_count(pvec); i++) {
-		struct page *page = pvec->pages[i];
-
-		if (page_has_private(page) && trylock_page(page)) {
-			if (page_has_private(page))
-				try_to_release_page(page, 0);
-			unlock_page(page);
-		}
-	}
-}
-
 /**
  * pagevec_lookup - gang pagecache lookup
  * @pvec:	Where the resulting pages are placed
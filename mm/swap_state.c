@@ -19,6 +19,7 @@
 #include <linux/pagevec.h>
 #include <linux/migrate.h>
 #include <linux/page_cgroup.h>
+#include <linux/blkdev.h>
 
 #include <asm/pgtable.h>
 
@@ -269,8 +270,11 @@ struct page * lookup_swap_cache(swp_entry_t entry)
 
 	page = find_get_page(&swapper_space, entry.val);
 
-	if (page)
+	if (page) {
 		INC_CACHE_INFO(find_success);
+		if (TestClearPageReadahead(page))
+			count_vm_event(SWAP_RA_HIT);
+	}
 
 	INC_CACHE_INFO(find_total);
 	return page;
@@ -320,6 +324,13 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
 		err = swapcache_prepare(entry);
 		if (err == -EEXIST) {	/* seems racy */
 			radix_tree_preload_end();
+			/*
+			 * A slot parked in a swap slot cache stays marked
+			 * SWAP_HAS_CACHE without a page: don't wait for one.
+			 */
+			if (swap_slot_unused(entry))
+				break;
+			cond_resched();
 			continue;
 		}
 		if (err) {		/* swp entry is obsolete ? */
@@ -401,3 +412,89 @@ struct page *swapin_readahead(swp_entry_t entry, gfp_t gfp_mask,
 	lru_add_drain();	/* Push any new pages onto the LRU now */
 	return read_swap_cache_async(entry, gfp_mask, vma, addr);
 }
+
+/* Read ahead around the faulting address rather than the swap offset */
+int swap_vma_readahead = 1;
+
+/* Upper bound on the readahead window, whatever page_cluster says */
+#define SWAP_RA_VMA_MAX		32
+
+/**
+ * swapin_vma_readahead - swap in pages of neighbouring virtual addresses
+ * @entry: swap entry of this memory
+ * @gfp_mask: memory allocation flags
+ * @vma: user vma this address belongs to
+ * @addr: faulting address
+ * @pmd: pmd mapping the page table of @addr
+ *
+ * Returns the struct page for entry and addr, after queueing swapin.
+ *
+ * Once swap gets fragmented, the pages next to each other in swap are
+ * rarely related; but the pages next to each other in a vma usually are.
+ * So read in the swap entries found in the ptes of an aligned block of
+ * (1 << page_cluster) addresses around @addr, limited to the vma and the
+ * page table, and submit them together with the target under one plug.
+ * Readahead pages are marked PageReadahead, and counted as swap_ra and,
+ * when they are faulted in later, swap_ra_hit in /proc/vmstat.
+ *
+ * Falls back to swapin_readahead() if swap_vma_readahead is disabled.
+ * Caller must hold down_read on the vma->vm_mm.
+ */
+struct page *swapin_vma_readahead(swp_entry_t entry, gfp_t gfp_mask,
+			struct vm_area_struct *vma, unsigned long addr,
+			pmd_t *pmd)
+{
+	swp_entry_t entries[SWAP_RA_VMA_MAX];
+	unsigned long addrs[SWAP_RA_VMA_MAX];
+	unsigned long start, end, ra_addr;
+	struct blk_plug plug;
+	struct page *page;
+	spinlock_t *ptl;
+	pte_t *pte, pteval;
+	int i, nr = 0, window;
+
+	if (!swap_vma_readahead)
+		return swapin_readahead(entry, gfp_mask, vma, addr);
+
+	window = min(1 << page_cluster, SWAP_RA_VMA_MAX);
+	start = addr & ~((unsigned long)(window << PAGE_SHIFT) - 1);
+	end = start + (window << PAGE_SHIFT);
+	start = max3(start, vma->vm_start, addr & PMD_MASK);
+	end = min3(end, vma->vm_end, (addr & PMD_MASK) + PMD_SIZE);
+
+	pte = pte_offset_map_lock(vma->vm_mm, pmd, start, &ptl);
+	for (ra_addr = start; ra_addr < end; ra_addr += PAGE_SIZE, pte++) {
+		pteval = *pte;
+		if (pte_none(pteval) || pte_present(pteval) || pte_file(pteval))
+			continue;
+		entries[nr] = pte_to_swp_entry(pteval);
+		if (non_swap_entry(entries[nr]) ||
+		    entries[nr].val == entry.val)
+			continue;
+		addrs[nr++] = ra_addr;
+	}
+	pte_unmap_unlock(pte - 1, ptl);
+
+	blk_start_plug(&plug);
+	for (i = 0; i < nr; i++) {
+		/* Already in swap cache: not ours to count */
+		page = find_get_page(&swapper_space, entries[i].val);
+		if (page) {
+			page_cache_release(page);
+			continue;
+		}
+
+		page = read_swap_cache_async(entries[i], gfp_mask,
+					     vma, addrs[i]);
+		if (!page)
+			continue;
+		SetPageReadahead(page);
+		count_vm_event(SWAP_RA);
+		page_cache_release(page);
+	}
+	lru_add_drain();	/* Push any new pages onto the LRU now */
+	page = read_swap_cache_async(entry, gfp_mask, vma, addr);
+	blk_finish_plug(&plug);
+
+	return page;
+}
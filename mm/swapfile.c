@@ -441,14 +441,69 @@ no_page:
 	return 0;
 }
 
-swp_entry_t get_swap_page(void)
+/*
+ * Per-cpu swap slot caches, to keep swap_lock out of most swap-outs.
+ *
+ * get_swap_page() takes slots from this cpu's alloc cache, which is
+ * refilled a batch at a time under one hold of swap_lock: scan_swap_map()
+ * allocates sequentially, so each cpu gets a run of neighbouring slots.
+ * Cached slots are marked SWAP_HAS_CACHE and counted as used.
+ *
+ * swapcache_free() of a slot with no other references left puts it on
+ * the free cache instead, and the whole batch is freed under one hold
+ * of swap_lock.  Nobody can take a new reference to such a slot, so it
+ * is safe to leave it marked SWAP_HAS_CACHE a little longer.
+ *
+ * swapoff disables the caches and drains them, so that try_to_unuse()
+ * doesn't wait on slots parked there.  Otherwise a reaper returns the
+ * free caches, and the alloc caches of cpus which have stopped swapping,
+ * about every second: so no slot stays parked for more than a few.
+ * Swap readahead skips parked slots, see swap_slot_unused().
+ */
+#define SWAP_SLOTS_CACHE_SIZE	64
+#define SWAP_SLOTS_CACHE_REAP	HZ
+
+struct swap_slots_cache {
+	struct mutex alloc_lock;	/* refill may sleep */
+	int cur, nr;			/* slots[cur] .. slots[nr - 1] */
+	bool alloc_used;		/* since the last reap */
+	swp_entry_t slots[SWAP_SLOTS_CACHE_SIZE];
+	spinlock_t free_lock;
+	int nr_free;
+	swp_entry_t slots_free[SWAP_SLOTS_CACHE_SIZE];
+};
+
+static DEFINE_PER_CPU(struct swap_slots_cache, swap_slots_cache);
+
+static void swap_slots_cache_reap(struct work_struct *work);
+static DECLARE_DELAYED_WORK(swap_slots_cache_work, swap_slots_cache_reap);
+
+/* Make sure the reaper comes round to the slots just cached */
+static inline void swap_slots_cache_arm(void)
+{
+	if (!delayed_work_pending(&swap_slots_cache_work))
+		schedule_delayed_work(&swap_slots_cache_work,
+			round_jiffies_relative(SWAP_SLOTS_CACHE_REAP));
+}
+
+/* Number of swapoffs in progress, the caches are bypassed while > 0 */
+static atomic_t swap_slots_cache_disabled = ATOMIC_INIT(0);
+
+static inline bool swap_slots_cache_active(void)
+{
+	/* Don't let the caches hide the last free slots from other cpus */
+	return !atomic_read(&swap_slots_cache_disabled) &&
+		nr_swap_pages > 2 * SWAP_SLOTS_CACHE_SIZE * num_online_cpus();
+}
+
+/* Called with swap_lock held */
+static swp_entry_t __get_swap_page(void)
 {
 	struct swap_info_struct *si;
 	pgoff_t offset;
 	int type, next;
 	int wrapped = 0;
 
-	spin_lock(&swap_lock);
 	if (nr_swap_pages <= 0)
 		goto noswap;
 	nr_swap_pages--;
@@ -470,19 +525,62 @@ swp_entry_t get_swap_page(void)
 		swap_list.next = next;
 		/* This is called for allocating swap entry for cache */
 		offset = scan_swap_map(si, SWAP_HAS_CACHE);
-		if (offset) {
-			spin_unlock(&swap_lock);
+		if (offset)
 			return swp_entry(type, offset);
-		}
 		next = swap_list.next;
 	}
 
 	nr_swap_pages++;
 noswap:
-	spin_unlock(&swap_lock);
 	return (swp_entry_t) {0};
 }
 
+/* Allocate up to @n swap cache slots into @entries, returns how many */
+static int get_swap_pages(int n, swp_entry_t *entries)
+{
+	int i;
+
+	spin_lock(&swap_lock);
+	for (i = 0; i < n; i++) {
+		entries[i] = __get_swap_page();
+		if (!entries[i].val)
+			break;
+	}
+	spin_unlock(&swap_lock);
+
+	return i;
+}
+
+swp_entry_t get_swap_page(void)
+{
+	struct swap_slots_cache *cache;
+	swp_entry_t entry;
+
+	/*
+	 * We may be migrated away from this cpu's cache, but that doesn't
+	 * matter: alloc_lock protects it, not preemption.
+	 */
+	cache = &per_cpu(swap_slots_cache, raw_smp_processor_id());
+	mutex_lock(&cache->alloc_lock);
+	if (cache->cur == cache->nr && swap_slots_cache_active()) {
+		cache->cur = 0;
+		cache->nr = get_swap_pages(SWAP_SLOTS_CACHE_SIZE,
+					   cache->slots);
+		if (cache->nr)
+			swap_slots_cache_arm();
+	}
+	if (cache->cur < cache->nr) {
+		entry = cache->slots[cache->cur++];
+		cache->alloc_used = true;
+		mutex_unlock(&cache->alloc_lock);
+		return entry;
+	}
+	mutex_unlock(&cache->alloc_lock);
+
+	get_swap_pages(1, &entry);
+	return entry;
+}
+
 /* The only caller of this function is now susupend routine */
 swp_entry_t get_swap_page_of_type(int type)
 {
@@ -612,6 +710,155 @@ void swap_free(swp_entry_t entry)
 	}
 }
 
+/* Free a batch of slots which only had SWAP_HAS_CACHE left */
+static void swapcache_free_entries(swp_entry_t *entries, int n)
+{
+	int i;
+
+	if (!n)
+		return;
+	spin_lock(&swap_lock);
+	for (i = 0; i < n; i++)
+		swap_entry_free(swap_info[swp_type(entries[i])], entries[i],
+				SWAP_HAS_CACHE);
+	spin_unlock(&swap_lock);
+}
+
+/*
+ * Park @entry in this cpu's free cache if nothing but the swap cache
+ * references it: returns false if it must be freed the slow way.
+ */
+static bool swapcache_free_cached(swp_entry_t entry)
+{
+	struct swap_slots_cache *cache;
+	struct swap_info_struct *p;
+	unsigned long type = swp_type(entry);
+	unsigned long offset = swp_offset(entry);
+	bool ret = false;
+
+	if (type >= nr_swapfiles)
+		return false;
+	p = swap_info[type];
+	if (!(p->flags & SWP_USED) || offset >= p->max ||
+	    p->swap_map[offset] != SWAP_HAS_CACHE)
+		return false;
+
+	cache = &get_cpu_var(swap_slots_cache);
+	spin_lock(&cache->free_lock);
+	/* Checked under free_lock, see drain_swap_slots_cache() */
+	if (!atomic_read(&swap_slots_cache_disabled)) {
+		cache->slots_free[cache->nr_free++] = entry;
+		if (cache->nr_free == SWAP_SLOTS_CACHE_SIZE) {
+			swapcache_free_entries(cache->slots_free,
+					       cache->nr_free);
+			cache->nr_free = 0;
+		} else
+			swap_slots_cache_arm();
+		ret = true;
+	}
+	spin_unlock(&cache->free_lock);
+	put_cpu_var(swap_slots_cache);
+
+	return ret;
+}
+
+/*
+ * Bypass the swap slot caches from now on, and return every slot in them.
+ * Called by swapoff before try_to_unuse().
+ */
+static void drain_swap_slots_cache(void)
+{
+	struct swap_slots_cache *cache;
+	int cpu;
+
+	atomic_inc(&swap_slots_cache_disabled);
+
+	for_each_possible_cpu(cpu) {
+		cache = &per_cpu(swap_slots_cache, cpu);
+
+		mutex_lock(&cache->alloc_lock);
+		swapcache_free_entries(cache->slots + cache->cur,
+				       cache->nr - cache->cur);
+		cache->cur = cache->nr = 0;
+		mutex_unlock(&cache->alloc_lock);
+
+		spin_lock(&cache->free_lock);
+		swapcache_free_entries(cache->slots_free, cache->nr_free);
+		cache->nr_free = 0;
+		spin_unlock(&cache->free_lock);
+	}
+}
+
+static void reenable_swap_slots_cache(void)
+{
+	atomic_dec(&swap_slots_cache_disabled);
+}
+
+/*
+ * Return the free caches, and the alloc caches which have not been used
+ * since the last time round; and come back while any slots are cached.
+ */
+static void swap_slots_cache_reap(struct work_struct *work)
+{
+	struct swap_slots_cache *cache;
+	bool cached = false;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		cache = &per_cpu(swap_slots_cache, cpu);
+
+		mutex_lock(&cache->alloc_lock);
+		if (!cache->alloc_used) {
+			swapcache_free_entries(cache->slots + cache->cur,
+					       cache->nr - cache->cur);
+			cache->cur = cache->nr = 0;
+		}
+		cache->alloc_used = false;
+		if (cache->cur < cache->nr)
+			cached = true;
+		mutex_unlock(&cache->alloc_lock);
+
+		spin_lock(&cache->free_lock);
+		swapcache_free_entries(cache->slots_free, cache->nr_free);
+		cache->nr_free = 0;
+		spin_unlock(&cache->free_lock);
+	}
+
+	if (cached)
+		swap_slots_cache_arm();
+}
+
+/*
+ * Whether the slot at @offset looks parked in a swap slot cache: marked
+ * SWAP_HAS_CACHE and nothing else, yet with no page in swap cache.  A slot
+ * on its way into or out of swap cache looks the same for a moment, so
+ * this is only good for deciding not to read a slot in.
+ */
+static bool swap_slot_parked(struct swap_info_struct *si, pgoff_t offset)
+{
+	struct page *page;
+
+	if (ACCESS_ONCE(si->swap_map[offset]) != SWAP_HAS_CACHE)
+		return false;
+	page = find_get_page(&swapper_space, swp_entry(si->type, offset).val);
+	if (page)
+		page_cache_release(page);
+	return !page;
+}
+
+/*
+ * Whether @entry is parked in a swap slot cache, so that no page will ever
+ * be added to swap cache for it: swap readahead must not wait for one then.
+ * But while swapoff has the caches disabled, try_to_unuse() needs to read
+ * every slot it finds in use: so say no then.
+ */
+int swap_slot_unused(swp_entry_t entry)
+{
+	if (atomic_read(&swap_slots_cache_disabled))
+		return 0;
+	return swap_slot_parked(swap_info[swp_type(entry)], swp_offset(entry));
+}
+
 /*
  * Called after dropping swapcache to decrease refcnt to swap entries.
  */
@@ -620,6 +867,12 @@ void swapcache_free(swp_entry_t entry, struct page *page)
 	struct swap_info_struct *p;
 	unsigned char count;
 
+	if (swapcache_free_cached(entry)) {
+		if (page)
+			mem_cgroup_uncharge_swapcache(page, entry, 0);
+		return;
+	}
+
 	p = swap_info_get(entry);
 	if (p) {
 		count = swap_entry_free(p, entry, SWAP_HAS_CACHE);
@@ -1616,11 +1869,15 @@ SYSCALL_DEFINE1(swapoff, const char __user *, specialfile)
 	p->flags &= ~SWP_WRITEOK;
 	spin_unlock(&swap_lock);
 
+	drain_swap_slots_cache();
+
 	current->flags |= PF_OOM_ORIGIN;
 	err = try_to_unuse(type);
 	current->flags &= ~PF_OOM_ORIGIN;
 
 	if (err) {
+		reenable_swap_slots_cache();
+
 		/* re-insert swap space back into swap_list */
 		spin_lock(&swap_lock);
 		if (p->prio < 0)
@@ -1643,6 +1900,8 @@ SYSCALL_DEFINE1(swapoff, const char __user *, specialfile)
 		goto out_dput;
 	}
 
+	reenable_swap_slots_cache();
+
 	/* wait for any unplug function to finish */
 	down_write(&swap_unplug_sem);
 	up_write(&swap_unplug_sem);
@@ -1835,6 +2094,20 @@ static int __init procswaps_init(void)
 __initcall(procswaps_init);
 #endif /* CONFIG_PROC_FS */
 
+static int __init swap_slots_cache_init(void)
+{
+	struct swap_slots_cache *cache;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		cache = &per_cpu(swap_slots_cache, cpu);
+		mutex_init(&cache->alloc_lock);
+		spin_lock_init(&cache->free_lock);
+	}
+	return 0;
+}
+__initcall(swap_slots_cache_init);
+
 #ifdef MAX_SWAPFILES_CHECK
 static int __init max_swapfiles_check(void)
 {
@@ -2326,16 +2599,16 @@ int valid_swaphandles(swp_entry_t entry, unsigned long *offset)
 
 	/* Count contiguous allocated slots above our target */
 	for (toff = target; ++toff < end; nr_pages++) {
-		/* Don't read in free or bad pages */
-		if (!si->swap_map[toff])
+		/* Don't read in free, parked or bad pages */
+		if (!si->swap_map[toff] || swap_slot_parked(si, toff))
 			break;
 		if (swap_count(si->swap_map[toff]) == SWAP_MAP_BAD)
 			break;
 	}
 	/* Count contiguous allocated slots below our target */
 	for (toff = target; --toff >= base; nr_pages++) {
-		/* Don't read in free or bad pages */
-		if (!si->swap_map[toff])
+		/* Don't read in free, parked or bad pages */
+		if (!si->swap_map[toff] || swap_slot_parked(si, toff))
 			break;
 		if (swap_count(si->swap_map[toff]) == SWAP_MAP_BAD)
 			break;
@@ -1246,6 +1246,28 @@ static int too_many_isolated(struct zone *zone, int file,
 	return isolated > inactive;
 }
 
+/*
+ * Drop the isolation reference on a page that has just been put back on
+ * its LRU list.  Called with lru_lock held.  If that was the last
+ * reference the page is taken off the LRU again and queued on
+ * @pages_to_free, to be freed after the lock is dropped.
+ */
+static void lru_release_page(struct zone *zone, struct page *page,
+			     struct list_head *pages_to_free)
+{
+	if (!put_page_testzero(page))
+		return;
+
+	__ClearPageLRU(page);
+	del_page_from_lru(zone, page);
+	if (unlikely(PageCompound(page))) {
+		spin_unlock_irq(&zone->lru_lock);
+		(*get_compound_page_dtor(page))(page);
+		spin_lock_irq(&zone->lru_lock);
+	} else
+		list_add(&page->lru, pages_to_free);
+}
+
 /*
  * TODO: Try merging with migrations version of putback_lru_pages
  */
@@ -1255,13 +1277,14 @@ putback_lru_pages(struct zone *zone, struct scan_control *sc,
 				struct list_head *page_list)
 {
 	struct page *page;
-	struct pagevec pvec;
+	LIST_HEAD(pages_to_free);
+	LIST_HEAD(unevictable);
 	struct zone_reclaim_stat *reclaim_stat = get_reclaim_stat(zone, sc);
 
-	pagevec_init(&pvec, 1);
-
 	/*
-	 * Put back any unfreeable pages.
+	 * Put back any unfreeable pages.  Everything that needs the lock
+	 * dropped is deferred, so that the whole list goes back under a
+	 * single hold of lru_lock.
 	 */
 	spin_lock(&zone->lru_lock);
 	while (!list_empty(page_list)) {
@@ -1270,9 +1293,7 @@ putback_lru_pages(struct zone *zone, struct scan_control *sc,
 		VM_BUG_ON(PageLRU(page));
 		list_del(&page->lru);
 		if (unlikely(!page_evictable(page, NULL))) {
-			spin_unlock_irq(&zone->lru_lock);
-			putback_lru_page(page);
-			spin_lock_irq(&zone->lru_lock);
+			list_add(&page->lru, &unevictable);
 			continue;
 		}
 		SetPageLRU(page);
@@ -1283,17 +1304,19 @@ putback_lru_pages(struct zone *zone, struct scan_control *sc,
 			int numpages = hpage_nr_pages(page);
 			reclaim_stat->recent_rotated[file] += numpages;
 		}
-		if (!pagevec_add(&pvec, page)) {
-			spin_unlock_irq(&zone->lru_lock);
-			__pagevec_release(&pvec);
-			spin_lock_irq(&zone->lru_lock);
-		}
+		lru_release_page(zone, page, &pages_to_free);
 	}
 	__mod_zone_page_state(zone, NR_ISOLATED_ANON, -nr_anon);
 	__mod_zone_page_state(zone, NR_ISOLATED_FILE, -nr_file);
 
 	spin_unlock_irq(&zone->lru_lock);
-	pagevec_release(&pvec);
+
+	while (!list_empty(&unevictable)) {
+		page = lru_to_page(&unevictable);
+		list_del(&page->lru);
+		putback_lru_page(page);
+	}
+	free_page_list(&pages_to_free);
 }
 
 static noinline_for_stack void update_isolated_counts(struct zone *zone,
@@ -1473,14 +1496,12 @@ shrink_inactive_list(unsigned long nr_to_scan, struct zone *zone,
 
 static void move_active_pages_to_lru(struct zone *zone,
 				     struct list_head *list,
+				     struct list_head *pages_to_free,
 				     enum lru_list lru)
 {
 	unsigned long pgmoved = 0;
-	struct pagevec pvec;
 	struct page *page;
 
-	pagevec_init(&pvec, 1);
-
 	while (!list_empty(list)) {
 		page = lru_to_page(list);
 
@@ -1491,13 +1512,7 @@ static void move_active_pages_to_lru(struct zone *zone,
 		mem_cgroup_add_lru_list(page, lru);
 		pgmoved += hpage_nr_pages(page);
 
-		if (!pagevec_add(&pvec, page) || list_empty(list)) {
-			spin_unlock_irq(&zone->lru_lock);
-			if (buffer_heads_over_limit)
-				pagevec_strip(&pvec);
-			__pagevec_release(&pvec);
-			spin_lock_irq(&zone->lru_lock);
-		}
+		lru_release_page(zone, page, pages_to_free);
 	}
 	__mod_zone_page_state(zone, NR_LRU_BASE + lru, pgmoved);
 	if (!is_active_lru(lru))
@@ -1513,6 +1528,7 @@ static void shrink_active_list(unsigned long nr_pages, struct zone *zone,
 	LIST_HEAD(l_hold);	/* The pages which were snipped off */
 	LIST_HEAD(l_active);
 	LIST_HEAD(l_inactive);
+	LIST_HEAD(l_free);	/* Pages whose last reference we dropped */
 	struct page *page;
 	struct zone_reclaim_stat *reclaim_stat = get_reclaim_stat(zone, sc);
 	unsigned long nr_rotated = 0;
@@ -1556,6 +1572,19 @@ static void shrink_active_list(unsigned long nr_pages, struct zone *zone,
 			continue;
 		}
 
+		/*
+		 * Strip buffers here rather than when the pages go back,
+		 * since that needs the page lock and we want to move the
+		 * whole batch under one hold of lru_lock.
+		 */
+		if (unlikely(buffer_heads_over_limit)) {
+			if (page_has_private(page) && trylock_page(page)) {
+				if (page_has_private(page))
+					try_to_release_page(page, 0);
+				unlock_page(page);
+			}
+		}
+
 		if (page_referenced(page, 0, sc->mem_cgroup, &vm_flags)) {
 			nr_rotated += hpage_nr_pages(page);
 			/*
@@ -1589,12 +1618,14 @@ static void shrink_active_list(unsigned long nr_pages, struct zone *zone,
 	 */
 	reclaim_stat->recent_rotated[file] += nr_rotated;
 
-	move_active_pages_to_lru(zone, &l_active,
+	move_active_pages_to_lru(zone, &l_active, &l_free,
 						LRU_ACTIVE + file * LRU_FILE);
-	move_active_pages_to_lru(zone, &l_inactive,
+	move_active_pages_to_lru(zone, &l_inactive, &l_free,
 						LRU_BASE   + file * LRU_FILE);
 	__mod_zone_page_state(zone, NR_ISOLATED_ANON + file, -nr_taken);
 	spin_unlock_irq(&zone->lru_lock);
+
+	free_page_list(&l_free);
 }
 
 #ifdef CONFIG_SWAP
@@ -889,6 +889,8 @@ static const char * const vmstat_text[] = {
 	"pgpgout",
 	"pswpin",
 	"pswpout",
+	"swap_ra",
+	"swap_ra_hit",
 
 	TEXTS_FOR_ZONES("pgalloc")
 
@@ -0,0 +1,263 @@
+/*
+ * mem-reclaim.c
+ *
+ * reclaim: Parallel page cache streaming, to stress page reclaim
+ *
+ * Each worker process reads its own sparse file from start to end, pass
+ * after pass.  Holes read as zeroes without any disk I/O, so with more
+ * file data in the workers than there is free memory the run is bound by
+ * reclaim, done on every cpu at once.  Reclaim throughput comes from
+ * /proc/vmstat and, with CONFIG_LOCK_STAT, zone->lru_lock hold times
+ * from /proc/lock_stat.
+ */
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define READ_CHUNK	(1024 * 1024)
+
+static const char	*size_str	= "1GB";
+static const char	*dir		= ".";
+static int		nr_workers;
+static int		loops		= 2;
+
+static const struct option options[] = {
+	OPT_STRING('s', "size", &size_str, "1GB",
+		    "Specify size of the file read by each worker. "
+		    "available unit: B, MB, GB (upper and lower)"),
+	OPT_STRING('d', "dir", &dir, "dir",
+		    "Specify directory for the files, not on tmpfs"),
+	OPT_INTEGER('w', "workers", &nr_workers,
+		    "Specify number of worker processes (default: nr cpus)"),
+	OPT_INTEGER('l', "loop", &loops,
+		    "Specify number of passes over each file"),
+	OPT_END()
+};
+
+static const char * const bench_mem_reclaim_usage[] = {
+	"perf bench mem reclaim <options>",
+	NULL
+};
+
+struct reclaim_events {
+	u64	steal;
+	u64	scan;
+};
+
+/* Sum the per-zone pgsteal and pgscan counters from /proc/vmstat */
+static void read_reclaim_events(struct reclaim_events *ev)
+{
+	char name[64];
+	unsigned long long val;
+	FILE *fp;
+
+	ev->steal = ev->scan = 0;
+	fp = fopen("/proc/vmstat", "r");
+	if (!fp)
+		return;
+	while (fscanf(fp, "%63s %llu", name, &val) == 2) {
+		if (!strncmp(name, "pgsteal_", 8))
+			ev->steal += val;
+		else if (!strncmp(name, "pgscan_", 7))
+			ev->scan += val;
+	}
+	fclose(fp);
+}
+
+struct lru_lock_stat {
+	u64	contentions;
+	u64	acquisitions;
+	double	wait_total;	/* usecs */
+	double	hold_max;	/* usecs */
+	double	hold_total;	/* usecs */
+};
+
+/*
+ * Clear the lock statistics; only root may, and only with
+ * CONFIG_LOCK_STAT.  Returns 0 when they will be meaningful.
+ */
+static int reset_lock_stat(void)
+{
+	int fd, ret = -1;
+
+	fd = open("/proc/lock_stat", O_WRONLY);
+	if (fd < 0)
+		return -1;
+	if (write(fd, "0", 1) == 1)
+		ret = 0;
+	close(fd);
+	return ret;
+}
+
+/*
+ * Add up the zone->lru_lock rows of /proc/lock_stat.  The fields after
+ * the class name are con-bounces, contentions, waittime-min, -max and
+ * -total, acq-bounces, acquisitions, holdtime-min, -max and -total.
+ */
+static int read_lock_stat(struct lru_lock_stat *st)
+{
+	char line[512], *p;
+	unsigned long con_bounces, contentions, acq_bounces, acquisitions;
+	double wait_min, wait_max, wait_total;
+	double hold_min, hold_max, hold_total;
+	FILE *fp;
+
+	memset(st, 0, sizeof(*st));
+	fp = fopen("/proc/lock_stat", "r");
+	if (!fp)
+		return -1;
+	while (fgets(line, sizeof(line), fp)) {
+		p = strchr(line, ':');
+		if (!p || !strstr(line, "lru_lock") || strstr(line, "[<"))
+			continue;
+		if (sscanf(p + 1, "%lu %lu %lf %lf %lf %lu %lu %lf %lf %lf",
+			   &con_bounces, &contentions,
+			   &wait_min, &wait_max, &wait_total,
+			   &acq_bounces, &acquisitions,
+			   &hold_min, &hold_max, &hold_total) != 10)
+			continue;
+		st->contentions += contentions;
+		st->acquisitions += acquisitions;
+		st->wait_total += wait_total;
+		st->hold_total += hold_total;
+		if (hold_max > st->hold_max)
+			st->hold_max = hold_max;
+	}
+	fclose(fp);
+	return 0;
+}
+
+static void worker(int nr, size_t len)
+{
+	char path[PATH_MAX], *buf;
+	size_t off;
+	ssize_t ret;
+	int fd, i;
+
+	snprintf(path, sizeof(path), "%s/perf-bench-reclaim.%d.%d",
+		 dir, getppid(), nr);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		die("cannot create %s\n", path);
+	unlink(path);
+	if (ftruncate(fd, len))
+		die("cannot extend %s to %zu bytes\n", path, len);
+
+	buf = malloc(READ_CHUNK);
+	if (!buf)
+		die("malloc failed\n");
+
+	for (i = 0; i < loops; i++) {
+		for (off = 0; off < len; off += ret) {
+			ret = pread(fd, buf, READ_CHUNK, off);
+			if (ret <= 0)
+				die("read of %s failed\n", path);
+		}
+	}
+
+	free(buf);
+	close(fd);
+	exit(0);
+}
+
+int bench_mem_reclaim(int argc, const char **argv,
+		      const char *prefix __used)
+{
+	struct timeval start, stop, diff;
+	struct reclaim_events ev[2];
+	struct lru_lock_stat ls;
+	int have_lock_stat;
+	size_t len;
+	double secs;
+	u64 steal;
+	int i, status;
+	pid_t pid;
+
+	argc = parse_options(argc, argv, options,
+			     bench_mem_reclaim_usage, 0);
+
+	len = (size_t)perf_atoll((char *)size_str);
+	if ((s64)len <= 0) {
+		fprintf(stderr, "Invalid size:%s\n", size_str);
+		return 1;
+	}
+	if (nr_workers <= 0)
+		nr_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (loops <= 0) {
+		fprintf(stderr, "Invalid number of loops:%d\n", loops);
+		return 1;
+	}
+
+	have_lock_stat = !reset_lock_stat();
+	read_reclaim_events(&ev[0]);
+	BUG_ON(gettimeofday(&start, NULL));
+
+	for (i = 0; i < nr_workers; i++) {
+		pid = fork();
+		BUG_ON(pid < 0);
+		if (!pid)
+			worker(i, len);
+	}
+	for (i = 0; i < nr_workers; i++) {
+		BUG_ON(wait(&status) < 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			die("worker failed\n");
+	}
+
+	BUG_ON(gettimeofday(&stop, NULL));
+	read_reclaim_events(&ev[1]);
+	if (have_lock_stat && read_lock_stat(&ls))
+		have_lock_stat = 0;
+	timersub(&stop, &start, &diff);
+
+	secs = (double)diff.tv_sec + (double)diff.tv_usec / 1000000;
+	steal = ev[1].steal - ev[0].steal;
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf("# %d workers reading %s each, %d passes\n\n",
+		       nr_workers, size_str, loops);
+		printf(" %14s: %lu.%03lu [sec]\n\n", "Total time",
+		       diff.tv_sec, (unsigned long)(diff.tv_usec / 1000));
+		printf(" %14lf pages reclaimed/sec\n", steal / secs);
+		printf(" %14llu pages reclaimed\n", (unsigned long long)steal);
+		printf(" %14llu pages scanned\n",
+		       (unsigned long long)(ev[1].scan - ev[0].scan));
+		if (!have_lock_stat) {
+			printf("\n # no zone->lru_lock statistics, "
+			       "they need CONFIG_LOCK_STAT and root\n");
+			break;
+		}
+		printf("\n %14llu lru_lock acquisitions\n",
+		       (unsigned long long)ls.acquisitions);
+		printf(" %14llu lru_lock contentions\n",
+		       (unsigned long long)ls.contentions);
+		printf(" %14.2lf usecs average lru_lock hold\n",
+		       ls.acquisitions ? ls.hold_total / ls.acquisitions : 0);
+		printf(" %14.2lf usecs longest lru_lock hold\n", ls.hold_max);
+		printf(" %14.2lf usecs waiting for lru_lock in total\n",
+		       ls.wait_total);
+		break;
+
+	case BENCH_FORMAT_SIMPLE:
+		printf("%lf\n", steal / secs);
+		break;
+
+	default:
+		/* reaching here is something disaster */
+		fprintf(stderr, "Unknown format:%d\n", bench_format);
+		exit(1);
+		break;
+	}
+
+	return 0;
+}
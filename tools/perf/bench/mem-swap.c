@@ -0,0 +1,156 @@
+/*
+ * mem-swap.c
+ *
+ * swap: Parallel anonymous memory touching, to stress swap
+ *
+ * Each worker process writes to every page of its own anonymous area,
+ * pass after pass.  With more memory in the workers than is available
+ * (in a memory cgroup, say), every pass swaps out and swaps back in.
+ */
+#include "../perf.h"
+#include "../util/util.h"
+#include "../util/parse-options.h"
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+static const char	*size_str	= "256MB";
+static int		nr_workers;
+static int		loops		= 4;
+
+static const struct option options[] = {
+	OPT_STRING('s', "size", &size_str, "256MB",
+		    "Specify size of memory touched by each worker. "
+		    "available unit: B, MB, GB (upper and lower)"),
+	OPT_INTEGER('w', "workers", &nr_workers,
+		    "Specify number of worker processes (default: nr cpus)"),
+	OPT_INTEGER('l', "loop", &loops,
+		    "Specify number of passes over the memory"),
+	OPT_END()
+};
+
+static const char * const bench_mem_swap_usage[] = {
+	"perf bench mem swap <options>",
+	NULL
+};
+
+/* Read pswpin and pswpout from /proc/vmstat, zero if not found */
+static void read_swap_events(u64 *pswpin, u64 *pswpout)
+{
+	char name[64];
+	unsigned long long val;
+	FILE *fp;
+
+	*pswpin = *pswpout = 0;
+	fp = fopen("/proc/vmstat", "r");
+	if (!fp)
+		return;
+	while (fscanf(fp, "%63s %llu", name, &val) == 2) {
+		if (!strcmp(name, "pswpin"))
+			*pswpin = val;
+		else if (!strcmp(name, "pswpout"))
+			*pswpout = val;
+	}
+	fclose(fp);
+}
+
+static void worker(size_t len, size_t page_size)
+{
+	char *area;
+	size_t off;
+	int i;
+
+	area = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (area == MAP_FAILED)
+		die("mmap of %zu bytes failed\n", len);
+
+	for (i = 0; i < loops; i++)
+		for (off = 0; off < len; off += page_size)
+			area[off] = i + 1;
+
+	munmap(area, len);
+	exit(0);
+}
+
+int bench_mem_swap(int argc, const char **argv,
+		   const char *prefix __used)
+{
+	struct timeval start, stop, diff;
+	u64 swapin[2], swapout[2];
+	size_t len, page_size;
+	double secs, pages;
+	int i, status;
+	pid_t pid;
+
+	argc = parse_options(argc, argv, options,
+			     bench_mem_swap_usage, 0);
+
+	len = (size_t)perf_atoll((char *)size_str);
+	if ((s64)len <= 0) {
+		fprintf(stderr, "Invalid size:%s\n", size_str);
+		return 1;
+	}
+	if (nr_workers <= 0)
+		nr_workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (loops <= 0) {
+		fprintf(stderr, "Invalid number of loops:%d\n", loops);
+		return 1;
+	}
+	page_size = sysconf(_SC_PAGESIZE);
+
+	read_swap_events(&swapin[0], &swapout[0]);
+	BUG_ON(gettimeofday(&start, NULL));
+
+	for (i = 0; i < nr_workers; i++) {
+		pid = fork();
+		BUG_ON(pid < 0);
+		if (!pid)
+			worker(len, page_size);
+	}
+	for (i = 0; i < nr_workers; i++) {
+		BUG_ON(wait(&status) < 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			die("worker failed\n");
+	}
+
+	BUG_ON(gettimeofday(&stop, NULL));
+	read_swap_events(&swapin[1], &swapout[1]);
+	timersub(&stop, &start, &diff);
+
+	secs = (double)diff.tv_sec + (double)diff.tv_usec / 1000000;
+	pages = (double)nr_workers * loops * (len / page_size);
+
+	switch (bench_format) {
+	case BENCH_FORMAT_DEFAULT:
+		printf("# %d workers touching %s each, %d passes\n\n",
+		       nr_workers, size_str, loops);
+		printf(" %14s: %lu.%03lu [sec]\n\n", "Total time",
+		       diff.tv_sec, (unsigned long)(diff.tv_usec / 1000));
+		printf(" %14lf pages/sec\n", pages / secs);
+		printf(" %14llu pages swapped out\n",
+		       (unsigned long long)(swapout[1] - swapout[0]));
+		printf(" %14llu pages swapped in\n",
+		       (unsigned long long)(swapin[1] - swapin[0]));
+		break;
+
+	case BENCH_FORMAT_SIMPLE:
+		printf("%lu.%03lu\n", diff.tv_sec,
+		       (unsigned long)(diff.tv_usec / 1000));
+		break;
+
+	default:
+		/* reaching here is something disaster */
+		fprintf(stderr, "Unknown format:%d\n", bench_format);
+		exit(1);
+		break;
+	}
+
+	return 0;
+}
@@ -52,6 +52,12 @@ static struct bench_suite mem_suites[] = {
 	{ "memcpy",
 	  "Simple memory copy in various ways",
 	  bench_mem_memcpy },
+	{ "swap",
+	  "Parallel anonymous memory touching, to stress swap",
+	  bench_mem_swap },
+	{ "reclaim",
+	  "Parallel page cache streaming, to stress page reclaim",
+	  bench_mem_reclaim },
 	suite_all,
 	{ NULL,
 	  NULL,
@@ -0,0 +1,93 @@
+#!/bin/sh
+#
+# raid5-write-bw.sh - raid5 write bandwidth against group_thread_cnt
+#
+# Builds a raid5 array out of loop devices backed by files in tmpfs, so
+# that parity computation rather than the disks is the bottleneck, then
+# writes the whole array with parallel O_DIRECT writers once for every
+# worker count in THREADS and prints the bandwidth of each run.  The
+# backing files take DISKS * SIZE_MB of memory.
+#
+# Needs root, mdadm, losetup and dd on the machine under test; it is
+# meant to be copied there and run as ktest's TEST, for example
+#
+#   TEST = ssh root@target /root/raid5-write-bw.sh
+#
+# Tunables, from the environment:
+#   DISKS    number of member devices (default 4)
+#   SIZE_MB  size of each member in MB (default 512)
+#   JOBS     number of parallel writers (default: number of cpus)
+#   THREADS  group_thread_cnt values to measure (default "0 1 2 4 8")
+#   SHM      tmpfs directory for the backing files (default /dev/shm)
+#   MD       md device to create (default /dev/md127)
+#   SYSFS    md sysfs directory (default /sys/block/<MD>/md)
+
+DISKS=${DISKS:-4}
+SIZE_MB=${SIZE_MB:-512}
+JOBS=${JOBS:-$(grep -c ^processor /proc/cpuinfo)}
+THREADS=${THREADS:-"0 1 2 4 8"}
+SHM=${SHM:-/dev/shm}
+MD=${MD:-/dev/md127}
+
+LOOPS=""
+
+cleanup() {
+	mdadm --stop "$MD" >/dev/null 2>&1
+	for loop in $LOOPS; do
+		losetup -d "$loop"
+	done
+	rm -f "$SHM"/raid5-bw.*
+}
+
+fail() {
+	echo "raid5-write-bw: $*" >&2
+	cleanup
+	exit 1
+}
+
+trap 'cleanup; exit 1' INT TERM
+
+for i in $(seq 1 "$DISKS"); do
+	dd if=/dev/zero of="$SHM/raid5-bw.$i" bs=1M count=0 seek="$SIZE_MB" \
+		2>/dev/null || fail "cannot create $SHM/raid5-bw.$i"
+	loop=$(losetup -f --show "$SHM/raid5-bw.$i") ||
+		fail "cannot set up a loop device"
+	LOOPS="$LOOPS $loop"
+done
+
+# The array is written whole, so there is no need to resync it first
+mdadm --create "$MD" --run --assume-clean --level=5 \
+	--raid-devices="$DISKS" $LOOPS >/dev/null 2>&1 ||
+	fail "cannot create $MD"
+
+SYSFS=${SYSFS:-/sys/block/$(basename "$MD")/md}
+[ -w "$SYSFS/group_thread_cnt" ] || fail "$SYSFS/group_thread_cnt missing"
+
+# Each writer gets its own slice of the array, in whole MB
+ARRAY_MB=$(( $(blockdev --getsize64 "$MD") / 1048576 ))
+SLICE_MB=$(( ARRAY_MB / JOBS ))
+[ "$SLICE_MB" -gt 0 ] || fail "array too small for $JOBS writers"
+
+echo "# $DISKS x ${SIZE_MB}MB raid5, $JOBS writers of ${SLICE_MB}MB"
+echo "# group_thread_cnt  MB/s"
+
+for cnt in $THREADS; do
+	echo "$cnt" > "$SYSFS/group_thread_cnt" ||
+		fail "cannot set group_thread_cnt to $cnt"
+
+	start=$(date +%s.%N)
+	for job in $(seq 0 $(( JOBS - 1 ))); do
+		( dd if=/dev/zero of="$MD" bs=1M count="$SLICE_MB" \
+			seek=$(( job * SLICE_MB )) oflag=direct \
+			2>/dev/null || touch "$SHM/raid5-bw.failed" ) &
+	done
+	wait
+	end=$(date +%s.%N)
+	[ -e "$SHM/raid5-bw.failed" ] && fail "write to $MD failed"
+
+	echo "$cnt $start $end" | awk -v mb=$(( JOBS * SLICE_MB )) \
+		'{ printf "%18d  %.1f\n", $1, mb / ($3 - $2) }'
+done
+
+cleanup
+exit 0
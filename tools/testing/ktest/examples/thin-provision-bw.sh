@@ -0,0 +1,117 @@
+#!/bin/sh
+#
+# thin-provision-bw.sh - dm-thin provisioning bandwidth against writers
+#
+# Builds a thin pool out of loop devices backed by files in tmpfs, then
+# for every writer count in JOBS_LIST creates a fresh thin volume and
+# fills it with that many parallel O_DIRECT writers, each on its own
+# slice.  Every write to a block that is not provisioned yet goes
+# through bio_detain(), and the writes that arrive while the block is
+# being provisioned are detained in the same cell, so this measures the
+# bio prison under load from many cpus.  With CONFIG_LOCK_STAT the
+# contention on the prison locks is printed after each run.
+#
+# Needs root, dmsetup, losetup and dd on the machine under test; it is
+# meant to be copied there and run as ktest's TEST, for example
+#
+#   TEST = ssh root@target /root/thin-provision-bw.sh
+#
+# Tunables, from the environment:
+#   DATA_MB     size of the data device in MB (default 1024)
+#   BLOCK       data block size in sectors (default 128)
+#   BS_KB       size of each write in KB (default 4)
+#   JOBS_LIST   writer counts to measure (default "1 2 4 ... nr cpus")
+#   SHM         tmpfs directory for the backing files (default /dev/shm)
+
+DATA_MB=${DATA_MB:-1024}
+BLOCK=${BLOCK:-128}
+BS_KB=${BS_KB:-4}
+SHM=${SHM:-/dev/shm}
+POOL=thin-bw-pool
+THIN=thin-bw
+
+if [ -z "$JOBS_LIST" ]; then
+	ncpus=$(grep -c ^processor /proc/cpuinfo)
+	n=1
+	while [ "$n" -lt "$ncpus" ]; do
+		JOBS_LIST="$JOBS_LIST $n"
+		n=$(( n * 2 ))
+	done
+	JOBS_LIST="$JOBS_LIST $ncpus"
+fi
+
+META_LOOP=""
+DATA_LOOP=""
+
+cleanup() {
+	dmsetup remove "$THIN" >/dev/null 2>&1
+	dmsetup remove "$POOL" >/dev/null 2>&1
+	for loop in $META_LOOP $DATA_LOOP; do
+		losetup -d "$loop"
+	done
+	rm -f "$SHM"/thin-bw.*
+}
+
+fail() {
+	echo "thin-provision-bw: $*" >&2
+	cleanup
+	exit 1
+}
+
+trap 'cleanup; exit 1' INT TERM
+
+dd if=/dev/zero of="$SHM/thin-bw.meta" bs=1M count=64 2>/dev/null ||
+	fail "cannot create $SHM/thin-bw.meta"
+dd if=/dev/zero of="$SHM/thin-bw.data" bs=1M count=0 seek="$DATA_MB" \
+	2>/dev/null || fail "cannot create $SHM/thin-bw.data"
+META_LOOP=$(losetup -f --show "$SHM/thin-bw.meta") ||
+	fail "cannot set up a loop device"
+DATA_LOOP=$(losetup -f --show "$SHM/thin-bw.data") ||
+	fail "cannot set up a loop device"
+
+SECTORS=$(( DATA_MB * 2048 ))
+
+dmsetup create "$POOL" --table "0 $SECTORS thin-pool $META_LOOP \
+	$DATA_LOOP $BLOCK $BLOCK" || fail "cannot create $POOL"
+
+echo "# ${DATA_MB}MB thin volume, ${BLOCK} sector blocks, ${BS_KB}k writes"
+echo "# writers  MB/s"
+
+id=0
+for jobs in $JOBS_LIST; do
+	dmsetup message "$POOL" 0 "create_thin $id" ||
+		fail "cannot create thin volume $id"
+	dmsetup create "$THIN" --table "0 $SECTORS thin /dev/mapper/$POOL $id" ||
+		fail "cannot activate thin volume $id"
+
+	[ -e /proc/lock_stat ] && echo 0 > /proc/lock_stat
+
+	# Each writer gets its own slice of the volume, in whole MB
+	slice=$(( DATA_MB / jobs ))
+	[ "$slice" -gt 0 ] || fail "volume too small for $jobs writers"
+
+	start=$(date +%s.%N)
+	for job in $(seq 0 $(( jobs - 1 ))); do
+		( dd if=/dev/zero of="/dev/mapper/$THIN" bs="${BS_KB}k" \
+			count=$(( slice * 1024 / BS_KB )) \
+			seek=$(( job * slice * 1024 / BS_KB )) \
+			oflag=direct 2>/dev/null ||
+			touch "$SHM/thin-bw.failed" ) &
+	done
+	wait
+	end=$(date +%s.%N)
+	[ -e "$SHM/thin-bw.failed" ] && fail "write to $THIN failed"
+
+	echo "$jobs $start $end" | awk -v mb=$(( jobs * slice )) \
+		'{ printf "%9d  %.1f\n", $1, mb / ($3 - $2) }'
+
+	[ -e /proc/lock_stat ] && grep -A1 "prison\|bucket" /proc/lock_stat
+
+	dmsetup remove "$THIN" || fail "cannot remove $THIN"
+	dmsetup message "$POOL" 0 "delete $id" ||
+		fail "cannot delete thin volume $id"
+	id=$(( id + 1 ))
+done
+
+cleanup
+exit 0
@@ -0,0 +1,99 @@
+#!/bin/sh
+#
+# zram-swap-bw.sh - swap-out bandwidth to zram against the number of cpus
+#
+# Sets up /dev/zram0 as the only swap device, then for every count in
+# CPUS_LIST runs that many workers of "perf bench mem swap", with
+# max_comp_streams set to the same count, inside a memory cgroup that
+# holds LIMIT_MB.  Every worker touches SIZE_MB of anonymous memory, so
+# nearly all of it has to go out to zram.  Prints the swap-out
+# bandwidth of each run, from pswpout in /proc/vmstat.
+#
+# Needs root, mkswap, swapon, the memory cgroup controller and a perf
+# built from this tree on the machine under test; it is meant to be
+# copied there and run as ktest's TEST, for example
+#
+#   TEST = ssh root@target /root/zram-swap-bw.sh
+#
+# Tunables, from the environment:
+#   ZRAM_MB    size of the zram device in MB (default 4096)
+#   SIZE_MB    memory touched by each worker in MB (default 256)
+#   LIMIT_MB   memory cgroup limit in MB (default 128)
+#   CPUS_LIST  worker counts to measure (default "1 2 4 ... nr cpus")
+#   PERF       perf binary (default perf)
+#   CGROOT     where to mount the memory cgroup (default /tmp/zram-bw-cg)
+
+ZRAM_MB=${ZRAM_MB:-4096}
+SIZE_MB=${SIZE_MB:-256}
+LIMIT_MB=${LIMIT_MB:-128}
+PERF=${PERF:-perf}
+CGROOT=${CGROOT:-/tmp/zram-bw-cg}
+ZRAM=/sys/block/zram0
+CG=$CGROOT/zram-bw
+
+if [ -z "$CPUS_LIST" ]; then
+	ncpus=$(grep -c ^processor /proc/cpuinfo)
+	n=1
+	while [ "$n" -lt "$ncpus" ]; do
+		CPUS_LIST="$CPUS_LIST $n"
+		n=$(( n * 2 ))
+	done
+	CPUS_LIST="$CPUS_LIST $ncpus"
+fi
+
+cleanup() {
+	swapoff /dev/zram0 >/dev/null 2>&1
+	echo 1 > "$ZRAM/reset" 2>/dev/null
+	rmdir "$CG" 2>/dev/null
+	umount "$CGROOT" 2>/dev/null
+	rmdir "$CGROOT" 2>/dev/null
+}
+
+fail() {
+	echo "zram-swap-bw: $*" >&2
+	cleanup
+	exit 1
+}
+
+pswpout() {
+	awk '$1 == "pswpout" { print $2 }' /proc/vmstat
+}
+
+trap 'cleanup; exit 1' INT TERM
+
+[ -d "$ZRAM" ] || modprobe zram num_devices=1 || fail "no zram module"
+[ -z "$(tail -n +2 /proc/swaps)" ] || fail "other swap devices are active"
+
+echo $(( ZRAM_MB * 1048576 )) > "$ZRAM/disksize" ||
+	fail "cannot set zram disksize"
+mkswap /dev/zram0 >/dev/null || fail "mkswap failed"
+swapon /dev/zram0 || fail "swapon failed"
+
+mkdir -p "$CGROOT" && mount -t cgroup -o memory none "$CGROOT" ||
+	fail "cannot mount the memory cgroup"
+mkdir "$CG" || fail "cannot create $CG"
+echo $(( LIMIT_MB * 1048576 )) > "$CG/memory.limit_in_bytes" ||
+	fail "cannot limit $CG"
+
+echo "# $(cat "$ZRAM/comp_algorithm"), ${SIZE_MB}MB per worker," \
+	"${LIMIT_MB}MB cgroup limit"
+echo "# workers  swap-out MB/s"
+
+for cpus in $CPUS_LIST; do
+	echo "$cpus" > "$ZRAM/max_comp_streams" ||
+		fail "cannot set max_comp_streams to $cpus"
+
+	out=$(pswpout)
+	start=$(date +%s.%N)
+	sh -c "echo \$\$ > $CG/tasks && exec $PERF bench -f simple \
+		mem swap -w $cpus -s ${SIZE_MB}MB -l 1" >/dev/null ||
+		fail "perf bench mem swap failed"
+	end=$(date +%s.%N)
+	out=$(( $(pswpout) - out ))
+
+	echo "$cpus $start $end" | awk -v kb=$(( out * $(getconf PAGESIZE) / 1024 )) \
+		'{ printf "%9d  %.1f\n", $1, kb / 1024 / ($3 - $2) }'
+done
+
+cleanup
+exit 0